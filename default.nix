@@ -21,6 +21,7 @@ pkgs.stdenv.mkDerivation rec {
     nss
     openssl_1_1
     zlib
+    zstd
     icu
   ];
 }
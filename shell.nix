@@ -20,5 +20,6 @@ pkgs.mkShell rec {
     pkgconfig
     python3
     zlib
+    zstd
   ];
 }
@@ -22,6 +22,8 @@
 
 #include "Crypto.h"
 
+#include <algorithm>
+#include <climits>
 #include <iostream>
 #include <math.h>
 
@@ -32,6 +34,9 @@
 #include <prrng.h>
 #include <secoid.h>
 
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
 /**
  *  \class Crypto
  *  \brief Wraps Mozilla's NSS and eases the encryption process.
@@ -56,6 +61,17 @@ void SECITEM_Free(SECItem *item)
 using PK11SlotInfoPtr = std::unique_ptr<PK11SlotInfo, decltype(&PK11_FreeSlot)>;
 using PK11SymKeyPtr   = std::unique_ptr<PK11SymKey, decltype(&PK11_FreeSymKey)>;
 using SECItemPtr      = std::unique_ptr<SECItem, decltype(&SECITEM_Free)>;
+using EVPCipherCtxPtr = std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)>;
+
+/**
+ *  \brief Wrapper for NSS::PK11_DestroyContext
+ */
+void PK11_FreeContext(PK11Context *context)
+{
+    PK11_DestroyContext(context, PR_TRUE);
+}
+
+using PK11ContextPtr = std::unique_ptr<PK11Context, decltype(&PK11_FreeContext)>;
 
 /**
  *  \brief Crypto's private data structure
@@ -86,6 +102,31 @@ struct CryptoPrivate
 
 bool CryptoPrivate::initialized = false;
 
+/**
+ *  \brief CryptoStream's private data structure
+ *
+ *  \see CryptoStream
+ */
+struct CryptoStreamPrivate
+{
+    EVPCipherCtxPtr    context = EVPCipherCtxPtr(nullptr, EVP_CIPHER_CTX_free); /*!< OpenSSL's cipher context. */
+    CryptoStream::Mode mode;                                                   /*!< Wether the stream encrypts or decrypts. */
+    std::string        tail;                                                   /*!< Last bytes fed while decrypting. They are the tag if no more data comes. */
+
+    bool cipher(const unsigned char *data, size_t size, unsigned char *output, size_t &written);
+};
+
+/**
+ *  \brief Digest's private data structure
+ *
+ *  \see Digest
+ */
+struct DigestPrivate
+{
+    PK11ContextPtr context = PK11ContextPtr(nullptr, PK11_FreeContext); /*!< NSS's digest context, kept alive between digests. */
+    unsigned int   size;                                                /*!< Size of the digest in bytes. */
+};
+
 /**
  *  \brief Generates a blob of random data.
  *
@@ -116,24 +157,140 @@ std::string Crypto::generateRandom(const uint8_t size)
  *  \return The binary digest as a std::string (not an HEX representation).
  */
 std::string Crypto::digest(const std::string &data, const CryptoParams params)
+{
+    std::string digest(digestSize(params), '\0');
+
+    auto data_c   = reinterpret_cast<const unsigned char*>(data.data());
+    auto digest_c = reinterpret_cast<unsigned char*>(&digest[0]);
+
+    digest.resize(Crypto::digest(data_c, data.size(), digest_c, digest.size(), params));
+
+    return digest;
+}
+
+/**
+ *  \brief Makes a checksum of \c size bytes of \c data using the method
+ *  choosen in \c params, writing it into \c output.
+ *
+ *  Creates a new digest context on every call. To digest many blobs or data
+ *  that arrives in slices, use a Digest object instead.
+ *
+ *  \arg \c data Data to be digested.
+ *  \arg \c size Size of \c data in bytes.
+ *  \arg \c output Where the binary digest will be written. Must hold at least
+ *  Crypto#digestSize bytes.
+ *  \arg \c outputSize Size of \c output in bytes.
+ *  \arg \c params CryptoParams containing the digest method.
+ *
+ *  \return The number of bytes written to \c output, 0 on failure.
+ *
+ *  \see Digest
+ */
+size_t Crypto::digest(const unsigned char *data, const size_t size, unsigned char *output, const size_t outputSize, const CryptoParams params)
+{
+    Digest digest(params);
+
+    digest.update(data, size);
+
+    return digest.finalize(output, outputSize);
+}
+
+/**
+ *  \brief Returns the size of the digests made with the method choosen in \c
+ *  params.
+ *
+ *  \arg \c params CryptoParams containing the digest method.
+ *
+ *  \return The size in bytes of the binary digest.
+ */
+size_t Crypto::digestSize(const CryptoParams params)
 {
     CryptoPrivate _p;
 
     _p.parseParams(params);
 
-    auto         data_c      = reinterpret_cast<const unsigned char*>(data.data());
-    unsigned int digest_size = _p.digestSize;
+    return _p.digestSize;
+}
 
-    std::unique_ptr<unsigned char> digest(new unsigned char[digest_size]);
+/**
+ *  \brief Returns how many bytes encryption adds to the clear text.
+ *
+ *  \return The size in bytes of the authentication tag.
+ */
+size_t Crypto::tagSize()
+{
+    return AES_BLOCK_SIZE;
+}
 
-    auto context = PK11_CreateDigestContext(_p.digestType);
+/**
+ *  \brief Combines the digests of the parts of a file into the digest of the
+ *  whole file, using the scheme choosen in \c params.
+ *
+ *  With FileDigestScheme#CHAINED every part digest is appended to the previous
+ *  result and digested again, so parts must be processed in order. With
+ *  FileDigestScheme#MERKLE_TREE the leaves of a binary tree are
+ *  digest(0x00 + part digest) and its nodes are digest(0x01 + left + right),
+ *  so a leaf can't pass for a node; a node without sibling is carried up
+ *  unchanged. The leaves don't depend on each other, so parts can be digested
+ *  in any order or all at once.
+ *
+ *  \arg \c partDigests The digests of the parts, in part order.
+ *  \arg \c params CryptoParams containing the digest method and scheme.
+ *
+ *  \return The binary digest of the whole file.
+ */
+std::string Crypto::fileDigest(const std::vector<std::string> &partDigests, const CryptoParams params)
+{
+    Digest digest(params);
 
-    PK11_DigestBegin(context);
-    PK11_DigestOp(context, data_c, static_cast<unsigned int>(data.size()));
-    PK11_DigestFinal(context, digest.get(), &digest_size, digest_size);
-    PK11_DestroyContext(context, PR_TRUE);
+    if (params.fileDigest == CHAINED) {
+        std::string wholeFileDigest;
+
+        for (const std::string &partDigest : partDigests) {
+            digest.update(wholeFileDigest);
+            digest.update(partDigest);
+            wholeFileDigest = digest.finalize();
+        }
+
+        return wholeFileDigest;
+    }
+
+    if (partDigests.empty()) {
+        return digest.finalize();
+    }
+
+    const unsigned char      leaf = 0x00;
+    const unsigned char      node = 0x01;
+    std::vector<std::string> level;
+
+    level.reserve(partDigests.size());
+
+    for (const std::string &partDigest : partDigests) {
+        digest.update(&leaf, 1);
+        digest.update(partDigest);
+        level.push_back(digest.finalize());
+    }
+
+    while (level.size() > 1) {
+        std::vector<std::string> next;
+
+        next.reserve((level.size() + 1) / 2);
+
+        for (size_t i = 0; i + 1 < level.size(); i += 2) {
+            digest.update(&node, 1);
+            digest.update(level[i]);
+            digest.update(level[i + 1]);
+            next.push_back(digest.finalize());
+        }
+
+        if (level.size() % 2) {
+            next.push_back(level.back());
+        }
+
+        level.swap(next);
+    }
 
-    return std::string(reinterpret_cast<const char*>(digest.get()), digest_size);
+    return level.front();
 }
 
 /**
@@ -334,6 +491,36 @@ Crypto::~Crypto() = default;
  *  \see Crypto#error
  */
 std::string Crypto::encrypt(const std::string &data)
+{
+    std::string buffer(data.size() + tagSize(), '\0');
+
+    auto clear_text = reinterpret_cast<const unsigned char*>(data.data());
+    auto cipher     = reinterpret_cast<unsigned char*>(&buffer[0]);
+
+    buffer.resize(encrypt(clear_text, data.size(), cipher, buffer.size()));
+
+    return error == Success ? buffer : "";
+}
+
+/**
+ *  \brief Encrypts \c size bytes of \c data into \c output.
+ *
+ *  Encrypts \c data using the method choosen when constructing the object,
+ *  writing the cipher text followed by the tag into caller owned memory.
+ *  Uses Crypto#error to report errors.
+ *
+ *  \arg \c data Data to be encrypted.
+ *  \arg \c size Size of \c data in bytes.
+ *  \arg \c output Where the encrypted data will be written. Must hold at least
+ *  \c size + Crypto#tagSize bytes.
+ *  \arg \c outputSize Size of \c output in bytes.
+ *
+ *  \return The number of bytes written to \c output.
+ *
+ *  \see Crypto#encrypt(const std::string&)
+ *  \see Crypto#error
+ */
+size_t Crypto::encrypt(const unsigned char *data, const size_t size, unsigned char *output, const size_t outputSize)
 {
     CK_GCM_PARAMS gcmParams;
     SECItem       param;
@@ -347,21 +534,24 @@ std::string Crypto::encrypt(const std::string &data)
     gcmParams.ulAADLen  = 0;
     gcmParams.ulTagBits = AES_BLOCK_SIZE * 8;
 
-    unsigned int                   len = static_cast<unsigned int>(data.size() + 2 * _p->IV->len);
-    std::unique_ptr<unsigned char> buffer(new unsigned char[len]);
+    unsigned int len    = 0;
+    unsigned int maxLen = static_cast<unsigned int>(std::min<size_t>(outputSize, UINT_MAX));
 
-    auto clear_text = reinterpret_cast<const unsigned char*>(data.data());
+    if ((outputSize < size + tagSize()) || (size > UINT_MAX - tagSize())) {
+        error = CantEncrypt;
+        return 0;
+    }
 
-    SECStatus s = PK11_Encrypt(_p->SymKey.get(), _p->cypherMechanism, &param, buffer.get(), &len, len, clear_text, static_cast<unsigned int>(data.size()));
+    SECStatus s = PK11_Encrypt(_p->SymKey.get(), _p->cypherMechanism, &param, output, &len, maxLen, data, static_cast<unsigned int>(size));
 
     if (s != SECSuccess) {
         error = CantEncrypt;
-        return "";
+        return 0;
     }
 
     error = Success;
 
-    return std::string(reinterpret_cast<const char*>(buffer.get()), len);
+    return len;
 }
 
 /**
@@ -380,6 +570,36 @@ std::string Crypto::encrypt(const std::string &data)
  *  \see Crypto#error
  */
 std::string Crypto::decrypt(const std::string &data)
+{
+    std::string buffer(data.size(), '\0');
+
+    auto cipher     = reinterpret_cast<const unsigned char*>(data.data());
+    auto clear_text = reinterpret_cast<unsigned char*>(&buffer[0]);
+
+    buffer.resize(decrypt(cipher, data.size(), clear_text, buffer.size()));
+
+    return error == Success ? buffer : "";
+}
+
+/**
+ *  \brief Decrypts \c size bytes of \c data into \c output.
+ *
+ *  Decrypts \c data using the method choosen when constructing the object,
+ *  writing the clear text into caller owned memory.
+ *  Uses Crypto#error to report errors.
+ *
+ *  \arg \c data Data to be decrypted, including the tag.
+ *  \arg \c size Size of \c data in bytes.
+ *  \arg \c output Where the decrypted data will be written. Must hold at least
+ *  \c size - Crypto#tagSize bytes.
+ *  \arg \c outputSize Size of \c output in bytes.
+ *
+ *  \return The number of bytes written to \c output.
+ *
+ *  \see Crypto#decrypt(const std::string&)
+ *  \see Crypto#error
+ */
+size_t Crypto::decrypt(const unsigned char *data, const size_t size, unsigned char *output, const size_t outputSize)
 {
     CK_GCM_PARAMS gcmParams;
     SECItem       param;
@@ -393,21 +613,24 @@ std::string Crypto::decrypt(const std::string &data)
     gcmParams.ulAADLen  = 0;
     gcmParams.ulTagBits = AES_BLOCK_SIZE * 8;
 
-    unsigned int                   len = static_cast<unsigned int>(data.size() + 2 * _p->IV->len);
-    std::unique_ptr<unsigned char> buffer(new unsigned char[len]);
+    unsigned int len    = 0;
+    unsigned int maxLen = static_cast<unsigned int>(std::min<size_t>(outputSize, UINT_MAX));
 
-    auto cipher = reinterpret_cast<const unsigned char*>(data.data());
+    if ((size < tagSize()) || (size > UINT_MAX) || (outputSize < size - tagSize())) {
+        error = CantDecrypt;
+        return 0;
+    }
 
-    SECStatus s = PK11_Decrypt(_p->SymKey.get(), _p->cypherMechanism, &param, buffer.get(), &len, len, cipher, static_cast<unsigned int>(data.size()));
+    SECStatus s = PK11_Decrypt(_p->SymKey.get(), _p->cypherMechanism, &param, output, &len, maxLen, data, static_cast<unsigned int>(size));
 
     if (s != SECSuccess) {
         error = CantDecrypt;
-        return "";
+        return 0;
     }
 
     error = Success;
 
-    return std::string(reinterpret_cast<const char*>(buffer.get()), len);
+    return len;
 }
 
 /**
@@ -467,12 +690,12 @@ void CryptoPrivate::parseParams(const CryptoParams params)
     switch (params.digest) {
         case SHA256:
             digestType = SEC_OID_SHA256;
-            digestSize = SHA256_BLOCK_LENGTH;
+            digestSize = SHA256_LENGTH;
             break;
 
         case SHA512:
             digestType = SEC_OID_SHA512;
-            digestSize = SHA512_BLOCK_LENGTH;
+            digestSize = SHA512_LENGTH;
             break;
     }
 
@@ -518,3 +741,402 @@ SECItemPtr CryptoPrivate::stringToSECItemPtr(std::string str)
 
     return secItem;
 }
+
+/**
+ *  \class CryptoStream
+ *  \brief Encrypts/decrypts data that arrives in slices.
+ *
+ *  Produces exactly the same output as Crypto#encrypt and accepts exactly the
+ *  same input as Crypto#decrypt, but the data can be fed in slices of any size
+ *  through CryptoStream#update, so a whole file part never needs to be in
+ *  memory at once. CryptoStream#final finishes the operation, returning the
+ *  tag when encrypting or checking it when decrypting.
+ *
+ *  NSS's softoken refuses to create multi-part contexts for CKM_AES_GCM, so the
+ *  stream is carried by OpenSSL's EVP interface, using the key and IV of the
+ *  Crypto object it was created from.
+ *
+ *  While decrypting, the returned clear text is not authenticated until
+ *  CryptoStream#final succeeds.
+ *
+ *  \see Crypto
+ */
+
+/**
+ *  \brief Creates a stream using the key and IV of \c crypto.
+ *
+ *  Uses CryptoStream#error to report errors.
+ *
+ *  \arg \c crypto The Crypto object holding the key and the IV.
+ *  \arg \c mode Wether the stream will encrypt or decrypt.
+ */
+CryptoStream::CryptoStream(const Crypto &crypto, const Mode mode)
+{
+    _p.reset(new CryptoStreamPrivate);
+    _p->mode = mode;
+
+    Crypto::CryptoError failure = mode == Encrypt ? Crypto::CantEncrypt : Crypto::CantDecrypt;
+
+    if (crypto.error != Crypto::Success) {
+        error = crypto.error;
+        return;
+    }
+
+    std::string       key    = crypto.key();
+    std::string       iv     = crypto.iv();
+    const EVP_CIPHER *cipher = nullptr;
+
+    switch (key.size()) {
+        case AES_128_KEY_LENGTH:
+            cipher = EVP_aes_128_gcm();
+            break;
+
+        case AES_192_KEY_LENGTH:
+            cipher = EVP_aes_192_gcm();
+            break;
+
+        case AES_256_KEY_LENGTH:
+            cipher = EVP_aes_256_gcm();
+            break;
+    }
+
+    _p->context.reset(EVP_CIPHER_CTX_new());
+
+    auto key_c = reinterpret_cast<const unsigned char*>(key.data());
+    auto iv_c  = reinterpret_cast<const unsigned char*>(iv.data());
+    int  ok    = cipher != nullptr && _p->context != nullptr;
+
+    if (ok && (mode == Encrypt)) {
+        ok = EVP_EncryptInit_ex(_p->context.get(), cipher, nullptr, nullptr, nullptr)
+             && EVP_CIPHER_CTX_ctrl(_p->context.get(), EVP_CTRL_GCM_SET_IVLEN, static_cast<int>(iv.size()), nullptr)
+             && EVP_EncryptInit_ex(_p->context.get(), nullptr, nullptr, key_c, iv_c);
+    } else if (ok) {
+        ok = EVP_DecryptInit_ex(_p->context.get(), cipher, nullptr, nullptr, nullptr)
+             && EVP_CIPHER_CTX_ctrl(_p->context.get(), EVP_CTRL_GCM_SET_IVLEN, static_cast<int>(iv.size()), nullptr)
+             && EVP_DecryptInit_ex(_p->context.get(), nullptr, nullptr, key_c, iv_c);
+    }
+
+    OPENSSL_cleanse(&key[0], key.size());
+
+    error = ok ? Crypto::Success : failure;
+}
+
+/**
+ *  \brief Default destructor.
+ */
+CryptoStream::~CryptoStream() = default;
+
+/**
+ *  \brief Feeds the next slice of \c data into the stream.
+ *
+ *  When decrypting, the last bytes fed are held back until more data arrives,
+ *  as they may be the tag. The returned clear text is not authenticated until
+ *  CryptoStream#final succeeds.
+ *  Uses CryptoStream#error to report errors.
+ *
+ *  \arg \c data The next slice of clear text (encryption) or cipher text
+ *  (decryption).
+ *
+ *  \return The processed slice, which might be shorter than \c data.
+ *
+ *  \see CryptoStream#final
+ */
+std::string CryptoStream::update(const std::string &data)
+{
+    std::string output(data.size(), '\0');
+
+    auto data_c   = reinterpret_cast<const unsigned char*>(data.data());
+    auto output_c = reinterpret_cast<unsigned char*>(&output[0]);
+
+    output.resize(update(data_c, data.size(), output_c, output.size()));
+
+    return output;
+}
+
+/**
+ *  \brief Finishes the stream.
+ *
+ *  When encrypting, returns the tag that must follow the cipher text. When
+ *  decrypting, checks the tag (the last bytes fed) and returns an empty string;
+ *  CryptoStream#error is set to Crypto#CantDecrypt if the data was tampered.
+ *
+ *  \return The tag when encrypting, an empty string otherwise.
+ *
+ *  \see CryptoStream#update
+ */
+std::string CryptoStream::final()
+{
+    std::string output(Crypto::tagSize(), '\0');
+
+    output.resize(final(reinterpret_cast<unsigned char*>(&output[0]), output.size()));
+
+    return output;
+}
+
+/**
+ *  \brief Feeds the next \c size bytes of \c data into the stream, writing
+ *  the processed slice into \c output.
+ *
+ *  \arg \c data The next slice of clear text (encryption) or cipher text
+ *  (decryption).
+ *  \arg \c size Size of \c data in bytes.
+ *  \arg \c output Where the processed slice will be written. Must hold at
+ *  least \c size bytes.
+ *  \arg \c outputSize Size of \c output in bytes.
+ *
+ *  \return The number of bytes written to \c output.
+ *
+ *  \see CryptoStream#update(const std::string&)
+ */
+size_t CryptoStream::update(const unsigned char *data, const size_t size, unsigned char *output, const size_t outputSize)
+{
+    size_t written = 0;
+
+    if (error != Crypto::Success) {
+        return written;
+    }
+
+    if (_p->mode == Encrypt) {
+        if ((outputSize < size) || !_p->cipher(data, size, output, written)) {
+            error = Crypto::CantEncrypt;
+            return 0;
+        }
+
+        return written;
+    }
+
+    size_t total = _p->tail.size() + size;
+
+    if (total <= AES_BLOCK_SIZE) {
+        _p->tail.append(reinterpret_cast<const char*>(data), size);
+        return written;
+    }
+
+    size_t      length   = total - AES_BLOCK_SIZE;
+    size_t      fromTail = std::min(length, _p->tail.size());
+    size_t      fromData = std::min(size, static_cast<size_t>(AES_BLOCK_SIZE));
+    std::string tail     = _p->tail.substr(fromTail);
+
+    tail.append(reinterpret_cast<const char*>(data + size - fromData), fromData);
+
+    size_t fromTailWritten = 0;
+    bool   ok              = outputSize >= length
+                             && _p->cipher(reinterpret_cast<const unsigned char*>(_p->tail.data()), fromTail, output, fromTailWritten)
+                             && _p->cipher(data, length - fromTail, output + fromTailWritten, written);
+
+    _p->tail = tail.substr(tail.size() - AES_BLOCK_SIZE);
+
+    if (!ok) {
+        error = Crypto::CantDecrypt;
+        return 0;
+    }
+
+    return fromTailWritten + written;
+}
+
+/**
+ *  \brief Finishes the stream, writing the tag into \c output when encrypting.
+ *
+ *  \arg \c output Where the tag will be written. Must hold at least
+ *  Crypto#tagSize bytes when encrypting.
+ *  \arg \c outputSize Size of \c output in bytes.
+ *
+ *  \return The number of bytes written to \c output.
+ *
+ *  \see CryptoStream#final()
+ */
+size_t CryptoStream::final(unsigned char *output, const size_t outputSize)
+{
+    if (error != Crypto::Success) {
+        return 0;
+    }
+
+    unsigned char buffer[AES_BLOCK_SIZE];
+    int           len = 0;
+
+    if (_p->mode == Encrypt) {
+        if ((outputSize < AES_BLOCK_SIZE)
+            || !EVP_EncryptFinal_ex(_p->context.get(), buffer, &len)
+            || !EVP_CIPHER_CTX_ctrl(_p->context.get(), EVP_CTRL_GCM_GET_TAG, AES_BLOCK_SIZE, output)) {
+            error = Crypto::CantEncrypt;
+            return 0;
+        }
+
+        return AES_BLOCK_SIZE;
+    }
+
+    if ((_p->tail.size() != AES_BLOCK_SIZE)
+        || !EVP_CIPHER_CTX_ctrl(_p->context.get(), EVP_CTRL_GCM_SET_TAG, AES_BLOCK_SIZE, &_p->tail[0])
+        || (EVP_DecryptFinal_ex(_p->context.get(), buffer, &len) <= 0)) {
+        error = Crypto::CantDecrypt;
+    }
+
+    return 0;
+}
+
+/**
+ *  \brief Runs \c size bytes of \c data through the cipher context, writing
+ *  the result into \c output.
+ *
+ *  \arg \c data The data to be processed.
+ *  \arg \c size How many bytes of \c data to process.
+ *  \arg \c output Where the processed data is written.
+ *  \arg \c written Set to the number of bytes written to \c output.
+ *
+ *  \return Wether the operation succeeded.
+ */
+bool CryptoStreamPrivate::cipher(const unsigned char *data, size_t size, unsigned char *output, size_t &written)
+{
+    const size_t chunkSize = 1 << 30;
+
+    written = 0;
+
+    while (size > 0) {
+        int    len   = 0;
+        size_t chunk = std::min(size, chunkSize);
+        int    ok    = mode == CryptoStream::Encrypt
+                       ? EVP_EncryptUpdate(context.get(), output + written, &len, data, static_cast<int>(chunk))
+                       : EVP_DecryptUpdate(context.get(), output + written, &len, data, static_cast<int>(chunk));
+
+        if (!ok) {
+            return false;
+        }
+
+        written += static_cast<size_t>(len);
+        data    += chunk;
+        size    -= chunk;
+    }
+
+    return true;
+}
+
+/**
+ *  \class Digest
+ *  \brief Incremental checksum with a long lived NSS context.
+ *
+ *  Crypto#digest creates and destroys a digest context on every call. A Digest
+ *  object keeps its context alive, can be fed data in slices as it arrives
+ *  through Digest#update and is ready for the next checksum as soon as
+ *  Digest#finalize returns.
+ *
+ *  \see Crypto#digest
+ */
+
+/**
+ *  \brief Creates a digest context using the method choosen in \c params.
+ *
+ *  Uses Digest#error to report errors.
+ *
+ *  \arg \c params CryptoParams containing the digest method.
+ */
+Digest::Digest(const CryptoParams params)
+{
+    CryptoPrivate cp;
+
+    cp.parseParams(params);
+    CryptoPrivate::initNSS();
+
+    _p.reset(new DigestPrivate);
+    _p->size = cp.digestSize;
+    _p->context.reset(PK11_CreateDigestContext(cp.digestType));
+
+    error = Crypto::Success;
+
+    reset();
+}
+
+/**
+ *  \brief Default destructor.
+ */
+Digest::~Digest() = default;
+
+/**
+ *  \brief Feeds \c data into the checksum.
+ *
+ *  \arg \c data The next slice of data to be digested.
+ */
+void Digest::update(const std::string &data)
+{
+    update(reinterpret_cast<const unsigned char*>(data.data()), data.size());
+}
+
+/**
+ *  \brief Feeds \c size bytes of \c data into the checksum.
+ *
+ *  Uses Digest#error to report errors.
+ *
+ *  \arg \c data The next slice of data to be digested.
+ *  \arg \c size Size of \c data in bytes.
+ */
+void Digest::update(const unsigned char *data, const size_t size)
+{
+    for (size_t offset = 0; (error == Crypto::Success) && (offset < size); offset += UINT_MAX) {
+        auto len = static_cast<unsigned int>(std::min<size_t>(size - offset, UINT_MAX));
+
+        if (PK11_DigestOp(_p->context.get(), data + offset, len) != SECSuccess) {
+            error = Crypto::CantDigest;
+        }
+    }
+}
+
+/**
+ *  \brief Finishes the checksum and resets the object for the next one.
+ *
+ *  \return The binary digest as a std::string (not an HEX representation).
+ */
+std::string Digest::finalize()
+{
+    std::string digest(_p->size, '\0');
+
+    digest.resize(finalize(reinterpret_cast<unsigned char*>(&digest[0]), digest.size()));
+
+    return digest;
+}
+
+/**
+ *  \brief Finishes the checksum, writing it into \c output, and resets the
+ *  object for the next one.
+ *
+ *  Uses Digest#error to report errors.
+ *
+ *  \arg \c output Where the binary digest will be written. Must hold at least
+ *  Crypto#digestSize bytes.
+ *  \arg \c outputSize Size of \c output in bytes.
+ *
+ *  \return The number of bytes written to \c output, 0 on failure.
+ */
+size_t Digest::finalize(unsigned char *output, const size_t outputSize)
+{
+    unsigned int size = 0;
+
+    if ((error == Crypto::Success) && (outputSize >= _p->size)) {
+        if (PK11_DigestFinal(_p->context.get(), output, &size, _p->size) != SECSuccess) {
+            size = 0;
+        }
+    }
+
+    bool failed = (error != Crypto::Success) || (size == 0);
+
+    reset();
+
+    if (failed) {
+        error = Crypto::CantDigest;
+    }
+
+    return size;
+}
+
+/**
+ *  \brief Discards any data fed so far and starts a new checksum.
+ *
+ *  Uses Digest#error to report errors.
+ */
+void Digest::reset()
+{
+    if ((_p->context == nullptr) || (PK11_DigestBegin(_p->context.get()) != SECSuccess)) {
+        error = Crypto::CantDigest;
+        return;
+    }
+
+    error = Crypto::Success;
+}
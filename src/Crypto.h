@@ -25,11 +25,14 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 #include <stdint.h>
 
 /*! \file */
 
 struct CryptoPrivate;
+struct CryptoStreamPrivate;
+struct DigestPrivate;
 
 /**
  *  \brief Type of encryption.
@@ -62,6 +65,15 @@ enum KeyDerivationHash : uint8_t {
     HMAC_SHA512  /*!< HMAC + SHA512 */
 };
 
+/**
+ *  \brief How the digests of the parts of a file are combined into the digest
+ *  of the whole file.
+ */
+enum FileDigestScheme : uint8_t {
+    CHAINED,    /*!< digest(previous + part digest), strictly in part order. */
+    MERKLE_TREE /*!< Binary hash tree over the part digests. */
+};
+
 /**
  *  \brief Parameters for Crypto operation.
  *
@@ -75,6 +87,7 @@ struct CryptoParams
     KeyDerivationFunction keyDerivationFunction = PKCS5_PBKDF2; /*!< \see KeyDerivationFunction */
     KeyDerivationHash     keyDerivationHash     = HMAC_SHA512;  /*!< \see KeyDerivationHash */
     uint32_t              keyDerivationCost     = 250000;       /*!< How many iterations the derivation function will use. */
+    FileDigestScheme      fileDigest            = MERKLE_TREE;  /*!< \see FileDigestScheme */
 };
 
 struct Crypto
@@ -88,7 +101,8 @@ struct Crypto
         CantGetSlot,     /*!< NSS error. Could not get a slot. */
         CantGenerateKey, /*!< NSS error. Could not generate a key. */
         CantEncrypt,     /*!< NSS error. Could not encrypt. */
-        CantDecrypt      /*!< NSS error. Could not decrypt. */
+        CantDecrypt,     /*!< NSS error. Could not decrypt. */
+        CantDigest       /*!< NSS error. Could not digest. */
     }
 
     /**
@@ -98,6 +112,10 @@ struct Crypto
 
     static std::string generateRandom(const uint8_t size);
     static std::string digest( const std::string &data, CryptoParams params = CryptoParams() );
+    static size_t digest( const unsigned char *data, const size_t size, unsigned char *output, const size_t outputSize, CryptoParams params = CryptoParams() );
+    static size_t digestSize( CryptoParams params = CryptoParams() );
+    static size_t tagSize();
+    static std::string fileDigest( const std::vector<std::string> &partDigests, CryptoParams params = CryptoParams() );
     static std::string stringToHex(const std::string &input, const std::string separator = ":");
     static std::string toBase64(const std::string &data);
     static std::string fromBase64(const std::string &data);
@@ -108,6 +126,8 @@ struct Crypto
 
     std::string encrypt(const std::string &data);
     std::string decrypt(const std::string &data);
+    size_t      encrypt(const unsigned char *data, const size_t size, unsigned char *output, const size_t outputSize);
+    size_t      decrypt(const unsigned char *data, const size_t size, unsigned char *output, const size_t outputSize);
 
     std::string key() const;
     std::string iv() const;
@@ -116,4 +136,51 @@ private:
     std::unique_ptr<CryptoPrivate> _p;
 };
 
+struct CryptoStream
+{
+    /**
+     *  \brief Direction of the stream.
+     */
+    enum Mode : uint8_t {
+        Encrypt, /*!< Turns clear text into cipher text followed by the tag. */
+        Decrypt  /*!< Turns cipher text followed by the tag into clear text. */
+    };
+
+    /**
+     *  \brief Errors returned by CryptoStream
+     */
+    Crypto::CryptoError error;
+
+    CryptoStream(const Crypto &crypto, const Mode mode);
+    ~CryptoStream();
+
+    std::string update(const std::string &data);
+    std::string final();
+    size_t      update(const unsigned char *data, const size_t size, unsigned char *output, const size_t outputSize);
+    size_t      final(unsigned char *output, const size_t outputSize);
+
+private:
+    std::unique_ptr<CryptoStreamPrivate> _p;
+};
+
+struct Digest
+{
+    /**
+     *  \brief Errors returned by Digest
+     */
+    Crypto::CryptoError error;
+
+    Digest( const CryptoParams params = CryptoParams() );
+    ~Digest();
+
+    void        update(const std::string &data);
+    void        update(const unsigned char *data, const size_t size);
+    std::string finalize();
+    size_t      finalize(unsigned char *output, const size_t outputSize);
+    void        reset();
+
+private:
+    std::unique_ptr<DigestPrivate> _p;
+};
+
 #endif
@@ -24,10 +24,12 @@
 
 #include <QBuffer>
 #include <QImage>
+#include <QImageReader>
 #include <QWebEngineUrlRequestJob>
 
 #include "Runner.h"
 #include "Store.h"
+#include "StoreFileDevice.h"
 
 struct SchemeHandlerPrivate
 {
@@ -52,26 +54,32 @@ void SchemeHandler::requestStarted(QWebEngineUrlRequestJob *job)
         return;
     }
 
-    QString scheme  = job->requestUrl().scheme();
-    QString mime    = _p->store->fileMetadata(path, "mimetype");
-    QBuffer *buffer = new QBuffer;
-    QByteArray data(_p->store->decryptFile(path) );
+    QString         scheme  = job->requestUrl().scheme();
+    QString         mime    = _p->store->fileMetadata(path, "mimetype");
+    StoreFileDevice *device = _p->store->open(path);
 
-    buffer->open(QIODevice::ReadWrite);
-    connect(job, &QObject::destroyed, buffer, &QObject::deleteLater);
-
-    if ( _p->store->error != Store::Success ) {
+    if ( (device == nullptr) || !device->open(QIODevice::ReadOnly) ) {
+        delete device;
         job->fail(QWebEngineUrlRequestJob::RequestFailed);
         return;
-    } else if ( scheme == "thumb" ) {
-        QImage image = QImage::fromData(data);
-        image        = image.scaledToWidth(200, Qt::SmoothTransformation);
-        image.save(buffer, "PNG");
-    } else {
-        buffer->write(data);
     }
 
-    buffer->seek(0);
+    connect(job, &QObject::destroyed, device, &QObject::deleteLater);
+
+    if ( scheme == "thumb" ) {
+        QBuffer *buffer = new QBuffer(device);
+        QImage image    = QImageReader(device).read();
+        image           = image.scaledToWidth(200, Qt::SmoothTransformation);
+
+        buffer->open(QIODevice::ReadWrite);
+        image.save(buffer, "PNG");
+        buffer->seek(0);
+
+        job->reply("image/png", buffer);
+        return;
+    }
 
-    job->reply(scheme == "thumb" ? "image/png" : mime.toUtf8(), buffer);
+    // The device decrypts lazily, so the page gets the first bytes as soon as
+    // the first part is decrypted.
+    job->reply(mime.toUtf8(), device);
 }
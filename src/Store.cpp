@@ -22,16 +22,28 @@
 
 #include "Store.h"
 
+#include <atomic>
 #include <iostream>
 
 #include <QDataStream>
 #include <QDir>
 #include <QFile>
+#include <QMap>
 #include <QMimeDatabase>
+#include <QMutex>
+#include <QRegularExpression>
+#include <QSaveFile>
+#include <QSet>
+#include <QThreadPool>
+#include <QWaitCondition>
+
+#include "Runner.h"
 
 #include "StoreFile.h"
 #include "StoreFS.h"
 
+#define JOURNAL_MIN_COMPACT_SIZE 1048576
+
 /*!
  *  \class Store
  *  \brief Manages encrypted files in a "store".
@@ -49,6 +61,20 @@
  *  it's real size. The names are a SHA512 sum of the unencrypted file's content
  *  and a random salt (per file), making it pretty much random itself.
  *
+ *  The index is split in segments, one per top-level directory plus one for
+ *  the files at the root (see StoreFS#segment). Each segment is compressed
+ *  and encrypted under its own nonce in a Store.<id>.index file, and
+ *  Store.void only lists them. Segments are read the first time something
+ *  inside them is accessed.
+ *
+ *  Changes are not written to the index directly. Each one appends the new
+ *  state of the files it touched to Store.journal, encrypted with the store
+ *  key under a random nonce. The journal is replayed when the store is
+ *  opened, and compacted in the background once it grows larger than the
+ *  last Store.void, rewriting only the segments it touched. Records hold the
+ *  whole state of a file, so replaying one twice is harmless, which makes
+ *  compaction crash safe.
+ *
  */
 
 /**
@@ -56,12 +82,63 @@
  */
 struct StorePrivate
 {
-    QString                    path;        /*!< Path to the Store directory in the file system. */
-    std::unique_ptr<Crypto>    storeCrypto; /*!< Crypto object used to encrypt/decrypt the Store. */
-    std::unique_ptr<StoreFile> storeFile;   /*!< StoreFile object of this Store. */
-    std::unique_ptr<StoreFS>   storeFS;     /*!< StoreFS object of this Store. */
+    /**
+     *  \brief Kinds of journal records.
+     */
+    enum JournalOp : quint8 {
+        Put,    /*!< The record of a file, as serialized by StoreFS#serializeFile. */
+        Forget, /*!< The path of a file that no longer exists. */
+        MoveDir /*!< The old and the new path of a directory moved by StoreFS#moveDir. */
+    };
+
+    QString                    path;                 /*!< Path to the Store directory in the file system. */
+    std::unique_ptr<Crypto>    storeCrypto;          /*!< Crypto object used to encrypt/decrypt the Store. */
+    std::unique_ptr<StoreFile> storeFile;            /*!< StoreFile object of this Store. */
+    std::unique_ptr<StoreFS>   storeFS;              /*!< StoreFS object of this Store. */
+    std::unique_ptr<QFile>     journalFile;          /*!< Store.journal, opened for appending. */
+    std::atomic<qint64>        snapshotSize{0};      /*!< Bytes written by the last compaction. */
+    QMap<QString, QString>     shards;               /*!< File of each segment of the index, by segment name. */
+    QSet<QString>              dirtyShards;          /*!< Segments changed since the last compaction. */
+    QSet<QString>              compacting;           /*!< Segments written by the last compaction. */
+    QStringList                retiredShards;        /*!< Files of replaced segments, removed once Store.void no longer lists them. */
+    std::atomic<bool>          compactFailed{false}; /*!< Whether the last compaction failed to write them. */
+
+    int                        batchDepth = 0;       /*!< Nesting level of Store#beginBatch. */
+    QStringList                batchPaths;           /*!< Paths changed by the batch, journaled on commit. */
+    QMap<QString, QByteArray>  batchBefore;          /*!< Records of the paths before the batch changed them. Empty if they didn't exist. */
+    QSet<QString>              batchParts;           /*!< Parts referenced by StorePrivate#batchBefore. Never removed by a rollback. */
+    QStringList                batchRemoved;         /*!< Parts of files removed by the batch, deleted on commit. */
+    QMutex                     batchMutex;           /*!< Guards the batch state. Store#addFile also runs on pool threads. */
+    QMutex                     pendingMutex;         /*!< Guards the pending records and the flags of StorePrivate#writer. */
+    QWaitCondition             wakeUp;               /*!< Wakes StorePrivate#writer before the delay passes. */
+    QMap<QString, QByteArray>  pending;              /*!< Latest record of each changed path not yet journaled. Empty if it no longer exists. */
+    bool                       scheduled = false;    /*!< Whether StorePrivate#writer will journal StorePrivate#pending. */
+    bool                       flushing = false;     /*!< Whether StorePrivate#writer should journal without waiting. */
+    int                        persistDelay = 0;     /*!< Milliseconds changes wait before being journaled. 0 journals right away. */
+    std::atomic<qint64>        journalSize{0};       /*!< Size of Store.journal after the last write. */
+    QThreadPool                writer;               /*!< Journals changes in the background. */
+    QThreadPool                compactor;            /*!< Compacts the journal into Store.void. Must be destroyed first. */
 
     void save();
+    bool saveSnapshot(const QByteArray &snapshot);
+    QByteArray manifest() const;
+    QByteArray sealShard(const QByteArray &segment) const;
+    QByteArray openShard(const QString fileName) const;
+    void       dirtyAll();
+    void touch(const QStringList &paths);
+    void record(const QStringList &paths);
+    void removeFile(const QString path);
+    void moveDir(const QString oldPath, const QString newPath);
+    void journal(const QStringList &paths);
+    void journalMove(const QString from, const QString to);
+    void persist();
+    void flush();
+    bool replay(const QString journalPath);
+    void openJournal();
+    void compact();
+
+    QByteArray  encode(const JournalOp op, const QByteArray &payload) const;
+    QStringList filesIn(const QString dir) const;
     Store::StoreError storeFSErrorToStoreError(StoreFS::StoreFSError);
 };
 
@@ -79,6 +156,8 @@ Store::Store(const QString path, const QString password, const bool create) : QO
     _p.reset(new StorePrivate);
     _p->storeFS.reset(new StoreFS(path));
     _p->path = path;
+    _p->writer.setMaxThreadCount(1);
+    _p->compactor.setMaxThreadCount(1);
 
     error = StoreError::Success;
 
@@ -101,8 +180,13 @@ Store::Store(const QString path, const QString password, const bool create) : QO
         _p->storeFile.reset(new StoreFile(path + "/Store.void"));
         _p->storeFile->setSalt(salt);
         _p->storeFile->setIV(iv);
+        _p->storeFile->setCodec(ZSTD);
         _p->storeFile->setCryptoParams(CryptoParams());
         _p->save();
+
+        QFile::remove(path + "/Store.journal");
+        QFile::remove(path + "/Store.journal.old");
+        _p->openJournal();
     } else if (storeExists) {
         _p->storeFile.reset(new StoreFile(path + "/Store.void"));
 
@@ -126,18 +210,83 @@ Store::Store(const QString path, const QString password, const bool create) : QO
         std::string data = _p->storeFile->data().toStdString();
         _p->storeFile->setData(QByteArray());
 
-        data = _p->storeCrypto->decrypt(data);
+        // From version 4 on, each save is sealed like a segment, under a
+        // nonce of its own. Older files are encrypted with the IV of the
+        // header.
+        if (_p->storeFile->version() >= 4) {
+            if (data.size() < 16) {
+                error = CantOpenStoreFile;
+                return;
+            }
 
-        if (_p->storeCrypto->error != Crypto::Success) {
-            error       = CantCreateCryptoObject;
-            cryptoError = _p->storeCrypto->error;
-            return;
+            Crypto c(_p->storeCrypto->key(), data.substr(0, 16));
+
+            data = c.decrypt(data.substr(16));
+
+            if (c.error != Crypto::Success) {
+                error       = CantCreateCryptoObject;
+                cryptoError = c.error;
+                return;
+            }
+        } else {
+            data = _p->storeCrypto->decrypt(data);
+
+            if (_p->storeCrypto->error != Crypto::Success) {
+                error       = CantCreateCryptoObject;
+                cryptoError = _p->storeCrypto->error;
+                return;
+            }
         }
 
-        data = qUncompress(reinterpret_cast<const unsigned char*>(data.data()), static_cast<int>(data.size())).toStdString();
-        QByteArray bdata = QByteArray::fromStdString(data);
+        _p->snapshotSize = static_cast<qint64>(data.size());
+
+        QByteArray bdata = StoreFile::uncompress(QByteArray::fromStdString(data), _p->storeFile->codec());
         data.clear();
-        _p->storeFS->load(bdata);
+
+        // Before version 4, Store.void held the whole index. It's split in
+        // segments on the next compaction.
+        if (_p->storeFile->version() < 4) {
+            _p->storeFS->load(bdata);
+            _p->dirtyAll();
+        } else {
+            QDataStream stream(bdata);
+
+            stream.setVersion(QDataStream::Qt_5_6);
+            stream >> _p->shards;
+
+            // Pending segments are never rewritten, so a copy of their files
+            // can be read from any thread.
+            QMap<QString, QString> files = _p->shards;
+
+            _p->storeFS->setSegments(files.keys(), [this, files](const QString name) {
+                return _p->openShard(files[name]);
+            });
+
+            // Files written by an interrupted compaction, or replaced by one
+            // that wasn't cleaned up, aren't listed.
+            QSet<QString> listed = QSet<QString>::fromList(files.values());
+
+            for (QString fileName : QDir(path).entryList(QStringList() << "Store.*.index")) {
+                if (!listed.contains(fileName)) {
+                    QFile::remove(path + "/" + fileName);
+                }
+            }
+        }
+
+        // Stores from before the codec was recorded move to the default one.
+        if (_p->storeFile->version() < 3) {
+            _p->storeFile->setCodec(ZSTD);
+        }
+
+        // A journal rotated by an interrupted compaction is replayed first.
+        bool interrupted = _p->replay(path + "/Store.journal.old");
+
+        _p->replay(path + "/Store.journal");
+        _p->openJournal();
+
+        if (interrupted) {
+            _p->compact();
+        }
     } else {
         error = DoesntExistAndCreationIsNotPermitted;
         return;
@@ -148,7 +297,7 @@ Store::Store(const QString path, const QString password, const bool create) : QO
  *  \brief Adds a file to the store.
  *
  *  Encrypts and adds \c data as a file named \c storePath to the store.
- *  Store.void is saved with the new file information in case of success.
+ *  The new file information is journaled in case of success.
  *  Errors are reported through Store#error.
  *
  *  \arg \c storePath The path inside the store. Example: "/path/to/file.txt". Leading '/' is necessary.
@@ -161,6 +310,7 @@ Store::Store(const QString path, const QString password, const bool create) : QO
  */
 void Store::addFileFromData(const QString storePath, const QByteArray data)
 {
+    _p->touch(QStringList() << storePath);
     _p->storeFS->addFile(storePath, data);
 
     if (_p->storeFS->error == StoreFS::Success) {
@@ -168,7 +318,7 @@ void Store::addFileFromData(const QString storePath, const QByteArray data)
         QMimeType     mimetype = mimedb.mimeTypeForData(data);
         _p->storeFS->file(storePath)->metadata[QStringLiteral("mimetype")] = mimetype.name().toUtf8();
 
-        _p->save();
+        _p->record(QStringList() << storePath);
     }
 
     error = _p->storeFSErrorToStoreError(_p->storeFS->error);
@@ -178,7 +328,7 @@ void Store::addFileFromData(const QString storePath, const QByteArray data)
  *  \brief Adds a file to the store.
  *
  *  Encrypts and adds \c filePath as a file named \c storePath to the store.
- *  Store.void is saved with the new file information in case of success.
+ *  The new file information is journaled in case of success.
  *  Errors are reported through Store#error.
  *
  *  \arg \c filePath Path of the file to be encrypted. No size limit.
@@ -191,6 +341,7 @@ void Store::addFileFromData(const QString storePath, const QByteArray data)
  */
 void Store::addFile(const QString filePath, const QString storePath)
 {
+    _p->touch(QStringList() << storePath);
     _p->storeFS->addFile(filePath, storePath);
 
     if (_p->storeFS->error == StoreFS::Success) {
@@ -198,7 +349,7 @@ void Store::addFile(const QString filePath, const QString storePath)
         QMimeType     mimetype = mimedb.mimeTypeForFile(filePath);
         _p->storeFS->file(storePath)->metadata[QStringLiteral("mimetype")] = mimetype.name().toUtf8();
 
-        _p->save();
+        _p->record(QStringList() << storePath);
     }
 
     error = _p->storeFSErrorToStoreError(_p->storeFS->error);
@@ -232,7 +383,8 @@ QByteArray Store::decryptFile(const QString path)
 /**
  *  \brief Decrypts the file in \c storePath into \c path.
  *
- *  Decrypts the file in \c storePath into \c path.
+ *  Decrypts the file in \c storePath into \c path. Files of any size can
+ *  be decrypted this way. Progress is reported through Store#decryptProgress.
  *  Errors are reported through Store#error.
  *
  *  \arg \c storePath Path of the file to be decrypted.
@@ -245,15 +397,74 @@ QByteArray Store::decryptFile(const QString path)
  */
 void Store::decryptFile(const QString storePath, const QString path)
 {
-    _p->storeFS->decryptFile(storePath, path);
+    _p->storeFS->decryptFile(storePath, path, [this, storePath](quint64 done, quint64 total) {
+        emit decryptProgress(storePath, done, total);
+    });
     error = _p->storeFSErrorToStoreError(_p->storeFS->error);
 }
 
+/**
+ *  \brief Opens the file in \c path for streaming reads.
+ *
+ *  Returns a seekable device that decrypts only the parts covering what is
+ *  read, instead of loading the whole file in memory.
+ *  Errors are reported through Store#error.
+ *
+ *  \arg \c path Path of the file to be opened.
+ *
+ *  \return A new, unopened device owned by the caller, or nullptr in case
+ *  of error. It must not outlive the Store.
+ *
+ *  \see StoreFileDevice
+ *  \see Store#error
+ */
+StoreFileDevice *Store::open(const QString path)
+{
+    StoreFileDevice *device = _p->storeFS->open(path);
+
+    error = _p->storeFSErrorToStoreError(_p->storeFS->error);
+    return device;
+}
+
+/**
+ *  \brief Creates the file in \c path from a stream of data.
+ *
+ *  Returns a write only device that encrypts data into parts as it's
+ *  written, so files can be added from pipes, sockets or any producer that
+ *  doesn't know the final size. The file is added to the Store, and the
+ *  change journaled, when the device is closed. Its mimetype is guessed
+ *  from the extension of \c path, as the data is never held whole.
+ *  Errors are reported through Store#error.
+ *
+ *  \arg \c path Path where the file will be stored.
+ *
+ *  \return A new, unopened device owned by the caller, or nullptr in case
+ *  of error. It must not outlive the Store.
+ *
+ *  \see StoreFileDevice
+ *  \see Store#error
+ */
+StoreFileDevice *Store::create(const QString path)
+{
+    _p->touch(QStringList() << path);
+
+    StoreFileDevice *device = _p->storeFS->create(path, [this, path]() {
+        QMimeDatabase mimedb;
+        QMimeType     mimetype = mimedb.mimeTypeForFile(path, QMimeDatabase::MatchExtension);
+        _p->storeFS->file(path)->metadata[QStringLiteral("mimetype")] = mimetype.name().toUtf8();
+
+        _p->record(QStringList() << path);
+    });
+
+    error = _p->storeFSErrorToStoreError(_p->storeFS->error);
+    return device;
+}
+
 /**
  *  \brief Renames \c oldPath to \c newPath
  *
  *  Renames a file or directory in \c oldPath to \c newPath.
- *  Saves Store.void in case of success.
+ *  Journals the change in case of success.
  *  Errors are reported through Store#error.
  *
  *  \arg \c oldPath Actual path of the file/directory.
@@ -264,20 +475,16 @@ void Store::decryptFile(const QString storePath, const QString path)
 void Store::move(const QString oldPath, const QString newPath)
 {
     if (_p->storeFS->file(oldPath)) {
+        _p->touch(QStringList() << oldPath << newPath);
         _p->storeFS->moveFile(oldPath, newPath);
 
         if (_p->storeFS->error == StoreFS::Success) {
-            _p->save();
+            _p->record(QStringList() << oldPath << newPath);
         }
 
         error = _p->storeFSErrorToStoreError(_p->storeFS->error);
     } else if (_p->storeFS->dir(oldPath)) {
-        _p->storeFS->moveDir(oldPath, newPath);
-
-        if (_p->storeFS->error == StoreFS::Success) {
-            _p->save();
-        }
-
+        _p->moveDir(oldPath, newPath);
         error = _p->storeFSErrorToStoreError(_p->storeFS->error);
     } else {
         error = NoSuchFile;
@@ -299,18 +506,27 @@ void Store::move(const QString oldPath, const QString newPath)
 void Store::remove(const QString path)
 {
     if (_p->storeFS->file(path)) {
-        _p->storeFS->removeFile(path);
+        _p->touch(QStringList() << path);
+        _p->removeFile(path);
 
         if (_p->storeFS->error == StoreFS::Success) {
-            _p->save();
+            _p->record(QStringList() << path);
         }
 
         error = _p->storeFSErrorToStoreError(_p->storeFS->error);
     } else if (_p->storeFS->dir(path)) {
+        QStringList paths = _p->filesIn(path);
+
+        _p->touch(paths);
+
+        for (QString filePath : paths) {
+            _p->removeFile(filePath);
+        }
+
         _p->storeFS->removeDir(path);
 
         if (_p->storeFS->error == StoreFS::Success) {
-            _p->save();
+            _p->record(paths);
         }
 
         error = _p->storeFSErrorToStoreError(_p->storeFS->error);
@@ -382,7 +598,7 @@ QStringList Store::listSubdirectories(QString path) const
     QList<StoreFSDirPtr> ds = _p->storeFS->subdirs(path);
 
     for (StoreFSDirPtr d : ds) {
-        list << d->path;
+        list << d->path();
     }
 
     return list;
@@ -405,7 +621,7 @@ QStringList Store::listFiles(QString path) const
     QList<StoreFSFilePtr> fs = _p->storeFS->subfiles(path);
 
     for (StoreFSFilePtr f : fs) {
-        list << f->path;
+        list << f->path();
     }
 
     return list;
@@ -455,7 +671,7 @@ QStringList Store::searchStartsWith(QString filter, quint8 type) const
             {
                 StoreFSFilePtr f = _p->storeFS->file(id);
                 if (f != nullptr) {
-                    entries << f->path;
+                    entries << f->path();
                 }
                 break;
             }
@@ -464,7 +680,7 @@ QStringList Store::searchStartsWith(QString filter, quint8 type) const
             {
                 StoreFSDirPtr d = _p->storeFS->dir(id);
                 if (d != nullptr) {
-                    entries << d->path;
+                    entries << d->path();
                 }
                 break;
             }
@@ -505,7 +721,7 @@ QStringList Store::searchEndsWith(QString filter, quint8 type) const
             {
                 StoreFSFilePtr f = _p->storeFS->file(id);
                 if (f != nullptr) {
-                    entries << f->path;
+                    entries << f->path();
                 }
                 break;
             }
@@ -514,7 +730,7 @@ QStringList Store::searchEndsWith(QString filter, quint8 type) const
             {
                 StoreFSDirPtr d = _p->storeFS->dir(id);
                 if (d != nullptr) {
-                    entries << d->path;
+                    entries << d->path();
                 }
                 break;
             }
@@ -555,7 +771,7 @@ QStringList Store::searchContains(QString filter, quint8 type) const
             {
                 StoreFSFilePtr f = _p->storeFS->file(id);
                 if (f != nullptr) {
-                    entries << f->path;
+                    entries << f->path();
                 }
                 break;
             }
@@ -564,7 +780,7 @@ QStringList Store::searchContains(QString filter, quint8 type) const
             {
                 StoreFSDirPtr d = _p->storeFS->dir(id);
                 if (d != nullptr) {
-                    entries << d->path;
+                    entries << d->path();
                 }
                 break;
             }
@@ -605,7 +821,7 @@ QStringList Store::searchRegex(QString filter, quint8 type) const
             {
                 StoreFSFilePtr f = _p->storeFS->file(id);
                 if (f != nullptr) {
-                    entries << f->path;
+                    entries << f->path();
                 }
                 break;
             }
@@ -614,7 +830,7 @@ QStringList Store::searchRegex(QString filter, quint8 type) const
             {
                 StoreFSDirPtr d = _p->storeFS->dir(id);
                 if (d != nullptr) {
-                    entries << d->path;
+                    entries << d->path();
                 }
                 break;
             }
@@ -685,13 +901,15 @@ void Store::setFileMetadata(const QString path, const QString key, const QByteAr
     StoreFSFilePtr file = _p->storeFS->file(path);
 
     if (file != nullptr) {
+        _p->touch(QStringList() << path);
+
         if (data.isEmpty()) {
             file->metadata.remove(key);
         } else {
             file->metadata[key] = data;
         }
 
-        _p->save();
+        _p->record(QStringList() << path);
     } else {
         error = NoSuchFile;
     }
@@ -720,9 +938,228 @@ quint64 Store::fileSize(const QString path)
 }
 
 /**
- *  \brief Default destructor.
+ *  \brief Sets how many file parts are encrypted or decrypted at once.
+ *
+ *  \arg \c parts Number of parts. Values lower than 1 are treated as 1.
+ *
+ *  \see StoreFS#setMaxPartsInFlight
+ */
+void Store::setMaxPartsInFlight(const int parts)
+{
+    _p->storeFS->setMaxPartsInFlight(parts);
+}
+
+/**
+ *  \brief Returns how many file parts are encrypted or decrypted at once.
+ *
+ *  \return The number of parts.
+ */
+int Store::maxPartsInFlight() const
+{
+    return _p->storeFS->maxPartsInFlight();
+}
+
+/**
+ *  \brief Returns the throughput of the last file transfer.
+ *
+ *  \return Bytes per second of the last transfer, or 0 if there was none.
+ *
+ *  \see StoreFS#throughput
+ */
+double Store::throughput() const
+{
+    return _p->storeFS->throughput();
+}
+
+/**
+ *  \brief Starts a batch of changes.
+ *
+ *  Until the matching Store#commitBatch, changes are applied in memory but
+ *  not journaled, and removed files keep their parts, so the whole batch
+ *  can be written at once or undone with Store#rollbackBatch. Batches can be
+ *  nested; only the outermost commit writes. The batch belongs to the
+ *  Store, so changes made by any thread while it's open are part of it.
+ *
+ *  \see Store#commitBatch
+ *  \see Store#rollbackBatch
+ */
+void Store::beginBatch()
+{
+    QMutexLocker locker(&_p->batchMutex);
+
+    _p->batchDepth++;
+}
+
+/**
+ *  \brief Ends a batch of changes.
+ *
+ *  When the outermost batch is committed, every file it changed is
+ *  journaled in a single write and the parts of the files it removed are
+ *  deleted.
+ *
+ *  \see Store#beginBatch
+ */
+void Store::commitBatch()
+{
+    QMutexLocker locker(&_p->batchMutex);
+
+    if ((_p->batchDepth == 0) || (--_p->batchDepth > 0)) {
+        return;
+    }
+
+    _p->batchPaths.removeDuplicates();
+    _p->journal(_p->batchPaths);
+
+    for (QString part : _p->batchRemoved) {
+        QFile::remove(_p->path + "/" + part);
+    }
+
+    _p->batchPaths.clear();
+    _p->batchBefore.clear();
+    _p->batchParts.clear();
+    _p->batchRemoved.clear();
+}
+
+/**
+ *  \brief Undoes every change of the current batch, including the nested
+ *  ones, and ends it.
+ *
+ *  Files are restored to their state before the batch, and the parts of
+ *  the files added by it are deleted.
+ *
+ *  \see Store#beginBatch
+ */
+void Store::rollbackBatch()
+{
+    QMutexLocker locker(&_p->batchMutex);
+
+    if (_p->batchDepth == 0) {
+        return;
+    }
+
+    QSet<QString> parts = QSet<QString>::fromList(_p->batchRemoved);
+
+    for (QString path : _p->batchBefore.keys()) {
+        StoreFSFilePtr file = _p->storeFS->file(path);
+
+        if (file != nullptr) {
+            for (QString part : file->cryptoParts.names()) {
+                parts << part;
+            }
+        }
+    }
+
+    for (QString path : _p->batchBefore.keys()) {
+        QByteArray before = _p->batchBefore[path];
+
+        if (before.isEmpty()) {
+            _p->storeFS->unloadFile(path);
+        } else {
+            _p->storeFS->loadFile(before);
+        }
+    }
+
+    for (QString part : parts - _p->batchParts) {
+        QFile::remove(_p->path + "/" + part);
+    }
+
+    _p->batchDepth = 0;
+    _p->batchPaths.clear();
+    _p->batchBefore.clear();
+    _p->batchParts.clear();
+    _p->batchRemoved.clear();
+}
+
+/**
+ *  \brief Sets how long changes wait before being written to disk.
+ *
+ *  With a delay, changes only update the index in memory and return. A
+ *  background thread writes them once the delay passes, together with all
+ *  other changes made in the meantime. Pending changes can be written
+ *  with Store#flush, and always are when the Store is destroyed.
+ *
+ *  \arg \c msecs Delay in milliseconds. 0, the default, writes every change
+ *  before returning.
+ *
+ *  \see Store#flush
  */
-Store::~Store() = default;
+void Store::setPersistDelay(const int msecs)
+{
+    _p->flush();
+    _p->persistDelay = std::max(0, msecs);
+}
+
+/**
+ *  \brief Returns how long changes wait before being written to disk.
+ *
+ *  \return Delay in milliseconds.
+ */
+int Store::persistDelay() const
+{
+    return _p->persistDelay;
+}
+
+/**
+ *  \brief Sets the compression of the index.
+ *
+ *  Store.void and every segment are rewritten with \c codec in the
+ *  background right away, so the whole index is loaded. The segments go to
+ *  new files, so Store.void never lists a segment compressed with another
+ *  codec, even if the rewrite fails.
+ *
+ *  Nothing changes if a segment can't be loaded, as it couldn't be
+ *  rewritten and Store.void would then list it with the wrong codec.
+ *  Errors are reported through Store#error.
+ *
+ *  \arg \c codec The IndexCodec to use.
+ *
+ *  \see Store#error
+ */
+void Store::setIndexCodec(const IndexCodec codec)
+{
+    _p->compactor.waitForDone();
+    _p->dirtyAll();
+
+    if (!_p->storeFS->unreadableSegments().isEmpty()) {
+        error = IndexCorrupted;
+        return;
+    }
+
+    _p->storeFile->setCodec(codec);
+    _p->compact();
+
+    error = Success;
+}
+
+/**
+ *  \brief Returns the compression of the index in Store.void.
+ *
+ *  \return The IndexCodec in use.
+ */
+IndexCodec Store::indexCodec() const
+{
+    return _p->storeFile->codec();
+}
+
+/**
+ *  \brief Writes pending changes to disk and waits until they are written.
+ *
+ *  \see Store#setPersistDelay
+ */
+void Store::flush()
+{
+    _p->flush();
+}
+
+/**
+ *  \brief Destructor. Rolls back a batch left open and writes pending
+ *  changes.
+ */
+Store::~Store()
+{
+    rollbackBatch();
+    _p->flush();
+}
 
 /**
  *  \brief Saves the Store.void file.
@@ -736,13 +1173,648 @@ Store::~Store() = default;
  */
 void StorePrivate::save()
 {
-    std::string serialized = qCompress(storeFS->serialize(), 9).toStdString();
+    saveSnapshot(manifest());
+}
+
+/**
+ *  \brief Compresses, encrypts and writes \c snapshot to Store.void.
+ *
+ *  It's sealed by StorePrivate#sealShard, so it never reuses the IV of
+ *  another save, and runs on the compactor without touching
+ *  StorePrivate#storeCrypto.
+ *
+ *  \arg \c snapshot The list of segments, as returned by
+ *  StorePrivate#manifest.
+ *
+ *  \return Whether it was written.
+ */
+bool StorePrivate::saveSnapshot(const QByteArray &snapshot)
+{
+    QByteArray sealed = sealShard(snapshot);
+
+    if (sealed.isEmpty()) {
+        return false;
+    }
+
+    snapshotSize = static_cast<qint64>(sealed.size());
+    storeFile->setData(sealed);
+
+    return true;
+}
+
+/**
+ *  \brief Serializes the list of segments of the index and their files.
+ *
+ *  \return The contents of Store.void.
+ */
+QByteArray StorePrivate::manifest() const
+{
+    QByteArray  data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << shards;
+
+    return data;
+}
+
+/**
+ *  \brief Compresses and encrypts a segment of the index, or the list of
+ *  them in Store.void.
+ *
+ *  \arg \c segment The segment, as returned by StoreFS#serializeSegment,
+ *  or StorePrivate#manifest.
+ *
+ *  \return A random nonce followed by the encrypted segment, or an empty
+ *  QByteArray if it couldn't be encrypted.
+ */
+QByteArray StorePrivate::sealShard(const QByteArray &segment) const
+{
+    std::string nonce  = Crypto::generateRandom(16);
+    Crypto      c(storeCrypto->key(), nonce);
+    std::string cipher = c.encrypt(StoreFile::compress(segment, storeFile->codec()).toStdString());
+
+    if (c.error != Crypto::Success) {
+        return QByteArray();
+    }
+
+    return QByteArray::fromStdString(nonce + cipher);
+}
+
+/**
+ *  \brief Reads a segment of the index written by StorePrivate#sealShard.
+ *
+ *  \arg \c fileName Name of the file of the segment in the store folder.
+ *
+ *  \return The segment, or an empty QByteArray if it couldn't be read.
+ */
+QByteArray StorePrivate::openShard(const QString fileName) const
+{
+    QFile file(path + "/" + fileName);
+
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+
+    std::string sealed = file.readAll().toStdString();
+
+    if (sealed.size() < 16) {
+        return QByteArray();
+    }
+
+    Crypto      c(storeCrypto->key(), sealed.substr(0, 16));
+    std::string compressed = c.decrypt(sealed.substr(16));
+
+    if (c.error != Crypto::Success) {
+        return QByteArray();
+    }
+
+    return StoreFile::uncompress(QByteArray::fromStdString(compressed), storeFile->codec());
+}
+
+/**
+ *  \brief Marks every segment as changed, so the next compaction rewrites
+ *  all of them. Loads the whole index.
+ */
+void StorePrivate::dirtyAll()
+{
+    for (QString name : shards.keys()) {
+        dirtyShards << name;
+    }
+
+    for (QString path : storeFS->allFiles()) {
+        dirtyShards << StoreFS::segment(path);
+    }
+}
+
+/**
+ *  \brief Remembers the state of \c paths before the current batch changes
+ *  them, so it can be rolled back.
+ *
+ *  Does nothing outside of batches or for paths already touched by the
+ *  batch.
+ *
+ *  \arg \c paths Paths of the files about to be changed.
+ */
+void StorePrivate::touch(const QStringList &paths)
+{
+    QMutexLocker locker(&batchMutex);
+
+    if (batchDepth == 0) {
+        return;
+    }
+
+    for (QString path : paths) {
+        if (batchBefore.contains(path)) {
+            continue;
+        }
+
+        StoreFSFilePtr file = storeFS->file(path);
+
+        batchBefore[path] = storeFS->serializeFile(path);
+
+        if (file != nullptr) {
+            for (QString part : file->cryptoParts.names()) {
+                batchParts << part;
+            }
+        }
+    }
+}
+
+/**
+ *  \brief Records that the files in \c paths changed.
+ *
+ *  Outside of batches they are journaled right away, otherwise when the
+ *  batch is committed.
+ *
+ *  \arg \c paths Paths of the files changed.
+ */
+void StorePrivate::record(const QStringList &paths)
+{
+    QMutexLocker locker(&batchMutex);
+
+    if (batchDepth > 0) {
+        batchPaths << paths;
+    } else {
+        journal(paths);
+    }
+}
+
+/**
+ *  \brief Removes the file at \c path.
+ *
+ *  Inside of batches, the parts are only deleted when the batch is
+ *  committed, so the file can be restored by a rollback.
+ *
+ *  \arg \c path Path of the file.
+ */
+void StorePrivate::removeFile(const QString path)
+{
+    QMutexLocker   locker(&batchMutex);
+    StoreFSFilePtr file = storeFS->file(path);
+
+    if ((batchDepth == 0) || (file == nullptr)) {
+        storeFS->removeFile(path);
+        return;
+    }
+
+    storeFS->unloadFile(path);
+    batchRemoved << file->cryptoParts.names();
+}
+
+/**
+ *  \brief Moves the directory at \c oldPath to \c newPath.
+ *
+ *  Outside of batches the move is journaled as a single
+ *  StorePrivate#MoveDir, whatever the number of files moved. Inside of
+ *  batches each file moved is remembered, so the move can be rolled back
+ *  even if it merged into an existing directory.
+ *
+ *  \arg \c oldPath Path of the directory.
+ *  \arg \c newPath Where to move it.
+ */
+void StorePrivate::moveDir(const QString oldPath, const QString newPath)
+{
+    QString from = storeFS->dir(oldPath)->path();
+    QString to   = newPath;
+    bool    batch;
+
+    to.remove(QRegularExpression(QStringLiteral("[/]+$")));
+
+    {
+        QMutexLocker locker(&batchMutex);
+        batch = batchDepth > 0;
+    }
+
+    if (!batch) {
+        storeFS->moveDir(oldPath, newPath);
+
+        if (storeFS->error == StoreFS::Success) {
+            journalMove(from, to);
+        }
+
+        return;
+    }
+
+    QStringList paths = filesIn(from);
+
+    for (QString path : QStringList(paths)) {
+        paths << to + path.mid(from.size());
+    }
+
+    touch(paths);
+    storeFS->moveDir(oldPath, newPath);
+
+    if (storeFS->error == StoreFS::Success) {
+        record(paths);
+    }
+}
+
+/**
+ *  \brief Journals the current state of the files in \c paths.
+ *
+ *  The records are taken right away, but with a StorePrivate#persistDelay
+ *  they are only encrypted and written by StorePrivate#writer once the
+ *  delay passes, coalesced with the changes made in the meantime. Compacts
+ *  the journal if it got too large.
+ *
+ *  \arg \c paths Paths of the files changed.
+ */
+void StorePrivate::journal(const QStringList &paths)
+{
+    {
+        QMutexLocker locker(&pendingMutex);
+
+        for (QString path : paths) {
+            pending[path] = storeFS->serializeFile(path);
+            dirtyShards << StoreFS::segment(path);
+        }
+
+        if ((persistDelay > 0) && !scheduled) {
+            scheduled = true;
+
+            writer.start(new Runner([this]() {
+                {
+                    QMutexLocker locker(&pendingMutex);
+
+                    if (!flushing) {
+                        wakeUp.wait(&pendingMutex, static_cast<unsigned long>(persistDelay));
+                    }
+                }
+
+                persist();
+            }));
+        }
+    }
+
+    if (persistDelay == 0) {
+        persist();
+    }
+
+    if (journalSize > std::max<qint64>(JOURNAL_MIN_COMPACT_SIZE, snapshotSize)) {
+        compact();
+    }
+}
+
+/**
+ *  \brief Journals that the directory \c from was moved to \c to.
+ *
+ *  Changes still waiting for StorePrivate#persistDelay are written first,
+ *  so they are replayed before the move. Only the segments of both
+ *  directories are marked as changed.
+ *
+ *  \arg \c from Old path of the directory.
+ *  \arg \c to New path of the directory.
+ */
+void StorePrivate::journalMove(const QString from, const QString to)
+{
+    flush();
+
+    QByteArray  payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << from
+    << to;
+
+    {
+        QMutexLocker locker(&pendingMutex);
+
+        dirtyShards << StoreFS::segment(from + "/") << StoreFS::segment(to + "/");
+    }
+
+    journalFile->write(encode(MoveDir, payload));
+    journalFile->flush();
+    journalSize = journalFile->size();
+
+    if (journalSize > std::max<qint64>(JOURNAL_MIN_COMPACT_SIZE, snapshotSize)) {
+        compact();
+    }
+}
+
+/**
+ *  \brief Writes the pending records to Store.journal.
+ *
+ *  Paths that exist are journaled as StorePrivate#Put, the others as
+ *  StorePrivate#Forget, all in a single write.
+ */
+void StorePrivate::persist()
+{
+    QMap<QString, QByteArray> records;
+
+    {
+        QMutexLocker locker(&pendingMutex);
+
+        records.swap(pending);
+        scheduled = false;
+    }
+
+    if (records.isEmpty()) {
+        return;
+    }
+
+    QByteArray data;
+
+    for (auto it = records.constBegin(); it != records.constEnd(); ++it) {
+        if (!it.value().isEmpty()) {
+            data += encode(Put, it.value());
+        } else {
+            QByteArray  payload;
+            QDataStream stream(&payload, QIODevice::WriteOnly);
+
+            stream.setVersion(QDataStream::Qt_5_6);
+            stream << it.key();
+
+            data += encode(Forget, payload);
+        }
+    }
+
+    journalFile->write(data);
+    journalFile->flush();
+    journalSize = journalFile->size();
+}
+
+/**
+ *  \brief Wakes StorePrivate#writer, waits for it and writes whatever is
+ *  still pending.
+ */
+void StorePrivate::flush()
+{
+    {
+        QMutexLocker locker(&pendingMutex);
+
+        flushing = true;
+        wakeUp.wakeAll();
+    }
 
-    serialized = storeCrypto->encrypt(serialized);
+    writer.waitForDone();
+    persist();
 
-    if (storeCrypto->error == Crypto::Success) {
-        storeFile->setData(QByteArray::fromStdString(serialized));
+    QMutexLocker locker(&pendingMutex);
+    flushing = false;
+}
+
+/**
+ *  \brief Encrypts a journal record.
+ *
+ *  The record is the nonce followed by the encrypted \c op and \c payload,
+ *  both as QDataStream byte arrays.
+ *
+ *  \arg \c op Kind of record.
+ *  \arg \c payload Data of the record.
+ *
+ *  \return The record, or an empty QByteArray if it couldn't be encrypted.
+ */
+QByteArray StorePrivate::encode(const JournalOp op, const QByteArray &payload) const
+{
+    std::string nonce  = Crypto::generateRandom(16);
+    Crypto      c(storeCrypto->key(), nonce);
+    std::string clear  = std::string(1, static_cast<char>(op)) + payload.toStdString();
+    std::string cipher = c.encrypt(clear);
+    QByteArray  record;
+
+    if (c.error != Crypto::Success) {
+        return record;
     }
+
+    QDataStream stream(&record, QIODevice::WriteOnly);
+
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << QByteArray::fromStdString(nonce)
+           << QByteArray::fromStdString(cipher);
+
+    return record;
+}
+
+/**
+ *  \brief Applies the records of the journal at \c journalPath.
+ *
+ *  A torn or corrupted record at the end, left by a crash in the middle of
+ *  an append, ends the replay and is cut from the file. The segments of
+ *  the records are marked as changed, since the journal is dropped by the
+ *  next compaction.
+ *
+ *  \arg \c journalPath Path of the journal.
+ *
+ *  \return Whether the journal existed.
+ */
+bool StorePrivate::replay(const QString journalPath)
+{
+    QFile file(journalPath);
+
+    if (!file.open(QIODevice::ReadWrite)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    qint64      valid = 0;
+
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    while (!stream.atEnd()) {
+        QByteArray nonce, cipher;
+
+        stream >> nonce
+        >> cipher;
+
+        if (stream.status() != QDataStream::Ok) {
+            break;
+        }
+
+        Crypto      c(storeCrypto->key(), nonce.toStdString());
+        std::string clear = c.decrypt(cipher.toStdString());
+
+        if ((c.error != Crypto::Success) || clear.empty()) {
+            break;
+        }
+
+        QByteArray payload = QByteArray::fromStdString(clear.substr(1));
+        JournalOp  op      = static_cast<JournalOp>(clear[0]);
+
+        if (op == MoveDir) {
+            QDataStream payloadStream(payload);
+            QString     from, to;
+
+            payloadStream.setVersion(QDataStream::Qt_5_6);
+            payloadStream >> from
+            >> to;
+
+            storeFS->moveDir(from, to);
+            dirtyShards << StoreFS::segment(from + "/") << StoreFS::segment(to + "/");
+        } else if (op == Put) {
+            StoreFSFilePtr loaded = storeFS->loadFile(payload);
+
+            // A record for a segment that can't be loaded isn't applied. The
+            // segment is marked anyway, so the journal is kept for it.
+            if (loaded != nullptr) {
+                dirtyShards << StoreFS::segment(loaded->path());
+            } else {
+                dirtyShards += QSet<QString>::fromList(storeFS->unreadableSegments());
+            }
+        } else {
+            QDataStream payloadStream(payload);
+            QString     path;
+
+            payloadStream.setVersion(QDataStream::Qt_5_6);
+            payloadStream >> path;
+
+            storeFS->unloadFile(path);
+            dirtyShards << StoreFS::segment(path);
+        }
+
+        valid = file.pos();
+    }
+
+    if (valid < file.size()) {
+        file.resize(valid);
+    }
+
+    return true;
+}
+
+/**
+ *  \brief Opens Store.journal for appending.
+ */
+void StorePrivate::openJournal()
+{
+    journalFile.reset(new QFile(path + "/Store.journal"));
+    journalFile->open(QIODevice::WriteOnly | QIODevice::Append);
+    journalSize = journalFile->size();
+}
+
+/**
+ *  \brief Compacts the journal into the index in the background.
+ *
+ *  The segments changed since the last compaction are serialized right
+ *  away and the journal is rotated to Store.journal.old, so new changes go
+ *  to a fresh journal. The segments and Store.void are then written in the
+ *  background and Store.journal.old removed. If that is interrupted, the
+ *  old journal is replayed on the next open. If it fails, the segments are
+ *  written again by the next compaction, which appends the journal to the
+ *  old one instead of replacing it.
+ *
+ *  Segments are never written in place. Each one goes to a new file, and
+ *  the files it replaces are only removed once Store.void lists the new
+ *  ones, so Store.void always lists files written with its codec.
+ *
+ *  A segment with a record that can't be decoded isn't written, as that
+ *  would lose the record. Its file is left alone and Store.journal.old is
+ *  kept, so the changes made to it are still replayed on the next open.
+ */
+void StorePrivate::compact()
+{
+    flush();
+    compactor.waitForDone();
+
+    // The files retired by a failed compaction are still listed on disk.
+    if (compactFailed) {
+        dirtyShards  += compacting;
+        compactFailed = false;
+    } else {
+        retiredShards.clear();
+    }
+
+    QMap<QString, QByteArray> segments;
+    QSet<QString>             corrupted;
+
+    for (QString name : dirtyShards) {
+        QByteArray segment = storeFS->serializeSegment(name);
+
+        // Its file is kept as is, and its changes stay in the journal.
+        if (storeFS->error == StoreFS::IndexCorrupted) {
+            corrupted << name;
+            continue;
+        }
+
+        if (shards.contains(name)) {
+            retiredShards << shards.take(name);
+        }
+
+        if (!segment.isEmpty()) {
+            shards[name]           = "Store." + QString::fromStdString(Crypto::stringToHex(Crypto::generateRandom(8), "")) + ".index";
+            segments[shards[name]] = segment;
+        }
+    }
+
+    compacting  = dirtyShards - corrupted;
+    dirtyShards = corrupted;
+
+    QStringList removed     = retiredShards;
+    bool        keepJournal = !corrupted.isEmpty();
+
+    QByteArray snapshot = manifest();
+    QString    oldPath  = path + "/Store.journal.old";
+
+    journalFile->close();
+
+    // The old journal of a failed compaction is kept until one succeeds.
+    if (QFile::exists(oldPath)) {
+        QFile oldJournal(oldPath);
+        QFile journal(path + "/Store.journal");
+
+        if (oldJournal.open(QIODevice::WriteOnly | QIODevice::Append) && journal.open(QIODevice::ReadOnly)) {
+            QByteArray records = journal.readAll();
+
+            if ((oldJournal.write(records) == records.size()) && oldJournal.flush()) {
+                journal.remove();
+            }
+        }
+    } else {
+        QFile::rename(path + "/Store.journal", oldPath);
+    }
+
+    openJournal();
+
+    compactor.start(new Runner([this, segments, removed, snapshot, oldPath, keepJournal]() {
+        qint64 written = 0;
+
+        for (auto it = segments.constBegin(); it != segments.constEnd(); ++it) {
+            QByteArray sealed = sealShard(it.value());
+            QSaveFile  file(path + "/" + it.key());
+
+            if (sealed.isEmpty() || !file.open(QIODevice::WriteOnly) || (file.write(sealed) != sealed.size()) || !file.commit()) {
+                compactFailed = true;
+                return;
+            }
+
+            written += sealed.size();
+        }
+
+        if (!saveSnapshot(snapshot)) {
+            compactFailed = true;
+            return;
+        }
+
+        snapshotSize += written;
+
+        for (QString fileName : removed) {
+            QFile::remove(path + "/" + fileName);
+        }
+
+        if (!keepJournal) {
+            QFile::remove(oldPath);
+        }
+    }));
+}
+
+/**
+ *  \brief Lists the paths of the files inside \c dir, recursively.
+ *
+ *  \arg \c dir Path of the directory.
+ *
+ *  \return The paths of the files.
+ */
+QStringList StorePrivate::filesIn(const QString dir) const
+{
+    QStringList paths;
+
+    for (quint64 id : storeFS->entryBeginsWith(dir + "/")) {
+        if (id < DIR_ID_BASE) {
+            paths << storeFS->path(id);
+        }
+    }
+
+    return paths;
 }
 
 /**
@@ -779,6 +1851,9 @@ Store::StoreError StorePrivate::storeFSErrorToStoreError(StoreFS::StoreFSError f
         case StoreFS::FileAlreadyExists:
             return Store::FileAlreadyExists;
 
+        case StoreFS::IndexCorrupted:
+            return Store::IndexCorrupted;
+
         case StoreFS::Success:
             return Store::Success;
     }
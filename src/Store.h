@@ -29,7 +29,11 @@
 #include <QString>
 
 #include "Crypto.h"
+#include "StoreFile.h"
 
+#define PERSIST_DELAY 250
+
+class StoreFileDevice;
 struct StorePrivate;
 
 class Store : public QObject
@@ -47,13 +51,14 @@ public:
         CantOpenStoreFile,                    /*!< The Store.void file could not be opened. */
 
         // From StoreFS
-        CantOpenFile,     /*!< Could not open a file. */
-        CantWriteToFile,  /*!< Could not write to a file. */
-        FileTooLarge,     /*!< The file is too large. Use Store#decryptFile(const QString, const QString) instead */
-        NoSuchFile,       /*!< File does not exist. */
-        PartCorrupted,    /*!< The checksum of the part file did not match. Verify that you are using the same parameters used during creation. The file might be just corrupted. */
-        WrongCheckSum,    /*!< The checksum of the whole file did not match. Verify that you are using the same parameters used during creation. One of the files might be just corrupted. */
-        FileAlreadyExists /*!< A destination file already exists. */
+        CantOpenFile,      /*!< Could not open a file. */
+        CantWriteToFile,   /*!< Could not write to a file. */
+        FileTooLarge,      /*!< The file is too large. Use Store#decryptFile(const QString, const QString) instead */
+        NoSuchFile,        /*!< File does not exist. */
+        PartCorrupted,     /*!< The checksum of the part file did not match. Verify that you are using the same parameters used during creation. The file might be just corrupted. */
+        WrongCheckSum,     /*!< The checksum of the whole file did not match. Verify that you are using the same parameters used during creation. One of the files might be just corrupted. */
+        FileAlreadyExists, /*!< A destination file already exists. */
+        IndexCorrupted     /*!< A segment or record of the index could not be read. */
     }
 
     /**
@@ -73,6 +78,20 @@ public:
     Q_INVOKABLE void addFile(const QString filePath, const QString storePath);
     Q_INVOKABLE QByteArray decryptFile(const QString path);
     Q_INVOKABLE void decryptFile(const QString storePath, const QString path);
+    StoreFileDevice  *open(const QString path);
+    StoreFileDevice  *create(const QString path);
+
+    Q_INVOKABLE void beginBatch();
+    Q_INVOKABLE void commitBatch();
+    Q_INVOKABLE void rollbackBatch();
+
+    Q_INVOKABLE void setPersistDelay(const int msecs);
+    Q_INVOKABLE int  persistDelay() const;
+    Q_INVOKABLE void flush();
+
+    void       setIndexCodec(const IndexCodec codec);
+    IndexCodec indexCodec() const;
+
     Q_INVOKABLE void move(const QString oldPath, const QString newPath);
     Q_INVOKABLE void remove(const QString path);
 
@@ -93,6 +112,17 @@ public:
     Q_INVOKABLE void setFileMetadata(const QString path, const QString key, const QByteArray data);
     Q_INVOKABLE quint64 fileSize(const QString path);
 
+    Q_INVOKABLE void   setMaxPartsInFlight(const int parts);
+    Q_INVOKABLE int    maxPartsInFlight() const;
+    Q_INVOKABLE double throughput() const;
+
+signals:
+    /**
+     *  \brief Emitted while Store#decryptFile(const QString, const QString)
+     *  writes \c path to disk. May be emitted from a worker thread.
+     */
+    void decryptProgress(const QString path, const quint64 done, const quint64 total);
+
 private:
     std::unique_ptr<StorePrivate> _p;
 };
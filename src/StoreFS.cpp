@@ -22,14 +22,31 @@
 
 #include "StoreFS.h"
 
+#include <algorithm>
+#include <functional>
 #include <math.h>
 
 #include <QDataStream>
 #include <QDir>
+#include <QElapsedTimer>
 #include <QFile>
+#include <QHash>
+#include <QMutex>
 #include <QRegularExpression>
+#include <QSemaphore>
+#include <QSet>
+#include <QThread>
+#include <QThreadPool>
+#include <QVector>
 
-#define MAX_PART_SIZE 52428800
+#include "Runner.h"
+#include "StoreFileDevice.h"
+#include "StoreFSIndex.h"
+#include "StoreFSNodeTable.h"
+#include "StoreFSPathTrie.h"
+#include "StoreFSTrigramIndex.h"
+
+#define SEARCH_CHUNK_SIZE 4096
 
 /*!
  *  \class StoreFS
@@ -45,40 +62,99 @@
  *
  */
 
+/**
+ *  \brief Outcome of a part processed by a transfer worker.
+ */
+struct StoreFSPart
+{
+    StoreFS::StoreFSError error = StoreFS::Success; /*!< Error that happened while processing the part. */
+    std::string           digest;                   /*!< Digest of the clear text of the part. */
+    std::string           name;                     /*!< Digest naming the encrypted part in the store folder. \see StoreFSPartList#fileName */
+};
+
 /**
  *  \brief StoreFS's private data structure
  */
 struct StoreFSPrivate
 {
-    /**
-     *  \brief Counter of file internal session ID.
-     *
-     *  Files and dir share the same id space the MSB
-     *  for dirs is set and for files it's cleared.
-     */
-    static quint64 fileIdCounter;
+    StoreFSPathTrie               pathIdMap;                  /*!< Maps Paths to IDs */
+    StoreFSTrigramIndex           trigrams;                   /*!< Trigrams of the paths, for substring searches. */
+    bool                          trigramsStale = true;       /*!< Whether StoreFSPrivate#trigrams wasn't built yet. */
+    StoreFSNodeTable<StoreFSDir>  idDirMap { DIR_ID_BASE };   /*!< Maps IDs to StoreFSDirPtr. Directory IDs have the MSB set. */
+    StoreFSNodeTable<StoreFSFile> idFileMap { FILE_ID_BASE }; /*!< Maps IDs to StoreFSFilePtr. File IDs have the MSB cleared. */
+
+    StoreFSDirPtr       root;  /*!< Root directory */
+    QHash<QString, int> names; /*!< Names of the entries, with how many entries use each. \see StoreFSPrivate#intern */
+
+    QString storePath;   /*!< Path to the store folder. */
 
     /**
-     *  \brief Counter of directory internal session ID.
+     *  \brief Version of the FS written by StoreFS#serialize.
      *
-     *  Files and dir share the same id space the MSB
-     *  for dirs is set and for files it's cleared.
+     *  1. Original format.
+     *  2. Records carry the FileDigestScheme of the file.
+     *  3. Records carry the StoreFSPartFormat and frame size of the file.
+     *     Files from older versions are StoreFSPartFormat#SINGLE_MESSAGE.
+     *  4. StoreFS#serialize writes the compact layout of StoreFSIndex.
+     *     Single records of StoreFS#serializeFile hold the raw digests of
+     *     the parts instead of a map of part index to name.
      */
-    static quint64 dirIdCounter;
+    quint32 version = 4;
 
-    QMap<quint64, QString>        idPathMap; /*!< Maps IDs to Paths */
-    QMap<QString, quint64>        pathIdMap; /*!< Maps Paths to IDs */
-    QMap<quint64, StoreFSDirPtr>  idDirMap;  /*!< Maps IDs to StoreFSDirPtr */
-    QMap<quint64, StoreFSFilePtr> idFileMap; /*!< Maps IDs to StoreFSFilePtr */
+    mutable QMutex       decodeMutex;        /*!< Serializes StoreFSPrivate#decode. */
+    QSet<QString>        pendingSegments;    /*!< Segments not loaded yet. \see StoreFS#setSegments */
+    QSet<QString>        unreadableSegments; /*!< Pending segments that failed to load. \see StoreFS#unreadableSegments */
+    StoreFSSegmentLoader segmentLoader;      /*!< Loads the segments in StoreFSPrivate#pendingSegments. */
 
-    StoreFSDirPtr root; /*!< Root directory */
+    QThreadPool pool;              /*!< Runs the part workers of transfers and parses segments. */
+    int         partsInFlight;     /*!< Maximum number of parts a transfer processes at once. \see StoreFS#setMaxPartsInFlight */
+    quint64     transferBytes = 0; /*!< Bytes moved by the last transfer. \see StoreFS#throughput */
+    qint64      transferNsecs = 0; /*!< Duration of the last transfer. \see StoreFS#throughput */
 
-    QString storePath;   /*!< Path to the store folder. */
-    quint32 version = 1; /*!< Version of the FS */
+    QString path(const quint64 id) const;
+    void    mapPath(const QString &path, const quint64 id);
+    void    unmapPath(const QString &path);
+    void    refreshTrigrams();
+
+    QString intern(const QString &name);
+    void    release(const QString &name);
+    void    releaseTree();
+
+    static void link(const StoreFSDirPtr &dir, const StoreFSDirPtr &parent);
+    static void unlink(const StoreFSDirPtr &dir);
+
+    void        parallelFor(const quint32 count, const std::function<void (quint32)> &job);
+    StoreFSPart encryptPart(const QString &filePath, const StoreFSFilePtr &file, const quint32 index);
+    void           writeRecord(QDataStream &stream, const StoreFSFilePtr &file) const;
+    StoreFSFilePtr readRecord(QDataStream &stream, const quint32 version, QString &path) const;
+    bool           decode(const StoreFSFilePtr &file) const;
+
+    bool parseSegment(const QByteArray &data, QList<QPair<QString, StoreFSFilePtr> > &files) const;
+
+    static QString requiredLiteral(const QString &pattern);
+
+    StoreFSPart decryptPart(const StoreFSFilePtr &file, const quint32 index, const QString &path, const std::function<void (quint64)> &advance);
 };
 
-quint64 StoreFSPrivate::fileIdCounter = 0;
-quint64 StoreFSPrivate::dirIdCounter  = (static_cast<quint64>(1)) << 63;
+/**
+ *  \brief Builds the path of the directory from its parents.
+ *
+ *  \return The path of the directory. Empty for the root.
+ */
+QString StoreFSDir::path() const
+{
+    return parent == nullptr ? name : parent->path() + "/" + name;
+}
+
+/**
+ *  \brief Builds the path of the file from its parents.
+ *
+ *  \return The path of the file.
+ */
+QString StoreFSFile::path() const
+{
+    return parent == nullptr ? name : parent->path() + "/" + name;
+}
 
 /**
  *  \brief Initializes the empty StoreFS object.
@@ -88,22 +164,26 @@ quint64 StoreFSPrivate::dirIdCounter  = (static_cast<quint64>(1)) << 63;
 StoreFS::StoreFS(QString storePath)
 {
     _p.reset(new StoreFSPrivate);
-    _p->root     = std::make_shared<StoreFSDir>();
-    _p->root->id = _p->dirIdCounter++;
+    _p->root = std::make_shared<StoreFSDir>();
 
-    _p->idPathMap[_p->root->id]   = _p->root->path;
-    _p->pathIdMap[_p->root->name] = _p->root->id;
-    _p->idDirMap[_p->root->id]    = _p->root;
+    _p->mapPath(_p->root->name, _p->idDirMap.insert(_p->root) );
 
     _p->storePath = storePath;
 
+    setMaxPartsInFlight(QThread::idealThreadCount());
+
     error = Success;
 }
 
 /**
- *  \brief Default destructor.
+ *  \brief Destructor.
+ *
+ *  \see StoreFSPrivate#releaseTree
  */
-StoreFS::~StoreFS() = default;
+StoreFS::~StoreFS()
+{
+    _p->releaseTree();
+}
 
 /**
  *  \brief Serializes the StoreFS structure.
@@ -112,13 +192,19 @@ StoreFS::~StoreFS() = default;
  *  to save the structure to a file. This serialized blob is not
  *  encrypted nor copressed, you must do it yourself.
  *
- *  \return A QByteArray containing the serialized structure.
+ *  \return A QByteArray containing the serialized structure, or an empty
+ *  QByteArray if the record of a file can't be decoded.
  *
  *  \see StoreFS#load
+ *  \see StoreFS#error
  *  \see StoreFS
  */
 QByteArray StoreFS::serialize() const
 {
+    const_cast<StoreFS *>(this)->error = Success;
+
+    requireAll();
+
     QByteArray  data;
     QDataStream stream(&data, QIODevice::WriteOnly);
 
@@ -126,25 +212,47 @@ QByteArray StoreFS::serialize() const
 
     stream << _p->version;
 
-    auto keys = _p->idFileMap.keys();
-
-    for (auto key : keys) {
-        StoreFSFilePtr file = _p->idFileMap[key];
-        stream << file->path
-               << file->size
-               << file->metadata
-               << file->key
-               << file->iv
-               << file->salt
-               << file->digest
-               << file->cryptoParts
-               << static_cast<quint8>(file->params.digest)
-               << static_cast<quint8>(file->params.encryption)
-               << static_cast<quint8>(file->params.keyDerivationFunction)
-               << static_cast<quint8>(file->params.keyDerivationHash)
-               << file->params.keyDerivationCost;
+    QList<StoreFSFilePtr> files = _p->idFileMap.values();
+
+    for (StoreFSFilePtr file : files) {
+        if (!_p->decode(file)) {
+            const_cast<StoreFS *>(this)->error = IndexCorrupted;
+            return QByteArray();
+        }
+    }
+
+    return data + StoreFSIndex::encode(files);
+}
+
+/**
+ *  \brief Serializes the record of the file at \c path.
+ *
+ *  The record can be given to StoreFS#loadFile, even by a StoreFS that
+ *  already knows the file.
+ *
+ *  \arg \c path Path of the file.
+ *
+ *  \return The serialized record, or an empty QByteArray if there is no such
+ *  file.
+ *
+ *  \see StoreFS#error
+ */
+QByteArray StoreFS::serializeFile(const QString path) const
+{
+    StoreFSFilePtr file = this->file(path);
+    QByteArray     data;
+
+    if (file == nullptr) {
+        return data;
     }
 
+    QDataStream stream(&data, QIODevice::WriteOnly);
+
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    stream << _p->version;
+    _p->writeRecord(stream, file);
+
     return data;
 }
 
@@ -153,6 +261,8 @@ QByteArray StoreFS::serialize() const
  *
  *  It will delete the current structure. All file information is
  *  loaded back into memory in a StoreFSDir/StoreFSFile structure.
+ *  From version 4 on, only paths and sizes are read right away, the rest
+ *  of each file is decoded the first time it's accessed.
  *
  *  \arg \c data The serialized data to load.
  *
@@ -163,61 +273,284 @@ void StoreFS::load(const QByteArray &data)
 {
     error = Success;
 
-    _p->fileIdCounter = 0;
-    _p->dirIdCounter  = (static_cast<quint64>(1)) << 63;
+    _p->releaseTree();
+    _p->root = std::make_shared<StoreFSDir>();
 
-    _p->root     = std::make_shared<StoreFSDir>();
-    _p->root->id = _p->dirIdCounter++;
-
-    _p->idPathMap.clear();
+    _p->names.clear();
     _p->pathIdMap.clear();
+    _p->trigrams.clear();
+    _p->trigramsStale = true;
     _p->idDirMap.clear();
     _p->idFileMap.clear();
+    _p->pendingSegments.clear();
+    _p->unreadableSegments.clear();
 
-    _p->idPathMap[_p->root->id]   = _p->root->path;
-    _p->pathIdMap[_p->root->name] = _p->root->id;
-    _p->idDirMap[_p->root->id]    = _p->root;
+    _p->mapPath(_p->root->name, _p->idDirMap.insert(_p->root) );
 
-    QDataStream stream(data);
+    loadSegment(data);
+}
+
+/**
+ *  \brief Returns the segment of the index the file at \c path belongs to.
+ *
+ *  Files are segmented by top-level directory. Files at the root are in
+ *  the segment with the empty name.
+ *
+ *  \arg \c path Path of the file.
+ *
+ *  \return The name of the segment.
+ */
+QString StoreFS::segment(const QString path)
+{
+    int end = path.indexOf(QLatin1Char('/'), 1);
+
+    return end < 0 ? QString() : path.mid(1, end - 1);
+}
+
+/**
+ *  \brief Serializes the files of the segment \c name.
+ *
+ *  The format is the one of StoreFS#serialize.
+ *
+ *  \arg \c name Name of the segment.
+ *
+ *  \return The serialized segment, or an empty QByteArray if it has no
+ *  files. Also empty if the segment couldn't be loaded or the record of one
+ *  of its files can't be decoded, in which case StoreFS#error is
+ *  StoreFS#IndexCorrupted.
+ *
+ *  \see StoreFS#segment
+ *  \see StoreFS#loadSegment
+ */
+QByteArray StoreFS::serializeSegment(const QString name) const
+{
+    const_cast<StoreFS *>(this)->error = Success;
+
+    QList<StoreFSFilePtr> files;
+    StoreFSDirPtr         top = name.isEmpty() ? _p->root : dir("/" + name);
+
+    if (name.isEmpty()) {
+        require("/");
+        files = _p->root->files;
+    } else if (top != nullptr) {
+        QList<StoreFSDirPtr> dirs { top };
+
+        while (!dirs.isEmpty()) {
+            StoreFSDirPtr d = dirs.takeLast();
+
+            files << d->files;
+            dirs  << d->subdirs;
+        }
+    }
+
+    if (_p->unreadableSegments.contains(name)) {
+        const_cast<StoreFS *>(this)->error = IndexCorrupted;
+        return QByteArray();
+    }
+
+    if (files.isEmpty()) {
+        return QByteArray();
+    }
+
+    for (StoreFSFilePtr file : files) {
+        if (!_p->decode(file)) {
+            const_cast<StoreFS *>(this)->error = IndexCorrupted;
+            return QByteArray();
+        }
+    }
+
+    QByteArray  data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
 
     stream.setVersion(QDataStream::Qt_5_6);
 
-    stream >> _p->version;
+    stream << _p->version;
+
+    return data + StoreFSIndex::encode(files);
+}
 
-    while (!stream.atEnd()) {
-        quint8 digest, encryption, keyDerivationFunction, keyDerivationHash;
+/**
+ *  \brief Adds the files serialized by StoreFS#serialize or
+ *  StoreFS#serializeSegment to the ones already loaded.
+ *
+ *  Nothing is added if the index can't be read.
+ *
+ *  \arg \c data The serialized files.
+ *
+ *  \see StoreFS#error
+ */
+void StoreFS::loadSegment(const QByteArray &data)
+{
+    error = Success;
+
+    QList<QPair<QString, StoreFSFilePtr> > files;
+
+    if (!_p->parseSegment(data, files)) {
+        error = IndexCorrupted;
+        return;
+    }
+
+    merge(files);
+}
+
+/**
+ *  \brief Declares segments that are loaded only when first needed.
+ *
+ *  A directory is created right away for each segment, so the root can be
+ *  listed without loading anything. The files of a segment are loaded by
+ *  \c loader the first time a path inside it is accessed through
+ *  StoreFS#dir, StoreFS#file, StoreFS#subdirs or StoreFS#subfiles, or
+ *  when all entries are listed or searched. Accessing the members of a
+ *  StoreFSDir directly doesn't load anything.
+ *
+ *  A segment that can't be loaded stays pending, and is tried again the
+ *  next time it's needed. Until then its files can't be read and nothing
+ *  can be changed in it. \see StoreFS#unreadableSegments
+ *
+ *  \arg \c names Names of the segments.
+ *  \arg \c loader Returns the serialized files of a segment.
+ *
+ *  \see StoreFS#segment
+ */
+void StoreFS::setSegments(const QStringList names, const StoreFSSegmentLoader loader)
+{
+    error = Success;
+
+    for (QString name : names) {
+        if (!name.isEmpty()) {
+            makePath("/" + name);
+        }
+    }
+
+    _p->segmentLoader   = loader;
+    _p->pendingSegments = QSet<QString>::fromList(names);
+    _p->unreadableSegments.clear();
+}
+
+/**
+ *  \brief Returns the segments that couldn't be loaded.
+ *
+ *  Only segments that were needed are tried, so a segment that wasn't
+ *  needed yet isn't listed even if it can't be loaded.
+ *
+ *  \return The names of the segments.
+ *
+ *  \see StoreFS#setSegments
+ */
+QStringList StoreFS::unreadableSegments() const
+{
+    return _p->unreadableSegments.values();
+}
+
+/**
+ *  \brief Loads the segments \c path may be in, if they are pending.
+ *
+ *  That is the segment of its top-level directory, and the one of the
+ *  files at the root if \c path may be one of them.
+ *
+ *  \arg \c path A path.
+ */
+void StoreFS::require(const QString path) const
+{
+    if (_p->pendingSegments.isEmpty()) {
+        return;
+    }
+
+    QStringList names;
+    int         end = path.indexOf(QLatin1Char('/'), 1);
+
+    if (end < 0) {
+        names << QString() << path.mid(1);
+    } else {
+        names << path.mid(1, end - 1);
+    }
+
+    StoreFS *self = const_cast<StoreFS *>(this);
+
+    for (QString name : names) {
+        if (_p->pendingSegments.remove(name)) {
+            self->loadSegment(_p->segmentLoader(name));
+
+            if (self->error == IndexCorrupted) {
+                _p->pendingSegments << name;
+                _p->unreadableSegments << name;
+            } else {
+                _p->unreadableSegments.remove(name);
+            }
+        }
+    }
+}
+
+/**
+ *  \brief Loads every pending segment.
+ *
+ *  The segments are read and parsed in parallel, as they don't depend on
+ *  each other, and merged into the tree one after the other, in the order
+ *  of their names. StoreFS#error is StoreFS#IndexCorrupted if one of them
+ *  can't be read, and it stays pending.
+ */
+void StoreFS::requireAll() const
+{
+    QStringList names = _p->pendingSegments.values();
+
+    if (names.isEmpty()) {
+        return;
+    }
+
+    std::sort(names.begin(), names.end());
+    _p->pendingSegments.clear();
+
+    QVector<QList<QPair<QString, StoreFSFilePtr> > > parsed(names.size());
+    QVector<bool>                                    valid(names.size());
+
+    _p->parallelFor(static_cast<quint32>(names.size()), [this, &names, &parsed, &valid](quint32 i) {
+        valid[static_cast<int>(i)] = _p->parseSegment(_p->segmentLoader(names[static_cast<int>(i)]), parsed[static_cast<int>(i)]);
+    });
+
+    for (int i = 0; i < names.size(); i++) {
+        if (valid[i]) {
+            _p->unreadableSegments.remove(names[i]);
+        } else {
+            _p->pendingSegments << names[i];
+            _p->unreadableSegments << names[i];
+            const_cast<StoreFS *>(this)->error = IndexCorrupted;
+        }
+    }
 
-        StoreFSFilePtr file(new StoreFSFile);
-        file->id = _p->fileIdCounter++;
+    for (auto files : parsed) {
+        const_cast<StoreFS *>(this)->merge(files);
+    }
+}
+
+/**
+ *  \brief Adds files parsed by StoreFSPrivate#parseSegment to the tree.
+ *
+ *  Segments list their files sorted by path, so the files of a directory
+ *  come one after the other. The directory is looked up for the first of
+ *  them and reused for the rest, and the tree is built in one pass.
+ *
+ *  \arg \c files The path of each file and the file, without id, name or
+ *  parent.
+ */
+void StoreFS::merge(const QList<QPair<QString, StoreFSFilePtr> > &files)
+{
+    QString       parentPath;
+    StoreFSDirPtr parent;
 
-        stream >> file->path
-        >> file->size
-        >> file->metadata
-        >> file->key
-        >> file->iv
-        >> file->salt
-        >> file->digest
-        >> file->cryptoParts
-        >> digest
-        >> encryption
-        >> keyDerivationFunction
-        >> keyDerivationHash
-        >> file->params.keyDerivationCost;
+    for (auto entry : files) {
+        StoreFSFilePtr file  = entry.second;
+        int            slash = entry.first.lastIndexOf(QLatin1Char('/'));
 
-        file->params.digest                = static_cast<DigestType>(digest);
-        file->params.encryption            = static_cast<EncType>(encryption);
-        file->params.keyDerivationFunction = static_cast<KeyDerivationFunction>(keyDerivationFunction);
-        file->params.keyDerivationHash     = static_cast<KeyDerivationHash>(keyDerivationHash);
+        _p->mapPath(entry.first, _p->idFileMap.insert(file) );
 
-        _p->pathIdMap[file->path] = file->id;
-        _p->idPathMap[file->id]   = file->path;
-        _p->idFileMap[file->id]   = file;
+        if ((parent == nullptr) || (entry.first.leftRef(slash) != parentPath)) {
+            parentPath = entry.first.left(slash);
+            parent     = makePath(parentPath);
+        }
 
-        QStringList list = file->path.split("/");
-        file->name = list.last();
-        list.removeLast();
-        file->parent = makePath(list.join("/"));
-        file->parent->files.append(file);
+        file->name   = _p->intern(entry.first.mid(slash + 1) );
+        file->parent = parent.get();
+        parent->files.append(file);
     }
 }
 
@@ -230,6 +563,8 @@ void StoreFS::load(const QByteArray &data)
  */
 StoreFSDirPtr StoreFS::dir(QString path) const
 {
+    require(path);
+
     if ((path == "/") || path.isEmpty()) {
         return _p->root;
     }
@@ -238,8 +573,8 @@ StoreFSDirPtr StoreFS::dir(QString path) const
         path.remove(QRegularExpression(QStringLiteral("[/]+$")));
     }
 
-    if (_p->pathIdMap.contains(path) && _p->idDirMap.contains(_p->pathIdMap[path])) {
-        return _p->idDirMap[_p->pathIdMap[path]];
+    if (_p->pathIdMap.contains(path) && _p->idDirMap.contains(_p->pathIdMap.value(path))) {
+        return _p->idDirMap.value(_p->pathIdMap.value(path));
     }
 
     return nullptr;
@@ -259,7 +594,7 @@ StoreFSDirPtr StoreFS::dir(const quint64 id) const
         return nullptr;
     }
 
-    return _p->idDirMap[id];
+    return _p->idDirMap.value(id);
 }
 
 /**
@@ -268,14 +603,17 @@ StoreFSDirPtr StoreFS::dir(const quint64 id) const
  *
  *  \arg \c path The path of the file.
  *
- *  \return The corresponding StoreFSFilePtr or nullptr if it does not exist.
+ *  \return The corresponding StoreFSFilePtr or nullptr if it does not exist
+ *  or its record can't be decoded, in which case StoreFS#error is
+ *  StoreFS#IndexCorrupted.
  */
 StoreFSFilePtr StoreFS::file(QString path) const
 {
-    StoreFSFilePtr file;
+    StoreFSFilePtr file = entry(path);
 
-    if (_p->pathIdMap.contains(path) && _p->idFileMap.contains(_p->pathIdMap[path])) {
-        file = _p->idFileMap[_p->pathIdMap[path]];
+    if ((file != nullptr) && !_p->decode(file)) {
+        const_cast<StoreFS *>(this)->error = IndexCorrupted;
+        return nullptr;
     }
 
     return file;
@@ -287,7 +625,9 @@ StoreFSFilePtr StoreFS::file(QString path) const
  *
  *  \arg \c path The id of the file.
  *
- *  \return The corresponding StoreFSFilePtr or nullptr if it does not exist.
+ *  \return The corresponding StoreFSFilePtr or nullptr if it does not exist
+ *  or its record can't be decoded, in which case StoreFS#error is
+ *  StoreFS#IndexCorrupted.
  */
 StoreFSFilePtr StoreFS::file(const quint64 id) const
 {
@@ -295,15 +635,73 @@ StoreFSFilePtr StoreFS::file(const quint64 id) const
         return nullptr;
     }
 
-    return _p->idFileMap[id];
+    StoreFSFilePtr file = _p->idFileMap.value(id);
+
+    if (!_p->decode(file)) {
+        const_cast<StoreFS *>(this)->error = IndexCorrupted;
+        return nullptr;
+    }
+
+    return file;
+}
+
+/**
+ *  \brief Returns the file at \c path without decoding its record.
+ *
+ *  Enough to know whether there is a file at \c path, or to unlink it.
+ *
+ *  \arg \c path The path of the file.
+ *
+ *  \return The StoreFSFilePtr or nullptr if it does not exist.
+ */
+StoreFSFilePtr StoreFS::entry(const QString path) const
+{
+    require(path);
+
+    if (_p->pathIdMap.contains(path) && _p->idFileMap.contains(_p->pathIdMap.value(path))) {
+        return _p->idFileMap.value(_p->pathIdMap.value(path));
+    }
+
+    return nullptr;
+}
+
+/**
+ *  \brief Returns whether the file at \c path can be changed.
+ *
+ *  It can't if its segment couldn't be loaded, as the change would be
+ *  written over the files of the segment. For a directory, pass its path
+ *  followed by a slash. The root stands for every segment.
+ *
+ *  \arg \c path The path of a file, or of a directory followed by a slash.
+ *
+ *  \return Whether it can be changed. If not, StoreFS#error is
+ *  StoreFS#IndexCorrupted.
+ */
+bool StoreFS::writable(const QString path)
+{
+    bool whole = (path == "/") || path.isEmpty();
+
+    if (whole) {
+        requireAll();
+    } else {
+        require(path);
+    }
+
+    if (whole ? _p->unreadableSegments.isEmpty() : !_p->unreadableSegments.contains(segment(path))) {
+        return true;
+    }
+
+    error = IndexCorrupted;
+
+    return false;
 }
 
 QString StoreFS::path(quint64 id)
 {
     error = Success;
 
-    if (_p->idPathMap.contains(id)) {
-        return _p->idPathMap[id];
+    if (_p->idDirMap.contains(id) || _p->idFileMap.contains(id)) {
+        return _p->path(id);
     }
 
     error = NoSuchFile;
@@ -317,12 +715,14 @@ QString StoreFS::path(quint64 id)
  */
 QStringList StoreFS::allDirs() const
 {
+    requireAll();
+
     QStringList paths;
 
-    auto ids = _p->idDirMap.keys();
+    auto ids = _p->idDirMap.ids();
 
     for (auto id : ids) {
-        paths << _p->idPathMap[id];
+        paths << _p->path(id);
     }
 
     paths.removeAll("");
@@ -338,6 +738,8 @@ QStringList StoreFS::allDirs() const
  */
 QStringList StoreFS::allEntries() const
 {
+    requireAll();
+
     QStringList paths = _p->pathIdMap.keys();
 
     paths.removeAll("");
@@ -353,12 +755,14 @@ QStringList StoreFS::allEntries() const
  */
 QStringList StoreFS::allFiles() const
 {
+    requireAll();
+
     QStringList paths;
 
-    auto ids = _p->idFileMap.keys();
+    auto ids = _p->idFileMap.ids();
 
     for (auto id : ids) {
-        paths << _p->idPathMap[id];
+        paths << _p->path(id);
     }
 
     return paths;
@@ -401,85 +805,121 @@ QList<StoreFSFilePtr> StoreFS::subfiles(QString path)
         return QList<StoreFSFilePtr>();
     }
 
+    for (StoreFSFilePtr file : d->files) {
+        if (!_p->decode(file)) {
+            error = IndexCorrupted;
+        }
+    }
+
     return d->files;
 }
 
 /**
  *  \brief Returns a list of IDs of all entries starting with \c s.
  *
+ *  Takes time proportional to the length of \c s and the number of
+ *  matches. \see StoreFSPathTrie
+ *
  *  \arg \c s The string to be matched.
  *
- *  \return A list of IDs of all entries starting with \c s.
+ *  \return A list of IDs of all entries starting with \c s, sorted by path.
  */
 QList<quint64> StoreFS::entryBeginsWith(const QString s) const
 {
-    QList<quint64> ids;
-
-    for (auto key : _p->pathIdMap.keys()) {
-        if (key.startsWith(s)) {
-            ids << _p->pathIdMap[key];
-        }
+    // A prefix inside a top-level directory only needs its segment.
+    if (s.startsWith(QLatin1Char('/')) && (s.indexOf(QLatin1Char('/'), 1) > 0)) {
+        require(s);
+    } else {
+        requireAll();
     }
 
-    return ids;
+    return _p->pathIdMap.withPrefix(s);
 }
 
 /**
  *  \brief Returns a list of IDs of all entries ending with \c s.
  *
+ *  Only the entries that hold every trigram of \c s are checked.
+ *  \see StoreFSTrigramIndex
+ *
  *  \arg \c s The string to be matched.
+ *  \arg \c cs Whether the case of \c s must match.
  *
- *  \return A list of IDs of all entries ending with \c s.
+ *  \return A list of IDs of all entries ending with \c s, sorted by path.
  */
-QList<quint64> StoreFS::entryEndsWith(const QString s) const
+QList<quint64> StoreFS::entryEndsWith(const QString s, const Qt::CaseSensitivity cs) const
 {
-    QList<quint64> ids;
+    requireAll();
+    _p->refreshTrigrams();
 
-    for (auto key : _p->pathIdMap.keys()) {
-        if (key.endsWith(s)) {
-            ids << _p->pathIdMap[key];
-        }
-    }
-
-    return ids;
+    return _p->trigrams.endsWith(s, cs);
 }
 
 /**
  *  \brief Returns a list of IDs of all entries containing with \c s.
  *
+ *  Only the entries that hold every trigram of \c s are checked.
+ *  \see StoreFSTrigramIndex
+ *
  *  \arg \c s The string to be matched.
+ *  \arg \c cs Whether the case of \c s must match.
  *
- *  \return A list of IDs of all entries containing with \c s.
+ *  \return A list of IDs of all entries containing with \c s, sorted by
+ *  path.
  */
-QList<quint64> StoreFS::entryContains(const QString s) const
+QList<quint64> StoreFS::entryContains(const QString s, const Qt::CaseSensitivity cs) const
 {
-    QList<quint64> ids;
-
-    for (auto key : _p->pathIdMap.keys()) {
-        if (key.contains(s)) {
-            ids << _p->pathIdMap[key];
-        }
-    }
+    requireAll();
+    _p->refreshTrigrams();
 
-    return ids;
+    return _p->trigrams.contains(s, cs);
 }
 
 /**
  *  \brief Returns a list of IDs of all entries matching the regex \c s.
  *
+ *  The longest literal every match must contain is taken from \c s, and
+ *  only the entries that contain it are matched, in chunks of
+ *  SEARCH_CHUNK_SIZE on the pool. The expression is compiled once, with
+ *  the JIT if available.
+ *
  *  \arg \c s The string to be matched.
  *
- *  \return A list of IDs of all entries matching the regex \c s.
+ *  \return A list of IDs of all entries matching the regex \c s, sorted by
+ *  path.
  */
 QList<quint64> StoreFS::entryMatchRegExp(const QString s) const
 {
-    QList<quint64>     ids;
+    requireAll();
+    _p->refreshTrigrams();
+
     QRegularExpression r(s);
 
-    for (auto key : _p->pathIdMap.keys()) {
-        if (r.match(key).hasMatch()) {
-            ids << _p->pathIdMap[key];
+    if (!r.isValid()) {
+        return QList<quint64>();
+    }
+
+    r.optimize();
+
+    QList<quint64>           candidates = _p->trigrams.contains(StoreFSPrivate::requiredLiteral(s) );
+    int                      chunks     = (candidates.size() + SEARCH_CHUNK_SIZE - 1) / SEARCH_CHUNK_SIZE;
+    QVector<QList<quint64> > matches(chunks);
+
+    _p->parallelFor(static_cast<quint32>(chunks), [this, &r, &candidates, &matches](quint32 chunk) {
+        int begin = static_cast<int>(chunk) * SEARCH_CHUNK_SIZE;
+        int end   = std::min(begin + SEARCH_CHUNK_SIZE, candidates.size());
+
+        for (int i = begin; i < end; i++) {
+            if (r.match(_p->path(candidates.at(i))).hasMatch()) {
+                matches[static_cast<int>(chunk)] << candidates.at(i);
+            }
         }
+    });
+
+    QList<quint64> ids;
+
+    for (QList<quint64> chunk : matches) {
+        ids << chunk;
     }
 
     return ids;
@@ -500,29 +940,26 @@ StoreFSDirPtr StoreFS::addSubdir(QString name, StoreFSDirPtr parent)
 {
     error = Success;
 
-    StoreFSDirPtr dir = this->dir(parent->path + "/" + name);
+    StoreFSDirPtr dir = parent->subdirsByName.value(name);
 
     if (dir != nullptr) {
         return dir;
     }
 
-    if (file(parent->path + "/" + name) != nullptr) {
+    QString path = parent->path() + "/" + name;
+
+    if (entry(path) != nullptr) {
         error = FileAlreadyExists;
         return nullptr;
     }
 
     dir = std::make_shared<StoreFSDir>();
 
-    dir->id     = _p->dirIdCounter++;
-    dir->name   = name;
-    dir->path   = parent->path + "/" + name;
-    dir->parent = parent;
+    dir->name = _p->intern(name);
 
-    parent->subdirs << dir;
+    StoreFSPrivate::link(dir, parent);
 
-    _p->idPathMap[dir->id]   = dir->path;
-    _p->pathIdMap[dir->path] = dir->id;
-    _p->idDirMap[dir->id]    = dir;
+    _p->mapPath(path, _p->idDirMap.insert(dir) );
 
     return dir;
 }
@@ -530,6 +967,9 @@ StoreFSDirPtr StoreFS::addSubdir(QString name, StoreFSDirPtr parent)
 /**
  *  \brief Makes a path if it doesnt exist, like `mkdir -p path`.
  *
+ *  Each component is looked up in StoreFSDir#subdirsByName, so it takes
+ *  the same time however many entries the directories hold.
+ *
  *  \arg \c path Path to be made. If it already exists, a pointer to the
  *  existing one is returned instead.
  *
@@ -549,13 +989,11 @@ StoreFSDirPtr StoreFS::makePath(QString path)
     parts.removeFirst();
 
     for (QString part : parts) {
-        for (StoreFSDirPtr dir:folder->subdirs) {
-            if (dir->name == part) {
-                folder = dir;
-            }
-        }
+        StoreFSDirPtr child = folder->subdirsByName.value(part);
 
-        if (folder->name != part) {
+        if (child != nullptr) {
+            folder = child;
+        } else {
             folder = addSubdir(part, folder);
             if (error == FileAlreadyExists) {
                 return nullptr;
@@ -577,37 +1015,51 @@ void StoreFS::removeDir(const QString path)
 
     StoreFSDirPtr dir = this->dir(path);
 
-    if (dir == nullptr) {
+    if ((dir == nullptr) || !writable(dir == _p->root ? "/" : dir->path() + "/")) {
         return;
     }
 
-    QList<quint64> ids = entryBeginsWith(dir->path + "/");
+    QList<quint64>       ids = entryBeginsWith(dir->path() + "/");
+    QList<StoreFSDirPtr> removed;
 
+    // Subdirectories stay linked until the end, so their paths can be built.
     std::sort(ids.begin(), ids.end());
     for (quint64 id : ids) {
-        if (id > ((static_cast<quint64>(1)) << 63)) {
-            dir = this->dir(id);
-            _p->idPathMap.remove(id);
+        if (id > DIR_ID_BASE) {
+            StoreFSDirPtr subdir = this->dir(id);
+
+            _p->unmapPath(subdir->path() );
             _p->idDirMap.remove(id);
-            _p->pathIdMap.remove(dir->path);
-            dir->parent->subdirs.removeOne(dir);
+            _p->release(subdir->name);
+            removed << subdir;
         } else {
-            removeFile(_p->idPathMap[id]);
+            removeFile(_p->path(id) );
         }
     }
 
-    dir = this->dir(path);
-    if (!dir->path.isEmpty() && (dir->parent != nullptr)) {
-        _p->idPathMap.remove(dir->id);
+    for (StoreFSDirPtr subdir : removed) {
+        subdir->parent = nullptr;
+    }
+
+    dir->subdirs.clear();
+    dir->subdirsByName.clear();
+
+    if ((dir != _p->root) && (dir->parent != nullptr)) {
+        _p->unmapPath(dir->path() );
         _p->idDirMap.remove(dir->id);
-        _p->pathIdMap.remove(dir->path);
-        dir->parent->subdirs.removeOne(dir);
+        _p->release(dir->name);
+        StoreFSPrivate::unlink(dir);
     }
 }
 
 /**
  *  \brief Moves a directory.
  *
+ *  If nothing exists at \c newPath, the directory is renamed and linked to
+ *  its new parent, and its contents are left untouched. Otherwise its files
+ *  are moved one by one into the directory at \c newPath. A directory
+ *  can't be moved inside itself.
+ *
  *  \arg \c oldPath Actual path of the folder.
  *  \arg \c newPath New path of the folder.
  */
@@ -617,22 +1069,56 @@ void StoreFS::moveDir(const QString oldPath, const QString newPath)
 
     StoreFSDirPtr d = dir(oldPath);
 
-    if (d == nullptr) {
+    if ((d == nullptr) || (d == _p->root)) {
         return;
     }
 
-    QList<quint64> ids = entryBeginsWith(d->path + "/");
+    QString from = d->path();
+    QString to   = newPath;
 
-    for (quint64 id : ids) {
-        if (id < ((static_cast<quint64>(1)) << 63)) {
-            QString oldFilePath = _p->idPathMap[id];
-            QString newFilePath = oldFilePath;
-            newFilePath.replace(oldPath, newPath);
-            moveFile(oldFilePath, newFilePath);
+    to.remove(QRegularExpression(QStringLiteral("[/]+$")));
+
+    if ((to == from) || to.startsWith(from + "/") || !writable(from + "/") || !writable(to + "/")) {
+        return;
+    }
+
+    if ((dir(to) == nullptr) && (entry(to) == nullptr)) {
+        StoreFSDirPtr parent = makePath(to.left(to.lastIndexOf(QLatin1Char('/'))));
+
+        if (parent == nullptr) {
+            return;
         }
+
+        StoreFSPrivate::unlink(d);
+        _p->release(d->name);
+        d->name = _p->intern(to.mid(to.lastIndexOf(QLatin1Char('/')) + 1) );
+        StoreFSPrivate::link(d, parent);
+
+        _p->pathIdMap.remove(from);
+        _p->pathIdMap.move(from + "/", to + "/");
+        _p->pathIdMap.insert(to, d->id);
+
+        // Every path under the directory changed.
+        if (!_p->trigramsStale) {
+            _p->trigrams.insert(to, d->id);
+
+            for (quint64 id : _p->pathIdMap.withPrefix(to + "/")) {
+                _p->trigrams.insert(_p->path(id), id);
+            }
+        }
+
+        return;
     }
 
-    removeDir(oldPath);
+    for (quint64 id : entryBeginsWith(from + "/")) {
+        if (id < DIR_ID_BASE) {
+            QString oldFilePath = _p->path(id);
+
+            moveFile(oldFilePath, to + oldFilePath.mid(from.size()));
+        }
+    }
+
+    removeDir(from);
 }
 
 /**
@@ -657,7 +1143,11 @@ StoreFSFilePtr StoreFS::addFile(QString path, QByteArray data)
 {
     error = Success;
 
-    if (file(path) != nullptr) {
+    if (!writable(path)) {
+        return nullptr;
+    }
+
+    if (entry(path) != nullptr) {
         error = FileAlreadyExists;
         return nullptr;
     }
@@ -684,36 +1174,50 @@ StoreFSFilePtr StoreFS::addFile(QString path, QByteArray data)
 
     parent->files << file;
 
-    file->id     = _p->fileIdCounter++;
-    file->name   = name;
-    file->path   = path;
-    file->parent = parent;
+    file->name   = _p->intern(name);
+    file->parent = parent.get();
     file->size   = static_cast<quint64>(data.size());
     file->key    = QByteArray::fromStdString(key);
     file->iv     = QByteArray::fromStdString(iv);
     file->salt   = QByteArray::fromStdString(salt);
 
-    _p->pathIdMap[file->path] = file->id;
-    _p->idPathMap[file->id]   = file->path;
-    _p->idFileMap[file->id]   = file;
+    _p->mapPath(path, _p->idFileMap.insert(file) );
 
-    std::string wholeFileDigest;
+    std::vector<std::string> partDigests;
+    QByteArray               cipher;
+    Digest                   digest;
 
     for (unsigned int i = 0; i < floor(data.size() / MAX_PART_SIZE) + 1; i++) {
-        std::string part       = data.mid(static_cast<int>(i * MAX_PART_SIZE), MAX_PART_SIZE).toStdString();
-        std::string partDigest = Crypto::digest(part);
-        std::string name       = partDigest + salt;
+        qint64 offset = static_cast<qint64>(i) * MAX_PART_SIZE;
+        size_t size   = static_cast<size_t>(std::min<qint64>(MAX_PART_SIZE, data.size() - offset));
+        auto   part   = reinterpret_cast<const unsigned char*>(data.constData() + offset);
+
+        digest.update(part, size);
+        std::string partDigest = digest.finalize();
+        std::string name       = StoreFSPartStream::partName(file, i, partDigest);
 
-        name             = Crypto::stringToHex(Crypto::digest(name), "");
-        wholeFileDigest += partDigest;
-        wholeFileDigest  = Crypto::digest(wholeFileDigest);
-        part             = c.encrypt(part);
+        partDigests.push_back(partDigest);
 
-        QFile partFile(_p->storePath + "/" + QString::fromStdString(name));
+        StoreFSPartStream stream(file, i, CryptoStream::Encrypt);
+
+        cipher.resize(static_cast<int>(stream.outputSize(size)));
+
+        auto   cipher_c = reinterpret_cast<unsigned char*>(cipher.data());
+        size_t written  = stream.update(part, size, cipher_c, static_cast<size_t>(cipher.size()));
+
+        written += stream.final(cipher_c + written, static_cast<size_t>(cipher.size()) - written);
+        cipher.resize(static_cast<int>(written));
+
+        if (stream.error != Crypto::Success) {
+            error = CantCreateCryptoObject;
+            break;
+        }
+
+        QFile partFile(_p->storePath + "/" + StoreFSPartList::fileName(name));
         if (partFile.open(QFile::WriteOnly)) {
-            file->cryptoParts[i] = QString::fromStdString(name);
+            file->cryptoParts.appendDigest(QByteArray::fromStdString(name));
 
-            if (partFile.write(QByteArray::fromStdString(part)) == -1) {
+            if (partFile.write(cipher) == -1) {
                 error = CantWriteToFile;
                 break;
             }
@@ -723,7 +1227,7 @@ StoreFSFilePtr StoreFS::addFile(QString path, QByteArray data)
         }
     }
 
-    file->digest = QByteArray::fromStdString(wholeFileDigest);
+    file->digest = QByteArray::fromStdString(Crypto::fileDigest(partDigests, file->params));
 
     return file;
 }
@@ -749,7 +1253,11 @@ StoreFSFilePtr StoreFS::addFile(QString filePath, QString path)
 {
     error = Success;
 
-    if (file(path) != nullptr) {
+    if (!writable(path)) {
+        return nullptr;
+    }
+
+    if (entry(path) != nullptr) {
         error = FileAlreadyExists;
         return nullptr;
     }
@@ -781,48 +1289,56 @@ StoreFSFilePtr StoreFS::addFile(QString filePath, QString path)
         return file;
     }
 
+    QElapsedTimer timer;
+
+    timer.start();
+
     parent->files << file;
 
-    file->id     = _p->fileIdCounter++;
-    file->name   = name;
-    file->path   = path;
-    file->parent = parent;
+    file->name   = _p->intern(name);
+    file->parent = parent.get();
     file->size   = static_cast<quint64>(fileIn.size());
     file->key    = QByteArray::fromStdString(key);
     file->iv     = QByteArray::fromStdString(iv);
     file->salt   = QByteArray::fromStdString(salt);
 
-    _p->pathIdMap[file->path] = file->id;
-    _p->idPathMap[file->id]   = file->path;
-    _p->idFileMap[file->id]   = file;
+    _p->mapPath(path, _p->idFileMap.insert(file) );
 
-    std::string wholeFileDigest;
+    fileIn.close();
 
-    for (unsigned int i = 0; i < floor(file->size / MAX_PART_SIZE) + 1; i++) {
-        std::string part       = fileIn.read(MAX_PART_SIZE).toStdString();
-        std::string partDigest = Crypto::digest(part);
-        std::string digest     = partDigest + salt;
-        std::string name       = Crypto::stringToHex(Crypto::digest(digest), "");
+    // Every worker reads, digests and encrypts its own part, slice by slice,
+    // into its own part file. The index is then updated in part order.
+    quint32                  count = static_cast<quint32>(file->size / MAX_PART_SIZE) + 1;
+    std::vector<StoreFSPart> parts(count);
+    std::vector<std::string> partDigests;
 
-        wholeFileDigest += partDigest;
-        wholeFileDigest  = Crypto::digest(wholeFileDigest);
-        part             = c.encrypt(part);
+    _p->parallelFor(count, [&](quint32 i) {
+        parts[i] = _p->encryptPart(filePath, file, i);
+    });
 
-        QFile partFile(_p->storePath + "/" + QString::fromStdString(name));
-        if (partFile.open(QFile::WriteOnly)) {
-            file->cryptoParts[i] = QString::fromStdString(name);
-
-            if (partFile.write(QByteArray::fromStdString(part)) == -1) {
-                error = CantWriteToFile;
-                break;
-            }
-        } else {
-            error = CantOpenFile;
-            break;
+    for (quint32 i = 0; i < count; i++) {
+        if (parts[i].error != Success) {
+            error = error == Success ? parts[i].error : error;
+            continue;
         }
+
+        file->cryptoParts.appendDigest(QByteArray::fromStdString(parts[i].name));
+        partDigests.push_back(parts[i].digest);
+    }
+
+    if (error != Success) {
+        StoreFSError failure = error;
+
+        removeFile(path);
+        error = failure;
+
+        return file;
     }
 
-    file->digest = QByteArray::fromStdString(wholeFileDigest);
+    file->digest = QByteArray::fromStdString(Crypto::fileDigest(partDigests, file->params));
+
+    _p->transferBytes = file->size;
+    _p->transferNsecs = timer.nsecsElapsed();
 
     return file;
 }
@@ -850,7 +1366,7 @@ QByteArray StoreFS::decryptFile(QString path)
     StoreFSFilePtr file = this->file(path);
 
     if (file == nullptr) {
-        error = NoSuchFile;
+        error = error == IndexCorrupted ? IndexCorrupted : NoSuchFile;
         return data;
     }
 
@@ -869,34 +1385,43 @@ QByteArray StoreFS::decryptFile(QString path)
         return data;
     }
 
-    std::string wholeFileDigest;
+    std::vector<std::string> partDigests;
+    Digest                   digest;
 
     for (unsigned int i = 0; i < static_cast<unsigned int>(file->cryptoParts.size()); i++) {
-        QFile part(_p->storePath + "/" + file->cryptoParts[i]);
+        QFile part(_p->storePath + "/" + file->cryptoParts.name(static_cast<int>(i)));
         if (!part.open(QIODevice::ReadOnly)) {
             error = CantOpenFile;
             return QByteArray();
         }
 
-        std::string partData = part.readAll().toStdString();
-        partData = c.decrypt(partData);
+        // Decrypts straight into the end of data, avoiding intermediate copies.
+        QByteArray cipher = part.readAll();
+        int        offset = data.size();
+
+        data.resize(offset + cipher.size());
+
+        StoreFSPartStream stream(file, i, CryptoStream::Decrypt);
+
+        auto   cipher_c = reinterpret_cast<const unsigned char*>(cipher.constData());
+        auto   clear_c  = reinterpret_cast<unsigned char*>(data.data() + offset);
+        size_t size     = stream.update(cipher_c, static_cast<size_t>(cipher.size()), clear_c, static_cast<size_t>(cipher.size()));
+
+        size += stream.final(clear_c + size, static_cast<size_t>(cipher.size()) - size);
+        data.resize(offset + static_cast<int>(size));
 
-        std::string partDigest = Crypto::digest(partData);
-        std::string digest     = partDigest + file->salt.toStdString();
+        digest.update(clear_c, size);
+        std::string partDigest = digest.finalize();
 
-        digest           = Crypto::digest(digest, file->params);
-        wholeFileDigest += partDigest;
-        wholeFileDigest  = Crypto::digest(wholeFileDigest);
+        partDigests.push_back(partDigest);
 
-        if (Crypto::stringToHex(digest, "") != file->cryptoParts[i].toStdString()) {
+        if ((stream.error != Crypto::Success) || !StoreFSPartStream::checkName(file, i, partDigest)) {
             error = PartCorrupted;
             return QByteArray();
         }
-
-        data += QByteArray::fromStdString(partData);
     }
 
-    if (file->digest != QByteArray::fromStdString(wholeFileDigest)) {
+    if (file->digest != QByteArray::fromStdString(Crypto::fileDigest(partDigests, file->params))) {
         error = WrongCheckSum;
         return QByteArray();
     }
@@ -908,31 +1433,28 @@ QByteArray StoreFS::decryptFile(QString path)
  *  \brief Decrypts the file at \c path.
  *
  *  Decrypts the file at \c storePath and into the file \c path.
+ *  The file is streamed part by part, so there is no limit on its size and
+ *  memory usage is bounded by StoreFS#maxPartsInFlight.
  *
  *  \arg \c storePath Path of the file to be decrypted.
  *  \arg \c path Where in the disk the file should be saved.
+ *  \arg \c progress Optional callback, called with the number of bytes
+ *  written so far and the size of the file. Calls are serialized, but may
+ *  come from any thread.
  *
  *  \see StoreFS#error
  *  \see StoreFS#addFile
  *  \see Store
  *  \see Crypto
  */
-void StoreFS::decryptFile(QString storePath, QString path)
+void StoreFS::decryptFile(QString storePath, QString path, StoreFSProgress progress)
 {
     error = Success;
 
     StoreFSFilePtr file = this->file(storePath);
 
     if (file == nullptr) {
-        error = NoSuchFile;
-        return;
-    }
-
-    // QByteArray is limited to 2GB
-    // I'm using power of 10 because I have
-    // no idea what Qt uses.
-    if (file->size > 2000000000) {
-        error = FileTooLarge;
+        error = error == IndexCorrupted ? IndexCorrupted : NoSuchFile;
         return;
     }
 
@@ -949,44 +1471,207 @@ void StoreFS::decryptFile(QString storePath, QString path)
 
     QFile outFile(path);
 
+    // The output is sized up front so every worker can write its part at its
+    // own offset, in whatever order the parts finish.
     if (!outFile.open(QIODevice::WriteOnly)) {
         error = CantOpenFile;
         return;
     }
 
-    std::string wholeFileDigest;
+    if (!outFile.resize(static_cast<qint64>(file->size))) {
+        error = CantWriteToFile;
+        outFile.remove();
+        return;
+    }
 
-    for (unsigned int i = 0; i < static_cast<unsigned int>(file->cryptoParts.size()); i++) {
-        QFile part(_p->storePath + "/" + file->cryptoParts[i]);
-        if (!part.open(QIODevice::ReadOnly)) {
-            error = CantOpenFile;
-            return;
-        }
+    outFile.close();
 
-        std::string partData = part.readAll().toStdString();
-        partData = c.decrypt(partData);
+    QElapsedTimer timer;
 
-        std::string partDigest = Crypto::digest(partData);
-        std::string digest     = partDigest + file->salt.toStdString();
+    timer.start();
 
-        digest           = Crypto::digest(digest, file->params);
-        wholeFileDigest += partDigest;
-        wholeFileDigest  = Crypto::digest(wholeFileDigest);
+    quint32                  count = static_cast<quint32>(file->cryptoParts.size());
+    std::vector<StoreFSPart> parts(count);
+    std::vector<std::string> partDigests;
+    QMutex                   progressMutex;
+    quint64                  written = 0;
 
-        if (Crypto::stringToHex(digest, "") != file->cryptoParts[i].toStdString()) {
-            error = PartCorrupted;
-            return;
+    auto advance = [&](quint64 bytes) {
+        if (progress) {
+            QMutexLocker lock(&progressMutex);
+            written += bytes;
+            progress(written, file->size);
         }
+    };
 
-        if (outFile.write(QByteArray::fromStdString(partData)) == -1) {
-            error = CantWriteToFile;
-            return;
+    _p->parallelFor(count, [&](quint32 i) {
+        parts[i] = _p->decryptPart(file, i, path, advance);
+    });
+
+    for (quint32 i = 0; i < count; i++) {
+        if (parts[i].error != Success) {
+            error = error == Success ? parts[i].error : error;
+            continue;
         }
+
+        partDigests.push_back(parts[i].digest);
+    }
+
+    // Clear text is written as it's decrypted. If any part fails, or the
+    // parts don't make up the file, the output file is removed, so no
+    // unauthenticated data is left behind.
+    if (error != Success) {
+        outFile.remove();
+        return;
     }
 
-    if (file->digest != QByteArray::fromStdString(wholeFileDigest)) {
+    if (file->digest != QByteArray::fromStdString(Crypto::fileDigest(partDigests, file->params))) {
         error = WrongCheckSum;
+        outFile.remove();
+        return;
+    }
+
+    _p->transferBytes = file->size;
+    _p->transferNsecs = timer.nsecsElapsed();
+}
+
+/**
+ *  \brief Opens the file at \c path for random access reads.
+ *
+ *  Nothing is decrypted until data is read from the returned device.
+ *
+ *  \arg \c path Path of the file to be opened.
+ *
+ *  \return A new, unopened StoreFileDevice owned by the caller, or nullptr
+ *  if there is no such file.
+ *
+ *  \see StoreFS#error
+ *  \see StoreFileDevice
+ */
+StoreFileDevice *StoreFS::open(const QString path)
+{
+    error = Success;
+
+    StoreFSFilePtr file = this->file(path);
+
+    if (file == nullptr) {
+        error = error == IndexCorrupted ? IndexCorrupted : NoSuchFile;
+        return nullptr;
+    }
+
+    return new StoreFileDevice(file, _p->storePath);
+}
+
+/**
+ *  \brief Creates the file at \c path from a stream of data.
+ *
+ *  Returns a write only device. Data written to it is encrypted into parts
+ *  as it arrives, and the file is added to the index when the device is
+ *  closed, so its size doesn't need to be known in advance.
+ *
+ *  \arg \c path Path where the file will be stored.
+ *  \arg \c committed Optional, called after the file is added to the index.
+ *
+ *  \return A new, unopened StoreFileDevice owned by the caller, or nullptr
+ *  if \c path already exists.
+ *
+ *  \see StoreFS#error
+ *  \see StoreFileDevice
+ */
+StoreFileDevice *StoreFS::create(const QString path, std::function<void ()> committed)
+{
+    error = Success;
+
+    if (!writable(path)) {
+        return nullptr;
+    }
+
+    if (entry(path) != nullptr) {
+        error = FileAlreadyExists;
+        return nullptr;
     }
+
+    StoreFSFilePtr file(new StoreFSFile);
+
+    file->name = path.split(QStringLiteral("/")).last();
+    file->size = 0;
+    file->key  = QByteArray::fromStdString(Crypto::generateRandom(32));
+    file->iv   = QByteArray::fromStdString(Crypto::generateRandom(16));
+    file->salt = QByteArray::fromStdString(Crypto::generateRandom(16));
+
+    return new StoreFileDevice(file, _p->storePath, [this, path, committed](StoreFSFilePtr file) {
+        // The path may have been taken while the file was being written.
+        if (!writable(path) || (entry(path) != nullptr)) {
+            return false;
+        }
+
+        QStringList pathList = path.split(QStringLiteral("/"));
+
+        pathList.removeLast();
+
+        StoreFSDirPtr parent = makePath(pathList.join(QStringLiteral("/")));
+
+        parent->files << file;
+
+        file->name   = _p->intern(file->name);
+        file->parent = parent.get();
+
+        _p->mapPath(path, _p->idFileMap.insert(file) );
+
+        if (committed) {
+            committed();
+        }
+
+        return true;
+    });
+}
+
+/**
+ *  \brief Sets how many parts a transfer processes at once.
+ *
+ *  Each part in flight uses one thread of the StoreFS pool and a couple of
+ *  1MB buffers, so this bounds both CPU and memory usage of transfers.
+ *  Defaults to QThread#idealThreadCount.
+ *
+ *  \arg \c parts Number of parts. Values lower than 1 are treated as 1.
+ *
+ *  \see StoreFS#addFile(const QString, const QString)
+ *  \see StoreFS#decryptFile(const QString, const QString)
+ */
+void StoreFS::setMaxPartsInFlight(const int parts)
+{
+    _p->partsInFlight = std::max(1, parts);
+    _p->pool.setMaxThreadCount(_p->partsInFlight);
+}
+
+/**
+ *  \brief Returns how many parts a transfer processes at once.
+ *
+ *  \return The number of parts.
+ *
+ *  \see StoreFS#setMaxPartsInFlight
+ */
+int StoreFS::maxPartsInFlight() const
+{
+    return _p->partsInFlight;
+}
+
+/**
+ *  \brief Returns the throughput of the last transfer.
+ *
+ *  \return Clear text bytes per second moved by the last transfer, or 0 if
+ *  there was none.
+ *
+ *  \see StoreFS#addFile(const QString, const QString)
+ *  \see StoreFS#decryptFile(const QString, const QString)
+ */
+double StoreFS::throughput() const
+{
+    if (_p->transferNsecs <= 0) {
+        return 0;
+    }
+
+    return static_cast<double>(_p->transferBytes) * 1e9 / static_cast<double>(_p->transferNsecs);
 }
 
 /**
@@ -1001,13 +1686,17 @@ void StoreFS::moveFile(const QString oldPath, const QString newPath)
 {
     error = Success;
 
+    if (!writable(oldPath) || !writable(newPath)) {
+        return;
+    }
+
     StoreFSFilePtr file = this->file(oldPath);
 
     if (file == nullptr) {
         return;
     }
 
-    if (this->file(newPath) != nullptr) {
+    if (entry(newPath) != nullptr) {
         error = FileAlreadyExists;
         return;
     }
@@ -1017,14 +1706,13 @@ void StoreFS::moveFile(const QString oldPath, const QString newPath)
 
     StoreFSDirPtr newParent = this->makePath(newParentPath);
 
-    file->name = newName;
-    file->path = newPath;
+    _p->release(file->name);
+    file->name = _p->intern(newName);
     file->parent->files.removeOne(file);
-    file->parent = newParent;
+    file->parent = newParent.get();
 
-    _p->pathIdMap.remove(oldPath);
-    _p->pathIdMap[newPath]  = file->id;
-    _p->idPathMap[file->id] = newPath;
+    _p->unmapPath(oldPath);
+    _p->mapPath(newPath, file->id);
 
     newParent->files << file;
 }
@@ -1040,19 +1728,1100 @@ void StoreFS::removeFile(const QString path)
 {
     error = Success;
 
+    if (!writable(path)) {
+        return;
+    }
+
     StoreFSFilePtr file = this->file(path);
 
     if (file == nullptr) {
         return;
     }
 
-    file->parent->files.removeOne(file);
+    unloadFile(path);
+
+    for (QString partName : file->cryptoParts.names()) {
+        QFile::remove(_p->storePath + "/" + partName);
+    }
+}
+
+/**
+ *  \brief Moves the written part \c partFile to \c partPath.
+ *
+ *  Part names digest the clear text and the salt of the file, so a file
+ *  already at \c partPath holds the same part, possibly written by another
+ *  thread. It's kept and \c partFile dropped. QFile#rename never replaces a
+ *  file, so \c partPath is never missing.
+ *
+ *  \arg \c partFile The closed temporary file of the part.
+ *  \arg \c partPath Path of the file named after the part.
+ *
+ *  \return Whether the part is at \c partPath. If \c partFile wasn't
+ *  moved, it's removed.
+ */
+bool StoreFS::placePart(QFile &partFile, const QString &partPath)
+{
+    if (partFile.rename(partPath)) {
+        return true;
+    }
+
+    partFile.remove();
+
+    return QFile::exists(partPath);
+}
+
+/**
+ *  \brief Forgets the file at \c path, leaving its parts untouched.
+ *
+ *  \arg \c path Path of the file.
+ *
+ *  \see StoreFS#removeFile
+ *  \see StoreFS#loadFile
+ */
+void StoreFS::unloadFile(const QString path)
+{
+    error = Success;
+
+    if (!writable(path)) {
+        return;
+    }
+
+    StoreFSFilePtr file = entry(path);
+
+    if (file == nullptr) {
+        return;
+    }
 
-    _p->idPathMap.remove(file->id);
+    _p->unmapPath(file->path() );
     _p->idFileMap.remove(file->id);
-    _p->pathIdMap.remove(file->path);
+    _p->release(file->name);
 
-    for (QString partName : file->cryptoParts.values()) {
-        QFile::remove(_p->storePath + "/" + partName);
+    file->parent->files.removeOne(file);
+    file->parent = nullptr;
+}
+
+/**
+ *  \brief Loads a record serialized by StoreFS#serializeFile.
+ *
+ *  If a file with the same path is already known, it's replaced. Its parts
+ *  are left untouched.
+ *
+ *  \arg \c data The serialized record.
+ *
+ *  \return A pointer to the loaded file, or nullptr if the record or its
+ *  segment couldn't be read.
+ *
+ *  \see StoreFS#unloadFile
+ */
+StoreFSFilePtr StoreFS::loadFile(const QByteArray &data)
+{
+    error = Success;
+
+    QDataStream stream(data);
+    quint32     version;
+
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    stream >> version;
+
+    QString        path;
+    StoreFSFilePtr file = _p->readRecord(stream, version, path);
+
+    if (stream.status() != QDataStream::Ok) {
+        error = IndexCorrupted;
+        return nullptr;
+    }
+
+    if (!writable(path)) {
+        return nullptr;
+    }
+
+    unloadFile(path);
+    merge(QList<QPair<QString, StoreFSFilePtr> >() << qMakePair(path, file) );
+
+    return file;
+}
+
+/**
+ *  \brief Parses the files serialized by StoreFS#serialize or
+ *  StoreFS#serializeSegment.
+ *
+ *  Touches no shared state, so segments can be parsed concurrently.
+ *
+ *  \arg \c data The serialized files.
+ *  \arg \c files Where to put the path of each file and the file, still to
+ *  be added to the tree by StoreFS#merge. Left empty if the index can't be
+ *  read.
+ *
+ *  \return Whether the index could be read.
+ */
+bool StoreFSPrivate::parseSegment(const QByteArray &data, QList<QPair<QString, StoreFSFilePtr> > &files) const
+{
+    QDataStream stream(data);
+    quint32     version = 0;
+
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    stream >> version;
+
+    if (stream.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    if (version >= 4) {
+        std::shared_ptr<StoreFSIndex> index(new StoreFSIndex(data, static_cast<int>(stream.device()->pos())));
+
+        if (!index->isValid()) {
+            return false;
+        }
+
+        for (quint32 i = 0; i < index->count(); i++) {
+            StoreFSFilePtr file(new StoreFSFile);
+
+            file->size   = index->size(i);
+            file->index  = index;
+            file->record = i;
+
+            files << qMakePair(index->path(i), file);
+        }
+
+        return true;
     }
+
+    QList<QPair<QString, StoreFSFilePtr> > records;
+
+    while (!stream.atEnd()) {
+        QString        path;
+        StoreFSFilePtr file = readRecord(stream, version, path);
+
+        if (stream.status() != QDataStream::Ok) {
+            return false;
+        }
+
+        records << qMakePair(path, file);
+    }
+
+    files = records;
+
+    return true;
+}
+
+/**
+ *  \brief Returns the path of the entry \c id.
+ *
+ *  \arg \c id The ID of a directory or file.
+ *
+ *  \return The path, or an empty QString if there's no such entry.
+ */
+QString StoreFSPrivate::path(const quint64 id) const
+{
+    if (idDirMap.contains(id)) {
+        return idDirMap.value(id)->path();
+    }
+
+    if (idFileMap.contains(id)) {
+        return idFileMap.value(id)->path();
+    }
+
+    return QString();
+}
+
+/**
+ *  \brief Maps \c path to \c id and indexes it for searches.
+ *
+ *  The search index is only kept up to date once the first search built
+ *  it. \see StoreFSPrivate#refreshTrigrams
+ *
+ *  \arg \c path The path of an entry.
+ *  \arg \c id The ID of the entry.
+ */
+void StoreFSPrivate::mapPath(const QString &path, const quint64 id)
+{
+    pathIdMap.insert(path, id);
+
+    if (!trigramsStale) {
+        trigrams.insert(path, id);
+    }
+}
+
+/**
+ *  \brief Removes \c path from the path map and from the search index.
+ *
+ *  \arg \c path The path of an entry.
+ */
+void StoreFSPrivate::unmapPath(const QString &path)
+{
+    if (pathIdMap.contains(path)) {
+        if (!trigramsStale) {
+            trigrams.remove(pathIdMap.value(path));
+        }
+
+        pathIdMap.remove(path);
+    }
+}
+
+/**
+ *  \brief Returns the pooled copy of \c name.
+ *
+ *  Entries with the same name, like the files of a camera in different
+ *  folders, share the data of one QString. Each call counts one more entry
+ *  using the name, to be dropped by StoreFSPrivate#release.
+ *
+ *  \arg \c name The name of an entry.
+ *
+ *  \return A QString equal to \c name, sharing its data with the pool.
+ */
+QString StoreFSPrivate::intern(const QString &name)
+{
+    auto it = names.find(name);
+
+    if (it == names.end()) {
+        it = names.insert(name, 0);
+    }
+
+    it.value()++;
+
+    return it.key();
+}
+
+/**
+ *  \brief Counts one entry less using \c name, and drops it from the pool
+ *  once no entry uses it.
+ *
+ *  \arg \c name The name of an entry leaving the tree or being renamed.
+ */
+void StoreFSPrivate::release(const QString &name)
+{
+    auto it = names.find(name);
+
+    if ((it != names.end()) && (--it.value() == 0)) {
+        names.erase(it);
+    }
+}
+
+/**
+ *  \brief Clears the parent of every entry of the tree, before it's
+ *  dropped.
+ *
+ *  Parents aren't owned by their entries, and an entry may outlive the tree
+ *  if someone still holds it, like a StoreFileDevice or a StoreFSFilePtr
+ *  returned by StoreFS#file.
+ */
+void StoreFSPrivate::releaseTree()
+{
+    for (StoreFSDirPtr dir : idDirMap.values()) {
+        dir->parent = nullptr;
+    }
+
+    for (StoreFSFilePtr file : idFileMap.values()) {
+        file->parent = nullptr;
+    }
+}
+
+/**
+ *  \brief Makes \c dir a subdirectory of \c parent.
+ *
+ *  \arg \c dir The directory, not linked to any parent.
+ *  \arg \c parent The new parent.
+ */
+void StoreFSPrivate::link(const StoreFSDirPtr &dir, const StoreFSDirPtr &parent)
+{
+    dir->parent = parent.get();
+    parent->subdirs << dir;
+    parent->subdirsByName.insert(dir->name, dir);
+}
+
+/**
+ *  \brief Removes \c dir from the subdirectories of its parent.
+ *
+ *  \arg \c dir The directory.
+ */
+void StoreFSPrivate::unlink(const StoreFSDirPtr &dir)
+{
+    dir->parent->subdirs.removeOne(dir);
+    dir->parent->subdirsByName.remove(dir->name);
+    dir->parent = nullptr;
+}
+
+/**
+ *  \brief Builds StoreFSPrivate#trigrams from the tree if it wasn't built
+ *  yet.
+ *
+ *  Stores that are never searched by substring, suffix or regular
+ *  expression don't pay for the index. Entries are added by ascending ID,
+ *  files first, so each ID goes at the end of its lists.
+ */
+void StoreFSPrivate::refreshTrigrams()
+{
+    if (!trigramsStale) {
+        return;
+    }
+
+    trigrams.clear();
+
+    for (StoreFSFilePtr file : idFileMap.values()) {
+        trigrams.insert(file->path(), file->id);
+    }
+
+    for (StoreFSDirPtr dir : idDirMap.values()) {
+        trigrams.insert(dir->path(), dir->id);
+    }
+
+    trigramsStale = false;
+}
+
+/**
+ *  \brief Returns the index of the last character of the escape whose
+ *  letter or digit is at \c i in \c pattern.
+ *
+ *  Character codes, control characters, properties and references take
+ *  arguments, such as the 41 of \\x41 or the name of \\k<name>.
+ *
+ *  \arg \c pattern The regular expression.
+ *  \arg \c i Index of the escaped letter or digit.
+ *
+ *  \return The index of the last character of its arguments.
+ */
+static int escapeEnd(const QString &pattern, int i)
+{
+    const QChar escaped = pattern.at(i);
+    const int   size    = pattern.size();
+
+    auto skipTo = [&pattern, size](int j, const QChar close) {
+        while ((j + 1 < size) && (pattern.at(j + 1) != close)) {
+            j++;
+        }
+
+        return std::min(j + 1, size - 1);
+    };
+
+    auto skipWhile = [&pattern, size](int j, int max, const std::function<bool (QChar)> &accept) {
+        while ((max-- > 0) && (j + 1 < size) && accept(pattern.at(j + 1))) {
+            j++;
+        }
+
+        return j;
+    };
+
+    auto isHex = [](const QChar c) {
+        return c.isDigit() || QString("abcdefABCDEF").contains(c);
+    };
+
+    auto isOctal = [](const QChar c) {
+        return (c >= QLatin1Char('0')) && (c <= QLatin1Char('7'));
+    };
+
+    QChar next = (i + 1 < size) ? pattern.at(i + 1) : QChar();
+
+    switch (escaped.toLatin1()) {
+        case 'x':
+            return next == QLatin1Char('{') ? skipTo(i + 1, QLatin1Char('}')) : skipWhile(i, 2, isHex);
+
+        case '0':
+            return skipWhile(i, 2, isOctal);
+
+        case 'c':
+            return std::min(i + 1, size - 1);
+
+        case 'o':
+        case 'N':
+        case 'p':
+        case 'P':
+            if (next == QLatin1Char('{')) {
+                return skipTo(i + 1, QLatin1Char('}'));
+            }
+
+            return (escaped == QLatin1Char('p')) || (escaped == QLatin1Char('P')) ? std::min(i + 1, size - 1) : i;
+
+        case 'g':
+        case 'k':
+            if (next == QLatin1Char('{')) {
+                return skipTo(i + 1, QLatin1Char('}'));
+            } else if (next == QLatin1Char('<')) {
+                return skipTo(i + 1, QLatin1Char('>'));
+            } else if (next == QLatin1Char('\'')) {
+                return skipTo(i + 1, QLatin1Char('\''));
+            } else if ((escaped == QLatin1Char('g')) && ((next == QLatin1Char('-')) || (next == QLatin1Char('+')))) {
+                i++;
+            }
+
+            return escaped == QLatin1Char('g') ? skipWhile(i, size, [](QChar c) { return c.isDigit(); }) : i;
+
+        default:
+            // Back references and octal codes.
+            if (escaped.isDigit()) {
+                return skipWhile(i, size, [](QChar c) { return c.isDigit(); });
+            }
+
+            return i;
+    }
+}
+
+/**
+ *  \brief Returns the longest run of characters every match of the regular
+ *  expression \c pattern contains.
+ *
+ *  Only characters outside groups and classes are considered, and a
+ *  character under a quantifier that allows it to be absent is not. A
+ *  pattern with an alternation, inline options or quoting has no required
+ *  literal, as they change what the characters mean.
+ *
+ *  \arg \c pattern The regular expression.
+ *
+ *  \return The literal, or an empty QString if none was found.
+ */
+QString StoreFSPrivate::requiredLiteral(const QString &pattern)
+{
+    QString longest;
+    QString run;
+    int     depth = 0;
+
+    auto endRun = [&longest, &run]() {
+        if (run.size() > longest.size()) {
+            longest = run;
+        }
+
+        run.clear();
+    };
+
+    for (int i = 0; i < pattern.size(); i++) {
+        QChar c = pattern.at(i);
+
+        if (c == QLatin1Char('\\')) {
+            if (i + 1 >= pattern.size()) {
+                return QString();
+            }
+
+            QChar escaped = pattern.at(++i);
+
+            if (escaped == QLatin1Char('Q')) {
+                return QString();
+            }
+
+            // Escaped letters and digits are classes, assertions, references
+            // or character codes, whose arguments aren't literal either.
+            if (escaped.isLetterOrNumber()) {
+                endRun();
+                i = escapeEnd(pattern, i);
+            } else if (depth == 0) {
+                run += escaped;
+            }
+
+            continue;
+        }
+
+        if (c == QLatin1Char('[')) {
+            endRun();
+
+            // Skips the class, where a leading ] is literal.
+            int j = i + 1;
+
+            if ((j < pattern.size()) && (pattern.at(j) == QLatin1Char('^'))) {
+                j++;
+            }
+
+            if ((j < pattern.size()) && (pattern.at(j) == QLatin1Char(']'))) {
+                j++;
+            }
+
+            while ((j < pattern.size()) && (pattern.at(j) != QLatin1Char(']'))) {
+                j += pattern.at(j) == QLatin1Char('\\') ? 2 : 1;
+            }
+
+            i = j;
+            continue;
+        }
+
+        switch (c.unicode()) {
+            case '|':
+                // Alternatives inside a group don't affect what is outside.
+                if (depth == 0) {
+                    return QString();
+                }
+
+                break;
+
+            case '(':
+                if ((i + 2 < pattern.size()) && (pattern.at(i + 1) == QLatin1Char('?'))
+                    && (pattern.at(i + 2).isLetter() || (pattern.at(i + 2) == QLatin1Char('-'))
+                        || (pattern.at(i + 2) == QLatin1Char('^')))) {
+                    return QString();
+                }
+
+                endRun();
+                depth++;
+                break;
+
+            case ')':
+                depth = std::max(0, depth - 1);
+                break;
+
+            case '{':
+                // Skips the bounds, which may allow zero repetitions.
+                while ((i < pattern.size()) && (pattern.at(i) != QLatin1Char('}'))) {
+                    i++;
+                }
+
+                run.chop(1);
+                endRun();
+                break;
+
+            case '*':
+            case '?':
+                // The quantified character may be absent.
+                run.chop(1);
+                endRun();
+                break;
+
+            case '+':
+                endRun();
+                break;
+
+            case '.':
+            case '^':
+            case '$':
+                endRun();
+                break;
+
+            default:
+                if (depth == 0) {
+                    run += c;
+                }
+        }
+    }
+
+    endRun();
+
+    return longest;
+}
+
+/**
+ *  \brief Runs \c job for every index in [0, \c count) on the pool and waits
+ *  for all of them to finish.
+ *
+ *  At most StoreFSPrivate#partsInFlight jobs are queued or running at once.
+ *
+ *  \arg \c count Number of jobs.
+ *  \arg \c job Function called with the index of each job.
+ */
+void StoreFSPrivate::parallelFor(const quint32 count, const std::function<void (quint32)> &job)
+{
+    int        inFlight = partsInFlight;
+    QSemaphore available(inFlight);
+
+    for (quint32 i = 0; i < count; i++) {
+        available.acquire();
+        pool.start(new Runner([&available, &job, i]() {
+            job(i);
+            available.release();
+        }));
+    }
+
+    available.acquire(inFlight);
+}
+
+/**
+ *  \brief Encrypts the part \c index of \c filePath into the store folder.
+ *
+ *  The part is read, digested and encrypted slice by slice into a temporary
+ *  file, which is renamed once the digest, and so the name, of the part is
+ *  known. Opens its own handles, so parts can be processed concurrently.
+ *
+ *  \arg \c filePath The file being added.
+ *  \arg \c file The file in the store, with its key, iv and salt set.
+ *  \arg \c index Index of the part.
+ *
+ *  \return The digest and name of the part, or the error that happened.
+ */
+StoreFSPart StoreFSPrivate::encryptPart(const QString &filePath, const StoreFSFilePtr &file, const quint32 index)
+{
+    StoreFSPart part;
+    QFile       fileIn(filePath);
+    QString     tempName = QString::fromStdString(Crypto::stringToHex(Crypto::generateRandom(16), "")) + ".part";
+    QFile       partFile(storePath + "/" + tempName);
+
+    if (!fileIn.open(QIODevice::ReadOnly) || !fileIn.seek(static_cast<qint64>(index) * MAX_PART_SIZE) || !partFile.open(QFile::WriteOnly)) {
+        part.error = StoreFS::CantOpenFile;
+        return part;
+    }
+
+    StoreFSPartStream stream(file, index, CryptoStream::Encrypt);
+    Digest            digest;
+    QByteArray        slice(MAX_SLICE_SIZE, Qt::Uninitialized);
+    QByteArray        cipher(static_cast<int>(stream.outputSize(MAX_SLICE_SIZE)), Qt::Uninitialized);
+    qint64            partSize = 0;
+
+    while ((part.error == StoreFS::Success) && (partSize < MAX_PART_SIZE)) {
+        qint64 size = fileIn.read(slice.data(), std::min<qint64>(MAX_SLICE_SIZE, MAX_PART_SIZE - partSize));
+
+        if (size <= 0) {
+            break;
+        }
+
+        auto   slice_c = reinterpret_cast<const unsigned char*>(slice.constData());
+        auto   out_c   = reinterpret_cast<unsigned char*>(cipher.data());
+        size_t written = stream.update(slice_c, static_cast<size_t>(size), out_c, static_cast<size_t>(cipher.size()));
+
+        digest.update(slice_c, static_cast<size_t>(size));
+        partSize += size;
+
+        if (partFile.write(cipher.constData(), static_cast<qint64>(written)) == -1) {
+            part.error = StoreFS::CantWriteToFile;
+        }
+    }
+
+    size_t tagSize = stream.final(reinterpret_cast<unsigned char*>(cipher.data()), static_cast<size_t>(cipher.size()));
+
+    if ((part.error == StoreFS::Success) && (stream.error != Crypto::Success)) {
+        part.error = StoreFS::CantCreateCryptoObject;
+    } else if ((part.error == StoreFS::Success) && (partFile.write(cipher.constData(), static_cast<qint64>(tagSize)) == -1)) {
+        part.error = StoreFS::CantWriteToFile;
+    }
+
+    partFile.close();
+
+    if (part.error != StoreFS::Success) {
+        partFile.remove();
+        return part;
+    }
+
+    part.digest = digest.finalize();
+    part.name   = StoreFSPartStream::partName(file, index, part.digest);
+
+    QString partPath = storePath + "/" + StoreFSPartList::fileName(part.name);
+
+    if (!StoreFS::placePart(partFile, partPath)) {
+        part.error = StoreFS::CantWriteToFile;
+    }
+
+    return part;
+}
+
+/**
+ *  \brief Decrypts the part \c index of \c file into \c path.
+ *
+ *  The part is read, decrypted and digested slice by slice, and the clear
+ *  text is written at the offset of the part in \c path, which must already
+ *  exist. Opens its own handles, so parts can be processed concurrently.
+ *
+ *  \arg \c file The file being decrypted.
+ *  \arg \c index Index of the part.
+ *  \arg \c path Where in the disk the file is being saved.
+ *  \arg \c advance Called with the number of bytes of every written slice.
+ *
+ *  \return The digest of the part, or the error that happened.
+ */
+StoreFSPart StoreFSPrivate::decryptPart(const StoreFSFilePtr &file, const quint32 index, const QString &path, const std::function<void (quint64)> &advance)
+{
+    StoreFSPart part;
+    QFile       partFile(storePath + "/" + file->cryptoParts.name(static_cast<int>(index)));
+    QFile       outFile(path);
+
+    if (!partFile.open(QIODevice::ReadOnly) || !outFile.open(QIODevice::ReadWrite) || !outFile.seek(static_cast<qint64>(index) * MAX_PART_SIZE)) {
+        part.error = StoreFS::CantOpenFile;
+        return part;
+    }
+
+    StoreFSPartStream stream(file, index, CryptoStream::Decrypt);
+    Digest            digest;
+    QByteArray        slice(MAX_SLICE_SIZE, Qt::Uninitialized);
+    QByteArray        clear(MAX_SLICE_SIZE, Qt::Uninitialized);
+
+    while (!partFile.atEnd()) {
+        qint64 size = partFile.read(slice.data(), slice.size());
+
+        if (size <= 0) {
+            break;
+        }
+
+        auto   slice_c = reinterpret_cast<const unsigned char*>(slice.constData());
+        auto   out_c   = reinterpret_cast<unsigned char*>(clear.data());
+        size_t written = stream.update(slice_c, static_cast<size_t>(size), out_c, static_cast<size_t>(clear.size()));
+
+        digest.update(out_c, written);
+
+        if (outFile.write(clear.constData(), static_cast<qint64>(written)) == -1) {
+            part.error = StoreFS::CantWriteToFile;
+            return part;
+        }
+
+        advance(written);
+
+        if (stream.error != Crypto::Success) {
+            break;
+        }
+    }
+
+    size_t written = stream.final(reinterpret_cast<unsigned char*>(clear.data()), static_cast<size_t>(clear.size()));
+
+    digest.update(reinterpret_cast<const unsigned char*>(clear.constData()), written);
+
+    if ((written > 0) && (outFile.write(clear.constData(), static_cast<qint64>(written)) == -1)) {
+        part.error = StoreFS::CantWriteToFile;
+        return part;
+    }
+
+    advance(written);
+
+    part.digest = digest.finalize();
+
+    if ((stream.error != Crypto::Success) || !StoreFSPartStream::checkName(file, index, part.digest)) {
+        part.error = StoreFS::PartCorrupted;
+    }
+
+    return part;
+}
+
+/**
+ *  \brief StoreFSPartStream's private data structure
+ */
+struct StoreFSPartStreamPrivate
+{
+    StoreFSFilePtr                file;           /*!< The file the part belongs to. */
+    quint32                       part;           /*!< Index of the part. */
+    quint32                       frame = 0;      /*!< Index of the current frame. */
+    CryptoStream::Mode            mode;           /*!< Whether encrypting or decrypting. */
+    std::unique_ptr<Crypto>       crypto;         /*!< Crypto of the current frame. */
+    std::unique_ptr<CryptoStream> stream;         /*!< Stream of the current frame. */
+    size_t                        frameBytes = 0; /*!< Input bytes fed to the current frame. */
+    size_t                        frameInput = 0; /*!< Input bytes of a complete frame. 0 for unframed parts. */
+
+    void start();
+};
+
+/**
+ *  \brief Starts a stream over the part \c part of \c file.
+ *
+ *  \arg \c file The file the part belongs to.
+ *  \arg \c part Index of the part.
+ *  \arg \c mode Whether to encrypt or decrypt.
+ */
+StoreFSPartStream::StoreFSPartStream(const StoreFSFilePtr &file, const quint32 part, const CryptoStream::Mode mode)
+{
+    _p.reset(new StoreFSPartStreamPrivate);
+
+    _p->file = file;
+    _p->part = part;
+    _p->mode = mode;
+
+    if (file->format == FRAMED) {
+        _p->frameInput = file->frameSize + (mode == CryptoStream::Decrypt ? Crypto::tagSize() : 0);
+    }
+
+    error = Crypto::Success;
+    _p->start();
+    error = _p->stream->error;
+}
+
+/**
+ *  \brief Default destructor.
+ */
+StoreFSPartStream::~StoreFSPartStream() = default;
+
+/**
+ *  \brief Encrypts or decrypts \c size bytes of \c data into \c output.
+ *
+ *  \c output must hold at least StoreFSPartStream#outputSize(size) bytes.
+ *  When decrypting, frames are authenticated as they are completed.
+ *
+ *  \arg \c data Input.
+ *  \arg \c size Size of \c data.
+ *  \arg \c output Where to write the output.
+ *  \arg \c outputSize Size of \c output.
+ *
+ *  \return Bytes written to \c output. On error, StoreFSPartStream#error is
+ *  set.
+ */
+size_t StoreFSPartStream::update(const unsigned char *data, const size_t size, unsigned char *output, const size_t outputSize)
+{
+    if (error != Crypto::Success) {
+        return 0;
+    }
+
+    if (_p->frameInput == 0) {
+        size_t written = _p->stream->update(data, size, output, outputSize);
+
+        error = _p->stream->error;
+        return written;
+    }
+
+    size_t read    = 0;
+    size_t written = 0;
+
+    while (read < size) {
+        // Frames are closed lazily, only when more input arrives, so a part
+        // never ends with an empty frame.
+        if (_p->frameBytes == _p->frameInput) {
+            written += _p->stream->final(output + written, outputSize - written);
+
+            if (_p->stream->error != Crypto::Success) {
+                error = _p->stream->error;
+                return written;
+            }
+
+            _p->frame++;
+            _p->start();
+        }
+
+        size_t count = std::min(size - read, _p->frameInput - _p->frameBytes);
+
+        written        += _p->stream->update(data + read, count, output + written, outputSize - written);
+        read           += count;
+        _p->frameBytes += count;
+
+        if (_p->stream->error != Crypto::Success) {
+            error = _p->stream->error;
+            return written;
+        }
+    }
+
+    return written;
+}
+
+/**
+ *  \brief Finishes the part.
+ *
+ *  When encrypting, writes the last tag. When decrypting, writes the
+ *  remaining clear text and authenticates the last frame.
+ *
+ *  \arg \c output Where to write the output.
+ *  \arg \c outputSize Size of \c output.
+ *
+ *  \return Bytes written to \c output. On error, StoreFSPartStream#error is
+ *  set.
+ */
+size_t StoreFSPartStream::final(unsigned char *output, const size_t outputSize)
+{
+    if (error != Crypto::Success) {
+        return 0;
+    }
+
+    size_t written = _p->stream->final(output, outputSize);
+
+    error = _p->stream->error;
+    return written;
+}
+
+/**
+ *  \brief Returns how large the output of StoreFSPartStream#update may be.
+ *
+ *  \arg \c size Size of the input.
+ *
+ *  \return Upper bound of the output for \c size bytes of input.
+ */
+size_t StoreFSPartStream::outputSize(const size_t size) const
+{
+    size_t frames = _p->frameInput == 0 ? 1 : size / _p->file->frameSize + 2;
+
+    return size + frames * Crypto::tagSize();
+}
+
+/**
+ *  \brief Returns the nonce of the frame \c frame of the part \c part.
+ *
+ *  The last 8 bytes of the IV of \c file are XORed with the big endian
+ *  <tt>(part << 32) | frame</tt>, which is unique per frame of the file.
+ *  Keys are never shared between files.
+ *
+ *  \arg \c file The file.
+ *  \arg \c part Index of the part.
+ *  \arg \c frame Index of the frame in the part.
+ *
+ *  \return The nonce, with the size of the IV of the file.
+ */
+std::string StoreFSPartStream::frameIV(const StoreFSFilePtr &file, const quint32 part, const quint32 frame)
+{
+    std::string iv       = file->iv.toStdString();
+    quint64     position = (static_cast<quint64>(part) << 32) | frame;
+
+    for (size_t i = 0; (i < 8) && (i < iv.size()); i++) {
+        iv[iv.size() - 1 - i] = static_cast<char>(iv[iv.size() - 1 - i] ^ static_cast<char>((position >> (8 * i)) & 0xFF));
+    }
+
+    return iv;
+}
+
+/**
+ *  \brief Returns the digest that names the part \c part of \c file.
+ *
+ *  The digest of the clear text of the part and the salt of the file are
+ *  digested. The ciphertext of a StoreFSPartFormat#FRAMED part depends on its
+ *  index, so the big endian index is digested too, and identical parts of
+ *  a file get different files.
+ *
+ *  \arg \c file The file.
+ *  \arg \c part Index of the part.
+ *  \arg \c digest Digest of the clear text of the part.
+ *
+ *  \return The raw digest. \see StoreFSPartList#fileName
+ */
+std::string StoreFSPartStream::partName(const StoreFSFilePtr &file, const quint32 part, const std::string &digest)
+{
+    Digest name(file->params);
+
+    name.update(digest);
+    name.update(file->salt.toStdString());
+
+    if (file->format == FRAMED) {
+        unsigned char index[4] = {
+            static_cast<unsigned char>(part >> 24), static_cast<unsigned char>(part >> 16),
+            static_cast<unsigned char>(part >> 8),  static_cast<unsigned char>(part)
+        };
+
+        name.update(index, sizeof(index));
+    }
+
+    return name.finalize();
+}
+
+/**
+ *  \brief Returns whether the part \c part of \c file is named after
+ *  \c digest.
+ *
+ *  \arg \c file The file.
+ *  \arg \c part Index of the part.
+ *  \arg \c digest Digest of the clear text of the part.
+ *
+ *  \return Whether the name matches. \see StoreFSPartStream#partName
+ */
+bool StoreFSPartStream::checkName(const StoreFSFilePtr &file, const quint32 part, const std::string &digest)
+{
+    return file->cryptoParts.matches(static_cast<int>(part), partName(file, part, digest));
+}
+
+/**
+ *  \brief Starts the stream of the current frame.
+ */
+void StoreFSPartStreamPrivate::start()
+{
+    std::string iv = frameInput == 0 ? file->iv.toStdString() : StoreFSPartStream::frameIV(file, part, frame);
+
+    crypto.reset(new Crypto(file->key.toStdString(), iv));
+    stream.reset(new CryptoStream(*crypto, mode));
+    frameBytes = 0;
+}
+
+/**
+ *  \brief Writes the record of \c file to \c stream.
+ *
+ *  \arg \c stream Where to write.
+ *  \arg \c file The file.
+ */
+void StoreFSPrivate::writeRecord(QDataStream &stream, const StoreFSFilePtr &file) const
+{
+    stream << file->path()
+           << file->size
+           << file->metadata
+           << file->key
+           << file->iv
+           << file->salt
+           << file->digest
+           << file->cryptoParts
+           << static_cast<quint8>(file->params.digest)
+           << static_cast<quint8>(file->params.encryption)
+           << static_cast<quint8>(file->params.keyDerivationFunction)
+           << static_cast<quint8>(file->params.keyDerivationHash)
+           << file->params.keyDerivationCost
+           << static_cast<quint8>(file->params.fileDigest)
+           << static_cast<quint8>(file->format)
+           << file->frameSize;
+}
+
+/**
+ *  \brief Decodes the details of \c file from StoreFSFile#index, if they
+ *  are still encoded.
+ *
+ *  A record that can't be decoded is left encoded, so it's never written
+ *  back half read.
+ *
+ *  \arg \c file The file.
+ *
+ *  \return Whether the details of \c file are decoded.
+ */
+bool StoreFSPrivate::decode(const StoreFSFilePtr &file) const
+{
+    QMutexLocker locker(&decodeMutex);
+
+    if (file->index == nullptr) {
+        return true;
+    }
+
+    if (!file->index->decode(file->record, *file)) {
+        return false;
+    }
+
+    file->index.reset();
+
+    return true;
+}
+
+/**
+ *  \brief Reads a file record written in \c version from \c stream.
+ *
+ *  Records older than version 4 name their parts by the hex of the digest.
+ *  A part named otherwise sets the status of \c stream to
+ *  QDataStream#ReadCorruptData.
+ *
+ *  \arg \c stream Where to read from.
+ *  \arg \c version Version of StoreFS that wrote the record.
+ *  \arg \c path Where to read the path of the file to.
+ *
+ *  \return The file, with everything but its id, name and parent set.
+ */
+StoreFSFilePtr StoreFSPrivate::readRecord(QDataStream &stream, const quint32 version, QString &path) const
+{
+    quint8 digest, encryption, keyDerivationFunction, keyDerivationHash;
+    quint8 fileDigest = CHAINED;
+    quint8 format     = SINGLE_MESSAGE;
+
+    StoreFSFilePtr file(new StoreFSFile);
+
+    stream >> path
+    >> file->size
+    >> file->metadata
+    >> file->key
+    >> file->iv
+    >> file->salt
+    >> file->digest;
+
+    if (version >= 4) {
+        stream >> file->cryptoParts;
+    } else {
+        QMap<quint32, QString> partNames;
+
+        stream >> partNames;
+
+        for (QString name : partNames.values()) {
+            if (!StoreFSPartList::isFileName(name)) {
+                stream.setStatus(QDataStream::ReadCorruptData);
+                break;
+            }
+
+            file->cryptoParts.appendDigest(QByteArray::fromHex(name.toLatin1()));
+        }
+    }
+
+    stream >> digest
+    >> encryption
+    >> keyDerivationFunction
+    >> keyDerivationHash
+    >> file->params.keyDerivationCost;
+
+    if (version >= 2) {
+        stream >> fileDigest;
+    }
+
+    if (version >= 3) {
+        stream >> format
+        >> file->frameSize;
+    }
+
+    file->params.digest                = static_cast<DigestType>(digest);
+    file->params.encryption            = static_cast<EncType>(encryption);
+    file->params.keyDerivationFunction = static_cast<KeyDerivationFunction>(keyDerivationFunction);
+    file->params.keyDerivationHash     = static_cast<KeyDerivationHash>(keyDerivationHash);
+    file->params.fileDigest            = static_cast<FileDigestScheme>(fileDigest);
+    file->format                       = static_cast<StoreFSPartFormat>(format);
+
+    return file;
 }
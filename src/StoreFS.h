@@ -23,31 +23,72 @@
 #ifndef STOREDATASTRUCT_H
 #define STOREDATASTRUCT_H
 
+#include <functional>
 #include <memory>
 
+#include <QHash>
 #include <QList>
 #include <QMap>
+#include <QPair>
 
 #include "Crypto.h"
+#include "StoreFSPartList.h"
 
+#define MAX_PART_SIZE   52428800
+#define MAX_SLICE_SIZE  1048576
+#define FRAME_SIZE      262144
+#define FILE_ID_BASE    (static_cast<quint64>(0))
+#define DIR_ID_BASE     (static_cast<quint64>(1) << 63)
+
+class QFile;
+class StoreFileDevice;
 struct StoreFSDir;
 struct StoreFSFile;
+struct StoreFSIndex;
+struct StoreFSPartStreamPrivate;
 struct StoreFSPrivate;
 
 using StoreFSDirPtr  = std::shared_ptr<StoreFSDir>;
 using StoreFSFilePtr = std::shared_ptr<StoreFSFile>;
 
+/**
+ *  \brief Progress callback of transfers. Receives the bytes done so far and
+ *  the total.
+ */
+using StoreFSProgress = std::function<void (quint64, quint64)>;
+
+/**
+ *  \brief Returns the segment named by its argument, as written by
+ *  StoreFS#serializeSegment.
+ */
+using StoreFSSegmentLoader = std::function<QByteArray (const QString)>;
+
 /**
  *  \brief Represents a Directory in the internal structure.
+ *
+ *  Only the name is stored, so moving a directory only relinks it. The path
+ *  is built from the parents when asked for. A directory owns its
+ *  subdirectories and files, which point back to it without owning it, so
+ *  dropping the root releases the whole tree.
  */
 struct StoreFSDir
 {
-    quint64               id;      /*!< Internal session id. */
-    QString               name;    /*!< Name of the directory. */
-    QString               path;    /*!< Path of this directory. Includes it's name. */
-    StoreFSDirPtr         parent;  /*!< Pointer to parent node structure. */
-    QList<StoreFSDirPtr>  subdirs; /*!< Subdirectories list. */
-    QList<StoreFSFilePtr> files;   /*!< Files list. */
+    quint64                       id;               /*!< Internal session id. */
+    QString                       name;             /*!< Name of the directory. */
+    StoreFSDir                   *parent = nullptr; /*!< Pointer to parent node structure. Not owned. nullptr for the root and removed directories. */
+    QList<StoreFSDirPtr>          subdirs;          /*!< Subdirectories list. */
+    QHash<QString, StoreFSDirPtr> subdirsByName;    /*!< StoreFSDir#subdirs by name. */
+    QList<StoreFSFilePtr>         files;            /*!< Files list. */
+
+    QString path() const;
+};
+
+/**
+ *  \brief Layout of the encrypted parts of a file.
+ */
+enum StoreFSPartFormat : uint8_t {
+    SINGLE_MESSAGE = 1, /*!< Each part is one GCM message under the IV of the file. */
+    FRAMED         = 2  /*!< Each part is a sequence of GCM frames, each with its own nonce. \see StoreFSPartStream */
 };
 
 /**
@@ -55,20 +96,59 @@ struct StoreFSDir
  */
 struct StoreFSFile
 {
-    quint64       id;     /*!< Internal session id. */
-    StoreFSDirPtr parent; /*!< Pointer to parent directory. */
+    quint64     id;               /*!< Internal session id. */
+    StoreFSDir *parent = nullptr; /*!< Pointer to parent directory. Not owned. nullptr for removed files. */
 
     QString                   name;     /*!< Name of the file. */
-    QString                   path;     /*!< Path of this file. Includes it's name. */
     quint64                   size;     /*!< Size of the unencrypted file in bytes. */
     QMap<QString, QByteArray> metadata; /*!< A list of metada. For general purpose. */
 
-    QByteArray             key;         /*!< Key used to encrypt this file. */
-    QByteArray             iv;          /*!< IV used to encrypt this file. */
-    QByteArray             salt;        /*!< Salt used on digests. */
-    QByteArray             digest;      /*!< Digest of the unencrypted file. */
-    CryptoParams           params;      /*!< CryptoParams used to encrypt/digest the file. */
-    QMap<quint32, QString> cryptoParts; /*!< Map of name of encrypted file parts. It's a map to guarantee order. Starts at 0. */
+    QByteArray      key;         /*!< Key used to encrypt this file. */
+    QByteArray      iv;          /*!< IV used to encrypt this file. */
+    QByteArray      salt;        /*!< Salt used on digests. */
+    QByteArray      digest;      /*!< Digest of the unencrypted file. */
+    CryptoParams    params;      /*!< CryptoParams used to encrypt/digest the file. */
+    StoreFSPartList cryptoParts; /*!< Names of the encrypted file parts, in part order. */
+
+    StoreFSPartFormat format    = FRAMED;     /*!< Layout of the encrypted parts. */
+    quint32           frameSize = FRAME_SIZE; /*!< Clear text bytes per frame, for StoreFSPartFormat#FRAMED. */
+
+    std::shared_ptr<StoreFSIndex> index;      /*!< Index holding the details of the file while they are still encoded. Empty once decoded. */
+    quint32                       record = 0; /*!< Position of the file in StoreFSFile#index. */
+
+    QString path() const;
+};
+
+/**
+ *  \brief Encrypts or decrypts one part of a file, in the format of the file.
+ *
+ *  For StoreFSPartFormat#FRAMED files, the clear text of a part is cut in
+ *  frames of StoreFSFile#frameSize bytes, the last one possibly shorter.
+ *  Each frame is encrypted separately and followed by its tag, under a nonce
+ *  derived from the IV of the file and the position of the frame. Frame
+ *  \c k of a part starts at <tt>k * (frameSize + tagSize)</tt>, so a frame
+ *  can be read and authenticated without touching the rest of the part.
+ */
+struct StoreFSPartStream
+{
+    /**
+     *  \brief Errors returned by StoreFSPartStream
+     */
+    Crypto::CryptoError error;
+
+    StoreFSPartStream(const StoreFSFilePtr &file, const quint32 part, const CryptoStream::Mode mode);
+    ~StoreFSPartStream();
+
+    size_t update(const unsigned char *data, const size_t size, unsigned char *output, const size_t outputSize);
+    size_t final(unsigned char *output, const size_t outputSize);
+    size_t outputSize(const size_t size) const;
+
+    static std::string frameIV(const StoreFSFilePtr &file, const quint32 part, const quint32 frame);
+    static std::string partName(const StoreFSFilePtr &file, const quint32 part, const std::string &digest);
+    static bool        checkName(const StoreFSFilePtr &file, const quint32 part, const std::string &digest);
+
+private:
+    std::unique_ptr<StoreFSPartStreamPrivate> _p;
 };
 
 struct StoreFS
@@ -77,8 +157,18 @@ struct StoreFS
     ~StoreFS();
 
     QByteArray serialize() const;
+    QByteArray serializeFile(const QString path) const;
+
+    void           load(const QByteArray &data);
+    StoreFSFilePtr loadFile(const QByteArray &data);
+    void           unloadFile(const QString path);
 
-    void load(const QByteArray &data);
+    static QString segment(const QString path);
+
+    QByteArray  serializeSegment(const QString name) const;
+    void        loadSegment(const QByteArray &data);
+    void        setSegments(const QStringList names, const StoreFSSegmentLoader loader);
+    QStringList unreadableSegments() const;
 
     StoreFSDirPtr  dir(const QString path) const;
     StoreFSDirPtr  dir(const quint64 id) const;
@@ -97,9 +187,9 @@ struct StoreFS
 
     QList<quint64> entryBeginsWith(const QString) const;
 
-    QList<quint64> entryEndsWith(const QString) const;
+    QList<quint64> entryEndsWith(const QString, const Qt::CaseSensitivity cs = Qt::CaseSensitive) const;
 
-    QList<quint64> entryContains(const QString) const;
+    QList<quint64> entryContains(const QString, const Qt::CaseSensitivity cs = Qt::CaseSensitive) const;
 
     QList<quint64> entryMatchRegExp(const QString) const;
 
@@ -111,10 +201,19 @@ struct StoreFS
     StoreFSFilePtr addFile(const QString path, const QByteArray data);
     StoreFSFilePtr addFile(const QString filePath, const QString storePath);
     QByteArray     decryptFile(const QString path);
-    void           decryptFile(const QString storePath, const QString path);
+    void           decryptFile(const QString storePath, const QString path, StoreFSProgress progress = nullptr);
     void           moveFile(const QString oldPath, const QString newPath);
     void           removeFile(const QString path);
 
+    static bool placePart(QFile &partFile, const QString &partPath);
+
+    StoreFileDevice *open(const QString path);
+    StoreFileDevice *create(const QString path, std::function<void ()> committed = nullptr);
+
+    void   setMaxPartsInFlight(const int parts);
+    int    maxPartsInFlight() const;
+    double throughput() const;
+
     /**
      *  \brief Errors returned by StoreFS
      */
@@ -123,11 +222,12 @@ struct StoreFS
         CantCreateCryptoObject, /*!< An error occured inside Crypto. */
         CantOpenFile,           /*!< Could not open a file. */
         CantWriteToFile,        /*!< Could not write to a file. */
-        FileTooLarge,           /*!< The file is too large. Use Store#decryptFile(const QString, const QString) instead */
+        FileTooLarge,           /*!< The file is too large to be decrypted in memory. Use StoreFS#decryptFile(const QString, const QString, StoreFSProgress) instead */
         NoSuchFile,             /*!< File does not exist. */
         PartCorrupted,          /*!< The checksum of the part file did not match. Verify that you are using the same parameters used during creation. The file might be just corrupted. */
         WrongCheckSum,          /*!< The checksum of the whole file did not match. Verify that you are using the same parameters used during creation. One of the files might be just corrupted. */
-        FileAlreadyExists       /*!< A destination file already exists. */
+        FileAlreadyExists,      /*!< A destination file already exists. */
+        IndexCorrupted          /*!< A segment or record of the index could not be read. */
     }
 
     /**
@@ -137,6 +237,13 @@ struct StoreFS
 
 private:
     std::unique_ptr<StoreFSPrivate> _p;
+
+    StoreFSFilePtr entry(const QString path) const;
+    bool           writable(const QString path);
+
+    void require(const QString path) const;
+    void requireAll() const;
+    void merge(const QList<QPair<QString, StoreFSFilePtr> > &files);
 };
 
 #endif // STOREDATASTRUCT_H
@@ -0,0 +1,434 @@
+/*
+ *  Copyright (c) 2015 Álan Crístoffer
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ *  sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ *  IN THE SOFTWARE.
+ */
+
+
+#include "StoreFSIndex.h"
+
+#include <algorithm>
+
+#include <QPair>
+#include <QStringList>
+#include <QVector>
+#include <QtEndian>
+
+/*!
+ *  \class StoreFSIndex
+ *  \brief Compact binary layout of the StoreFS index, decoded lazily.
+ *
+ *  Integers are LEB128 varints and byte strings are a varint length followed
+ *  by the bytes. The files are sorted by path, and the index is laid out as:
+ *
+ *  - the number of files;
+ *  - the metadata keys, interned: each key is written once and records
+ *    refer to it by position;
+ *  - the paths, front coded: each one is the number of UTF-8 bytes it shares
+ *    with the previous path followed by the rest, and then the size of the
+ *    file;
+ *  - a table with the offset of each record, as little endian 32 bit
+ *    integers, so any record can be reached without reading the others;
+ *  - the records: metadata, key, IV, salt, digest, CryptoParams, part
+ *    format, frame size and parts. Each part is stored as the binary digest
+ *    its file is named after.
+ *
+ *  Loading only reads the paths and sizes, which is what is needed to build
+ *  the tree. A record is decoded from the buffer in place the first time its
+ *  file is accessed.
+ *
+ *  \see StoreFS#load
+ */
+
+/**
+ *  \brief StoreFSIndex's private data structure
+ */
+struct StoreFSIndexPrivate
+{
+    QByteArray       data;          /*!< The encoded index. Implicitly shared with the caller, not copied. */
+    bool             valid = false; /*!< Whether the paths and the offset table could be read. */
+    QStringList      keys;          /*!< Interned metadata keys. */
+    QStringList      paths;         /*!< Paths of the records, in order. */
+    QVector<quint64> sizes;         /*!< Sizes of the files of the records, in order. */
+    int              offsets = 0;   /*!< Position of the offset table in StoreFSIndexPrivate#data. */
+    int              records = 0;   /*!< Position of the first record in StoreFSIndexPrivate#data. */
+
+    static void putVarint(QByteArray &out, quint64 value);
+    static void putBytes(QByteArray &out, const QByteArray &bytes);
+
+    bool varint(int &pos, quint64 &value) const;
+    bool bytes(int &pos, QByteArray &value) const;
+};
+
+/**
+ *  \brief Encodes \c files in the compact layout.
+ *
+ *  The files must have their details decoded.
+ *
+ *  \arg \c files The files of the index.
+ *
+ *  \return The encoded index.
+ */
+QByteArray StoreFSIndex::encode(const QList<StoreFSFilePtr> &files)
+{
+    QList<QPair<QString, StoreFSFilePtr> > sorted;
+    QMap<QString, quint64>                 keyIndex;
+    QStringList                            keys;
+
+    // Paths are built from the tree, so each is built once.
+    for (StoreFSFilePtr file : files) {
+        sorted << qMakePair(file->path(), file);
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [](const QPair<QString, StoreFSFilePtr> &a, const QPair<QString, StoreFSFilePtr> &b) {
+        return a.first < b.first;
+    });
+
+    for (auto entry : sorted) {
+        for (QString key : entry.second->metadata.keys()) {
+            if (!keyIndex.contains(key)) {
+                keyIndex[key] = static_cast<quint64>(keys.size());
+                keys << key;
+            }
+        }
+    }
+
+    QByteArray data;
+    QByteArray previous;
+
+    StoreFSIndexPrivate::putVarint(data, static_cast<quint64>(sorted.size()));
+    StoreFSIndexPrivate::putVarint(data, static_cast<quint64>(keys.size()));
+
+    for (QString key : keys) {
+        StoreFSIndexPrivate::putBytes(data, key.toUtf8());
+    }
+
+    for (auto entry : sorted) {
+        QByteArray path   = entry.first.toUtf8();
+        int        shared = 0;
+        int        limit  = std::min(path.size(), previous.size());
+
+        while ((shared < limit) && (path.at(shared) == previous.at(shared))) {
+            shared++;
+        }
+
+        StoreFSIndexPrivate::putVarint(data, static_cast<quint64>(shared));
+        StoreFSIndexPrivate::putBytes(data, path.mid(shared));
+        StoreFSIndexPrivate::putVarint(data, entry.second->size);
+
+        previous = path;
+    }
+
+    QByteArray records;
+    QByteArray table(sorted.size() * 4, '\0');
+
+    for (int i = 0; i < sorted.size(); i++) {
+        StoreFSFilePtr file = sorted[i].second;
+
+        qToLittleEndian(static_cast<quint32>(records.size()), table.data() + i * 4);
+
+        StoreFSIndexPrivate::putVarint(records, static_cast<quint64>(file->metadata.size()));
+
+        for (auto it = file->metadata.constBegin(); it != file->metadata.constEnd(); ++it) {
+            StoreFSIndexPrivate::putVarint(records, keyIndex[it.key()]);
+            StoreFSIndexPrivate::putBytes(records, it.value());
+        }
+
+        StoreFSIndexPrivate::putBytes(records, file->key);
+        StoreFSIndexPrivate::putBytes(records, file->iv);
+        StoreFSIndexPrivate::putBytes(records, file->salt);
+        StoreFSIndexPrivate::putBytes(records, file->digest);
+        StoreFSIndexPrivate::putVarint(records, file->params.digest);
+        StoreFSIndexPrivate::putVarint(records, file->params.encryption);
+        StoreFSIndexPrivate::putVarint(records, file->params.keyDerivationFunction);
+        StoreFSIndexPrivate::putVarint(records, file->params.keyDerivationHash);
+        StoreFSIndexPrivate::putVarint(records, file->params.keyDerivationCost);
+        StoreFSIndexPrivate::putVarint(records, file->params.fileDigest);
+        StoreFSIndexPrivate::putVarint(records, file->format);
+        StoreFSIndexPrivate::putVarint(records, file->frameSize);
+        StoreFSIndexPrivate::putVarint(records, static_cast<quint64>(file->cryptoParts.size()));
+
+        for (int part = 0; part < file->cryptoParts.size(); part++) {
+            StoreFSIndexPrivate::putBytes(records, file->cryptoParts.bytes(part));
+        }
+    }
+
+    return data + table + records;
+}
+
+/**
+ *  \brief Reads the paths and the offset table of an encoded index.
+ *
+ *  \arg \c data Buffer holding the index. It's kept, not copied.
+ *  \arg \c start Position of the index in \c data.
+ *
+ *  \see StoreFSIndex#isValid
+ */
+StoreFSIndex::StoreFSIndex(const QByteArray &data, const int start)
+{
+    _p.reset(new StoreFSIndexPrivate);
+    _p->data = data;
+
+    int     pos = start;
+    quint64 count, keyCount;
+
+    if (!_p->varint(pos, count) || !_p->varint(pos, keyCount)) {
+        return;
+    }
+
+    for (quint64 i = 0; i < keyCount; i++) {
+        QByteArray key;
+
+        if (!_p->bytes(pos, key)) {
+            return;
+        }
+
+        _p->keys << QString::fromUtf8(key);
+    }
+
+    QByteArray path;
+
+    _p->paths.reserve(static_cast<int>(count));
+    _p->sizes.reserve(static_cast<int>(count));
+
+    for (quint64 i = 0; i < count; i++) {
+        quint64    shared, size;
+        QByteArray suffix;
+
+        if (!_p->varint(pos, shared) || (shared > static_cast<quint64>(path.size())) || !_p->bytes(pos, suffix) || !_p->varint(pos, size)) {
+            return;
+        }
+
+        path.truncate(static_cast<int>(shared));
+        path.append(suffix);
+
+        _p->paths << QString::fromUtf8(path);
+        _p->sizes << size;
+    }
+
+    _p->offsets = pos;
+    _p->records = pos + static_cast<int>(count) * 4;
+    _p->valid   = _p->records <= _p->data.size();
+}
+
+/**
+ *  \brief Default destructor.
+ */
+StoreFSIndex::~StoreFSIndex() = default;
+
+/**
+ *  \brief Returns whether the index could be read.
+ *
+ *  \return Whether the paths and the offset table could be read. Records are
+ *  only checked by StoreFSIndex#decode.
+ */
+bool StoreFSIndex::isValid() const
+{
+    return _p->valid;
+}
+
+/**
+ *  \brief Returns the number of records.
+ *
+ *  \return The number of files in the index.
+ */
+quint32 StoreFSIndex::count() const
+{
+    return static_cast<quint32>(_p->paths.size());
+}
+
+/**
+ *  \brief Returns the path of the file of \c record.
+ *
+ *  \arg \c record Position of the record.
+ *
+ *  \return The path.
+ */
+QString StoreFSIndex::path(const quint32 record) const
+{
+    return _p->paths[static_cast<int>(record)];
+}
+
+/**
+ *  \brief Returns the size of the file of \c record.
+ *
+ *  \arg \c record Position of the record.
+ *
+ *  \return The size of the unencrypted file in bytes.
+ */
+quint64 StoreFSIndex::size(const quint32 record) const
+{
+    return _p->sizes[static_cast<int>(record)];
+}
+
+/**
+ *  \brief Decodes the details of \c record into \c file.
+ *
+ *  \c file is only changed if the whole record could be read.
+ *
+ *  \arg \c record Position of the record.
+ *  \arg \c file Where to decode to. Its id, name, parent and size are
+ *  left untouched.
+ *
+ *  \return Whether the record could be decoded.
+ */
+bool StoreFSIndex::decode(const quint32 record, StoreFSFile &file) const
+{
+    if (!_p->valid || (record >= count())) {
+        return false;
+    }
+
+    quint32 offset = qFromLittleEndian<quint32>(_p->data.constData() + _p->offsets + record * 4);
+
+    if (offset >= static_cast<quint32>(_p->data.size() - _p->records)) {
+        return false;
+    }
+
+    int                       pos = _p->records + static_cast<int>(offset);
+    QMap<QString, QByteArray> metadata;
+    QByteArray                key, iv, salt, fileDigest;
+    StoreFSPartList           cryptoParts;
+    quint64                   metadataCount, digest, encryption, keyDerivationFunction, keyDerivationHash, keyDerivationCost, digestScheme, format, frameSize, parts;
+
+    if (!_p->varint(pos, metadataCount)) {
+        return false;
+    }
+
+    for (quint64 i = 0; i < metadataCount; i++) {
+        quint64    keyIndex;
+        QByteArray value;
+
+        if (!_p->varint(pos, keyIndex) || (keyIndex >= static_cast<quint64>(_p->keys.size())) || !_p->bytes(pos, value)) {
+            return false;
+        }
+
+        metadata[_p->keys[static_cast<int>(keyIndex)]] = value;
+    }
+
+    if (!_p->bytes(pos, key) || !_p->bytes(pos, iv) || !_p->bytes(pos, salt) || !_p->bytes(pos, fileDigest)
+        || !_p->varint(pos, digest) || !_p->varint(pos, encryption) || !_p->varint(pos, keyDerivationFunction) || !_p->varint(pos, keyDerivationHash)
+        || !_p->varint(pos, keyDerivationCost) || !_p->varint(pos, digestScheme) || !_p->varint(pos, format) || !_p->varint(pos, frameSize)
+        || !_p->varint(pos, parts)) {
+        return false;
+    }
+
+    for (quint64 i = 0; i < parts; i++) {
+        QByteArray partDigest;
+
+        if (!_p->bytes(pos, partDigest) || partDigest.isEmpty()) {
+            return false;
+        }
+
+        cryptoParts.appendDigest(partDigest);
+    }
+
+    file.metadata                     = metadata;
+    file.key                          = key;
+    file.iv                           = iv;
+    file.salt                         = salt;
+    file.digest                       = fileDigest;
+    file.cryptoParts                  = cryptoParts;
+    file.params.digest                = static_cast<DigestType>(digest);
+    file.params.encryption            = static_cast<EncType>(encryption);
+    file.params.keyDerivationFunction = static_cast<KeyDerivationFunction>(keyDerivationFunction);
+    file.params.keyDerivationHash     = static_cast<KeyDerivationHash>(keyDerivationHash);
+    file.params.keyDerivationCost     = static_cast<uint32_t>(keyDerivationCost);
+    file.params.fileDigest            = static_cast<FileDigestScheme>(digestScheme);
+    file.format                       = static_cast<StoreFSPartFormat>(format);
+    file.frameSize                    = static_cast<quint32>(frameSize);
+
+    return true;
+}
+
+/**
+ *  \brief Appends \c value to \c out as a LEB128 varint.
+ *
+ *  \arg \c out Where to write.
+ *  \arg \c value The value.
+ */
+void StoreFSIndexPrivate::putVarint(QByteArray &out, quint64 value)
+{
+    while (value >= 0x80) {
+        out.append(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+
+    out.append(static_cast<char>(value));
+}
+
+/**
+ *  \brief Appends \c bytes to \c out, prefixed by its length.
+ *
+ *  \arg \c out Where to write.
+ *  \arg \c bytes The bytes.
+ */
+void StoreFSIndexPrivate::putBytes(QByteArray &out, const QByteArray &bytes)
+{
+    putVarint(out, static_cast<quint64>(bytes.size()));
+    out.append(bytes);
+}
+
+/**
+ *  \brief Reads a varint at \c pos and moves past it.
+ *
+ *  \arg \c pos Position in StoreFSIndexPrivate#data.
+ *  \arg \c value Where to read to.
+ *
+ *  \return Whether it was inside the buffer.
+ */
+bool StoreFSIndexPrivate::varint(int &pos, quint64 &value) const
+{
+    const int size = data.size();
+
+    value = 0;
+
+    for (int shift = 0; (pos < size) && (shift < 64); shift += 7) {
+        quint8 byte = static_cast<quint8>(data.constData()[pos++]);
+
+        value |= static_cast<quint64>(byte & 0x7F) << shift;
+
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ *  \brief Reads a byte string at \c pos and moves past it.
+ *
+ *  \arg \c pos Position in StoreFSIndexPrivate#data.
+ *  \arg \c value Where to read to.
+ *
+ *  \return Whether it was inside the buffer.
+ */
+bool StoreFSIndexPrivate::bytes(int &pos, QByteArray &value) const
+{
+    quint64 length;
+
+    if (!varint(pos, length) || (length > static_cast<quint64>(data.size() - pos))) {
+        return false;
+    }
+
+    value = QByteArray(data.constData() + pos, static_cast<int>(length));
+    pos  += static_cast<int>(length);
+
+    return true;
+}
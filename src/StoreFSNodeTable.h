@@ -0,0 +1,206 @@
+/*
+ *  Copyright (c) 2015 Álan Crístoffer
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ *  sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ *  IN THE SOFTWARE.
+ */
+
+#ifndef STOREFSNODETABLE_H
+#define STOREFSNODETABLE_H
+
+#include <memory>
+
+#include <QList>
+#include <QVector>
+
+/*!
+ *  \class StoreFSNodeTable
+ *  \brief Holds the nodes of a StoreFS in a dense table indexed by their IDs.
+ *
+ *  The ID of a node is the base of the table plus the slot it's kept in, so
+ *  looking a node up is an array access. Slots freed by StoreFSNodeTable#remove
+ *  are reused by the next StoreFSNodeTable#insert, so the table stays as
+ *  large as the most nodes it held at once, and listing the nodes walks a
+ *  contiguous array.
+ */
+template<typename T>
+struct StoreFSNodeTable
+{
+    explicit StoreFSNodeTable(const quint64 base = 0);
+
+    quint64 insert(const std::shared_ptr<T> &node);
+    void    remove(const quint64 id);
+    void    clear();
+
+    bool               contains(const quint64 id) const;
+    std::shared_ptr<T> value(const quint64 id) const;
+    int                size() const;
+
+    QList<quint64>             ids() const;
+    QList<std::shared_ptr<T> > values() const;
+
+private:
+    quint64                      base;      /*!< ID of the first slot. */
+    QVector<std::shared_ptr<T> > slots;     /*!< Nodes, by ID minus StoreFSNodeTable#base. Empty where a node was removed. */
+    QVector<int>                 freeSlots; /*!< Empty slots, reused before the table grows. */
+};
+
+/**
+ *  \brief Constructs an empty table.
+ *
+ *  \arg \c base ID of the first node.
+ */
+template<typename T>
+StoreFSNodeTable<T>::StoreFSNodeTable(const quint64 base) : base(base)
+{
+}
+
+/**
+ *  \brief Adds \c node to the table and sets its ID.
+ *
+ *  \arg \c node The node.
+ *
+ *  \return The ID of \c node.
+ */
+template<typename T>
+quint64 StoreFSNodeTable<T>::insert(const std::shared_ptr<T> &node)
+{
+    int slot;
+
+    if (freeSlots.isEmpty()) {
+        slot = slots.size();
+        slots << node;
+    } else {
+        slot        = freeSlots.takeLast();
+        slots[slot] = node;
+    }
+
+    node->id = base + static_cast<quint64>(slot);
+
+    return node->id;
+}
+
+/**
+ *  \brief Removes the node \c id from the table. Its ID may be given to a
+ *  node inserted later.
+ *
+ *  \arg \c id The ID of the node.
+ */
+template<typename T>
+void StoreFSNodeTable<T>::remove(const quint64 id)
+{
+    if (!contains(id)) {
+        return;
+    }
+
+    int slot = static_cast<int>(id - base);
+
+    slots[slot].reset();
+    freeSlots << slot;
+}
+
+/**
+ *  \brief Removes every node from the table.
+ */
+template<typename T>
+void StoreFSNodeTable<T>::clear()
+{
+    slots.clear();
+    freeSlots.clear();
+}
+
+/**
+ *  \brief Returns whether the node \c id is in the table.
+ *
+ *  \arg \c id The ID of the node.
+ *
+ *  \return Whether the node is in the table.
+ */
+template<typename T>
+bool StoreFSNodeTable<T>::contains(const quint64 id) const
+{
+    return (id >= base) && (id - base < static_cast<quint64>(slots.size())) && (slots.at(static_cast<int>(id - base)) != nullptr);
+}
+
+/**
+ *  \brief Returns the node \c id.
+ *
+ *  \arg \c id The ID of the node.
+ *
+ *  \return The node, or nullptr if it's not in the table.
+ */
+template<typename T>
+std::shared_ptr<T> StoreFSNodeTable<T>::value(const quint64 id) const
+{
+    return contains(id) ? slots.at(static_cast<int>(id - base)) : nullptr;
+}
+
+/**
+ *  \brief Returns the number of nodes in the table.
+ *
+ *  \return The number of nodes.
+ */
+template<typename T>
+int StoreFSNodeTable<T>::size() const
+{
+    return slots.size() - freeSlots.size();
+}
+
+/**
+ *  \brief Returns the IDs of the nodes in the table, sorted.
+ *
+ *  \return The IDs.
+ */
+template<typename T>
+QList<quint64> StoreFSNodeTable<T>::ids() const
+{
+    QList<quint64> ids;
+
+    ids.reserve(size() );
+
+    for (int slot = 0; slot < slots.size(); slot++) {
+        if (slots.at(slot) != nullptr) {
+            ids << base + static_cast<quint64>(slot);
+        }
+    }
+
+    return ids;
+}
+
+/**
+ *  \brief Returns the nodes in the table, sorted by ID.
+ *
+ *  \return The nodes.
+ */
+template<typename T>
+QList<std::shared_ptr<T> > StoreFSNodeTable<T>::values() const
+{
+    QList<std::shared_ptr<T> > nodes;
+
+    nodes.reserve(size() );
+
+    for (const std::shared_ptr<T> &node : slots) {
+        if (node != nullptr) {
+            nodes << node;
+        }
+    }
+
+    return nodes;
+}
+
+#endif // STOREFSNODETABLE_H
@@ -0,0 +1,276 @@
+/*
+ *  Copyright (c) 2015 Álan Crístoffer
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ *  sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ *  IN THE SOFTWARE.
+ */
+
+#include "StoreFSPartList.h"
+
+#include <cstring>
+
+/*!
+ *  \class StoreFSPartList
+ *  \brief Names of the encrypted parts of a file, in part order.
+ *
+ *  Parts are stored under the upper case hex of a digest. The list keeps
+ *  the raw digests one after the other in a single buffer. They're only
+ *  turned into file names, at twice their size, when a part is opened.
+ *  Parts can be checked against a digest without encoding it.
+ */
+
+/**
+ *  \brief Returns the number of parts.
+ *
+ *  \return The number of parts.
+ */
+int StoreFSPartList::size() const
+{
+    return ends.size();
+}
+
+/**
+ *  \brief Returns whether there are no parts.
+ *
+ *  \return Whether the list is empty.
+ */
+bool StoreFSPartList::isEmpty() const
+{
+    return ends.isEmpty();
+}
+
+/**
+ *  \brief Removes every part.
+ */
+void StoreFSPartList::clear()
+{
+    data.clear();
+    ends.clear();
+}
+
+/**
+ *  \brief Removes the last part.
+ */
+void StoreFSPartList::removeLast()
+{
+    if (ends.isEmpty()) {
+        return;
+    }
+
+    ends.removeLast();
+    data.truncate(ends.isEmpty() ? 0 : static_cast<int>(ends.last()));
+}
+
+/**
+ *  \brief Appends the part stored under the hex of \c digest.
+ *
+ *  \arg \c digest The raw digest.
+ */
+void StoreFSPartList::appendDigest(const QByteArray &digest)
+{
+    data.append(digest);
+    ends << static_cast<quint32>(data.size());
+}
+
+/**
+ *  \brief Returns the raw digest of \c part.
+ *
+ *  \arg \c part Index of the part.
+ *
+ *  \return The raw digest, or an empty QByteArray if there's no such part.
+ */
+QByteArray StoreFSPartList::bytes(const int part) const
+{
+    if ((part < 0) || (part >= ends.size())) {
+        return QByteArray();
+    }
+
+    int start = part == 0 ? 0 : static_cast<int>(ends.at(part - 1));
+
+    return data.mid(start, static_cast<int>(ends.at(part)) - start);
+}
+
+/**
+ *  \brief Returns whether \c part is stored under the hex of \c digest.
+ *
+ *  \arg \c part Index of the part.
+ *  \arg \c digest The raw digest.
+ *
+ *  \return Whether \c digest names \c part.
+ */
+bool StoreFSPartList::matches(const int part, const std::string &digest) const
+{
+    if ((part < 0) || (part >= ends.size())) {
+        return false;
+    }
+
+    int start = part == 0 ? 0 : static_cast<int>(ends.at(part - 1));
+    int size  = static_cast<int>(ends.at(part)) - start;
+
+    return (static_cast<size_t>(size) == digest.size()) && (memcmp(data.constData() + start, digest.data(), digest.size()) == 0);
+}
+
+/**
+ *  \brief Returns the name of the file of \c part.
+ *
+ *  \arg \c part Index of the part.
+ *
+ *  \return The name, or an empty QString if there's no such part.
+ */
+QString StoreFSPartList::name(const int part) const
+{
+    QByteArray stored = bytes(part);
+
+    if (stored.isEmpty()) {
+        return QString();
+    }
+
+    return QString::fromLatin1(stored.toHex().toUpper());
+}
+
+/**
+ *  \brief Returns the names of the files of every part, in order.
+ *
+ *  \return The names.
+ */
+QStringList StoreFSPartList::names() const
+{
+    QStringList list;
+
+    list.reserve(ends.size());
+
+    for (int i = 0; i < ends.size(); i++) {
+        list << name(i);
+    }
+
+    return list;
+}
+
+/**
+ *  \brief Returns whether both lists name the same parts.
+ *
+ *  \arg \c other The other list.
+ *
+ *  \return Whether the lists are equal.
+ */
+bool StoreFSPartList::operator==(const StoreFSPartList &other) const
+{
+    return (ends == other.ends) && (data == other.data);
+}
+
+/**
+ *  \brief Returns whether the lists name different parts.
+ *
+ *  \arg \c other The other list.
+ *
+ *  \return Whether the lists differ.
+ */
+bool StoreFSPartList::operator!=(const StoreFSPartList &other) const
+{
+    return !(*this == other);
+}
+
+/**
+ *  \brief Returns the name of the file of the part with \c digest.
+ *
+ *  \arg \c digest The raw digest.
+ *
+ *  \return The upper case hex of \c digest.
+ */
+QString StoreFSPartList::fileName(const std::string &digest)
+{
+    return QString::fromLatin1(QByteArray::fromRawData(digest.data(), static_cast<int>(digest.size())).toHex().toUpper());
+}
+
+/**
+ *  \brief Returns whether \c name is upper case hex of whole bytes, as
+ *  written by Crypto#stringToHex and StoreFSPartList#fileName.
+ *
+ *  \arg \c name The part name.
+ *
+ *  \return Whether \c name is the name of a part file.
+ */
+bool StoreFSPartList::isFileName(const QString &name)
+{
+    if (name.isEmpty() || (name.size() % 2 != 0)) {
+        return false;
+    }
+
+    for (QChar c : name) {
+        ushort u = c.unicode();
+
+        if (!(((u >= '0') && (u <= '9')) || ((u >= 'A') && (u <= 'F')))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ *  \brief Writes the number of parts and the raw digest of each one.
+ *
+ *  \arg \c stream The stream.
+ *  \arg \c parts The parts.
+ *
+ *  \return \c stream.
+ */
+QDataStream &operator<<(QDataStream &stream, const StoreFSPartList &parts)
+{
+    stream << static_cast<quint32>(parts.size());
+
+    for (int i = 0; i < parts.size(); i++) {
+        stream << parts.bytes(i);
+    }
+
+    return stream;
+}
+
+/**
+ *  \brief Reads parts written by operator<<(QDataStream &, const StoreFSPartList &).
+ *
+ *  An empty digest sets the status of \c stream to
+ *  QDataStream#ReadCorruptData.
+ *
+ *  \arg \c stream The stream.
+ *  \arg \c parts Where to read to.
+ *
+ *  \return \c stream.
+ */
+QDataStream &operator>>(QDataStream &stream, StoreFSPartList &parts)
+{
+    quint32 count = 0;
+
+    stream >> count;
+
+    parts.clear();
+
+    for (quint32 i = 0; (i < count) && (stream.status() == QDataStream::Ok); i++) {
+        QByteArray digest;
+
+        stream >> digest;
+
+        if (digest.isEmpty()) {
+            stream.setStatus(QDataStream::ReadCorruptData);
+        } else {
+            parts.appendDigest(digest);
+        }
+    }
+
+    return stream;
+}
@@ -0,0 +1,63 @@
+/*
+ *  Copyright (c) 2015 Álan Crístoffer
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ *  sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ *  IN THE SOFTWARE.
+ */
+
+#ifndef STOREFSPARTLIST_H
+#define STOREFSPARTLIST_H
+
+#include <string>
+
+#include <QByteArray>
+#include <QDataStream>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+struct StoreFSPartList
+{
+    int  size() const;
+    bool isEmpty() const;
+    void clear();
+    void removeLast();
+
+    void appendDigest(const QByteArray &digest);
+
+    QByteArray bytes(const int part) const;
+    bool       matches(const int part, const std::string &digest) const;
+
+    QString     name(const int part) const;
+    QStringList names() const;
+
+    bool operator==(const StoreFSPartList &other) const;
+    bool operator!=(const StoreFSPartList &other) const;
+
+    static QString fileName(const std::string &digest);
+    static bool    isFileName(const QString &name);
+
+private:
+    QByteArray       data; /*!< Raw digest of each part, one after the other. */
+    QVector<quint32> ends; /*!< Where each part ends in StoreFSPartList#data. */
+};
+
+QDataStream &operator<<(QDataStream &stream, const StoreFSPartList &parts);
+QDataStream &operator>>(QDataStream &stream, StoreFSPartList &parts);
+
+#endif // STOREFSPARTLIST_H
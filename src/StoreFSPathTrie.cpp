@@ -0,0 +1,493 @@
+/*
+ *  Copyright (c) 2015 Álan Crístoffer
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ *  sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ *  IN THE SOFTWARE.
+ */
+
+#include "StoreFSPathTrie.h"
+
+#include <algorithm>
+#include <map>
+
+/*!
+ *  \class StoreFSPathTrie
+ *  \brief Maps the paths of a StoreFS to their IDs in a radix tree.
+ *
+ *  Each edge is labelled with the characters the paths below it share, so
+ *  there are only nodes where paths end or branch. Looking up a path takes
+ *  time proportional to its length, and listing the paths that start with a
+ *  prefix takes time proportional to the prefix and the number of matches,
+ *  whatever the number of paths in the tree.
+ *
+ *  Children are kept sorted, so paths are listed in the same order as the
+ *  keys of a QMap.
+ */
+
+/**
+ *  \brief StoreFSPathTrie's private data structure
+ */
+struct StoreFSPathTriePrivate
+{
+    /**
+     *  \brief A node of the tree.
+     */
+    struct Node
+    {
+        QString                                label;            /*!< Characters of the edge from the parent to this node. */
+        bool                                   terminal = false; /*!< Whether a path ends at this node. */
+        quint64                                id       = 0;     /*!< ID of the path that ends at this node. */
+        std::map<QChar, std::unique_ptr<Node> > children;        /*!< Children, by the first character of their label. */
+    };
+
+    Node root;     /*!< Root of the tree. Its label is empty. */
+    int  size = 0; /*!< Number of paths in the tree. */
+
+    const Node *find(const QString &path) const;
+    const Node *reach(const QString &prefix) const;
+    Node       *split(const QString &prefix);
+    bool        remove(Node *node, const QString &path, const int pos);
+    void        prune(Node *node, const QString &path, const int pos);
+    void        tidy(Node *node, const QChar first);
+    void        collect(const Node *node, QList<quint64> &ids) const;
+    void        collect(const Node *node, const QString &prefix, QStringList &paths) const;
+};
+
+/**
+ *  \brief Constructs an empty tree.
+ */
+StoreFSPathTrie::StoreFSPathTrie()
+{
+    _p.reset(new StoreFSPathTriePrivate);
+}
+
+/**
+ *  \brief Default destructor.
+ */
+StoreFSPathTrie::~StoreFSPathTrie() = default;
+
+/**
+ *  \brief Maps \c path to \c id, replacing its ID if it's already there.
+ *
+ *  \arg \c path The path.
+ *  \arg \c id The ID.
+ */
+void StoreFSPathTrie::insert(const QString &path, const quint64 id)
+{
+    StoreFSPathTriePrivate::Node *node = _p->split(path);
+
+    if (!node->terminal) {
+        node->terminal = true;
+        _p->size++;
+    }
+
+    node->id = id;
+}
+
+/**
+ *  \brief Removes \c path from the tree.
+ *
+ *  Nodes left without a path are removed, and edges left without a branch
+ *  are merged, so the tree is the same as if \c path had never been there.
+ *
+ *  \arg \c path The path.
+ *
+ *  \return Whether \c path was in the tree.
+ */
+bool StoreFSPathTrie::remove(const QString &path)
+{
+    if (!_p->remove(&_p->root, path, 0)) {
+        return false;
+    }
+
+    _p->size--;
+
+    return true;
+}
+
+/**
+ *  \brief Replaces the prefix \c from by \c to in every path that starts
+ *  with it.
+ *
+ *  The branch below \c from is detached and linked below \c to as it is, so
+ *  it takes time proportional to the length of the prefixes, whatever the
+ *  number of paths moved. No path may start with \c to, and \c to must not
+ *  start with \c from.
+ *
+ *  \arg \c from The prefix to replace.
+ *  \arg \c to The new prefix.
+ *
+ *  \return Whether any path started with \c from.
+ */
+bool StoreFSPathTrie::move(const QString &from, const QString &to)
+{
+    using Node = StoreFSPathTriePrivate::Node;
+
+    if (from.isEmpty() || (_p->reach(from) == nullptr)) {
+        return false;
+    }
+
+    Node *source = _p->split(from);
+    Node  branch;
+
+    branch.terminal = source->terminal;
+    branch.id       = source->id;
+    branch.children.swap(source->children);
+    source->terminal = false;
+
+    _p->prune(&_p->root, from, 0);
+
+    Node *target = _p->split(to);
+
+    target->terminal = branch.terminal;
+    target->id       = branch.id;
+    target->children.swap(branch.children);
+
+    // The target may now have a single child it has to be merged with.
+    _p->prune(&_p->root, to, 0);
+
+    return true;
+}
+
+/**
+ *  \brief Removes every path from the tree.
+ */
+void StoreFSPathTrie::clear()
+{
+    _p->root.children.clear();
+    _p->root.terminal = false;
+    _p->size          = 0;
+}
+
+/**
+ *  \brief Returns whether \c path is in the tree.
+ *
+ *  \arg \c path The path.
+ *
+ *  \return Whether \c path is in the tree.
+ */
+bool StoreFSPathTrie::contains(const QString &path) const
+{
+    return _p->find(path) != nullptr;
+}
+
+/**
+ *  \brief Returns the ID of \c path.
+ *
+ *  \arg \c path The path.
+ *
+ *  \return The ID of \c path, or 0 if it's not in the tree.
+ */
+quint64 StoreFSPathTrie::value(const QString &path) const
+{
+    const StoreFSPathTriePrivate::Node *node = _p->find(path);
+
+    return node != nullptr ? node->id : 0;
+}
+
+/**
+ *  \brief Returns the number of paths in the tree.
+ *
+ *  \return The number of paths.
+ */
+int StoreFSPathTrie::size() const
+{
+    return _p->size;
+}
+
+/**
+ *  \brief Returns every path in the tree, sorted.
+ *
+ *  \return The paths.
+ */
+QStringList StoreFSPathTrie::keys() const
+{
+    QStringList paths;
+
+    _p->collect(&_p->root, QString(), paths);
+
+    return paths;
+}
+
+/**
+ *  \brief Returns the IDs of the paths that start with \c prefix, sorted by
+ *  path.
+ *
+ *  \arg \c prefix The prefix.
+ *
+ *  \return The IDs.
+ */
+QList<quint64> StoreFSPathTrie::withPrefix(const QString &prefix) const
+{
+    const StoreFSPathTriePrivate::Node *node = _p->reach(prefix);
+    QList<quint64>                      ids;
+
+    if (node != nullptr) {
+        _p->collect(node, ids);
+    }
+
+    return ids;
+}
+
+/**
+ *  \brief Returns the node where \c path ends.
+ *
+ *  \arg \c path The path.
+ *
+ *  \return The node, or nullptr if \c path is not in the tree.
+ */
+const StoreFSPathTriePrivate::Node *StoreFSPathTriePrivate::find(const QString &path) const
+{
+    const Node *node = &root;
+    int         pos  = 0;
+
+    while (pos < path.size()) {
+        auto it = node->children.find(path.at(pos));
+
+        if (it == node->children.end()) {
+            return nullptr;
+        }
+
+        const Node *child = it->second.get();
+
+        if (path.midRef(pos, child->label.size()) != child->label) {
+            return nullptr;
+        }
+
+        node = child;
+        pos += child->label.size();
+    }
+
+    return node->terminal ? node : nullptr;
+}
+
+/**
+ *  \brief Returns the highest node whose paths all start with \c prefix.
+ *
+ *  \arg \c prefix The prefix.
+ *
+ *  \return The node where \c prefix ends, or the node at the end of the edge
+ *  where it ends halfway, or nullptr if no path starts with \c prefix.
+ */
+const StoreFSPathTriePrivate::Node *StoreFSPathTriePrivate::reach(const QString &prefix) const
+{
+    const Node *node = &root;
+    int         pos  = 0;
+
+    while (pos < prefix.size()) {
+        auto it = node->children.find(prefix.at(pos));
+
+        if (it == node->children.end()) {
+            return nullptr;
+        }
+
+        const Node *child = it->second.get();
+        int         count = std::min(child->label.size(), prefix.size() - pos);
+
+        // The prefix may end halfway through the edge.
+        if (prefix.midRef(pos, count) != child->label.leftRef(count)) {
+            return nullptr;
+        }
+
+        node = child;
+        pos += count;
+    }
+
+    return node;
+}
+
+/**
+ *  \brief Returns the node where \c prefix ends, creating it if needed.
+ *
+ *  Edges that \c prefix leaves or ends halfway through are split, so there
+ *  is a node exactly at \c prefix. A new node holds no path.
+ *
+ *  \arg \c prefix The prefix.
+ *
+ *  \return The node.
+ */
+StoreFSPathTriePrivate::Node *StoreFSPathTriePrivate::split(const QString &prefix)
+{
+    Node *node = &root;
+    int   pos  = 0;
+
+    while (pos < prefix.size()) {
+        auto it = node->children.find(prefix.at(pos));
+
+        if (it == node->children.end()) {
+            Node *leaf = new Node;
+
+            leaf->label = prefix.mid(pos);
+            node->children[prefix.at(pos)].reset(leaf);
+
+            return leaf;
+        }
+
+        Node *child  = it->second.get();
+        int   shared = 0;
+        int   limit  = std::min(child->label.size(), prefix.size() - pos);
+
+        while ((shared < limit) && (child->label.at(shared) == prefix.at(pos + shared))) {
+            shared++;
+        }
+
+        // The prefix leaves the edge halfway, so it's split where they differ.
+        if (shared < child->label.size()) {
+            std::unique_ptr<Node> middle(new Node);
+
+            middle->label = child->label.left(shared);
+            child->label.remove(0, shared);
+            middle->children[child->label.at(0)] = std::move(it->second);
+            it->second = std::move(middle);
+
+            child = it->second.get();
+        }
+
+        node = child;
+        pos += shared;
+    }
+
+    return node;
+}
+
+/**
+ *  \brief Removes the rest of \c path, from \c pos, below \c node.
+ *
+ *  \arg \c node The node reached by the first \c pos characters of \c path.
+ *  \arg \c path The path.
+ *  \arg \c pos Number of characters of \c path already matched.
+ *
+ *  \return Whether \c path was in the tree.
+ */
+bool StoreFSPathTriePrivate::remove(Node *node, const QString &path, const int pos)
+{
+    if (pos == path.size()) {
+        if (!node->terminal) {
+            return false;
+        }
+
+        node->terminal = false;
+
+        return true;
+    }
+
+    auto it = node->children.find(path.at(pos));
+
+    if (it == node->children.end()) {
+        return false;
+    }
+
+    Node *child = it->second.get();
+
+    if ((path.midRef(pos, child->label.size()) != child->label) || !remove(child, path, pos + child->label.size())) {
+        return false;
+    }
+
+    tidy(node, path.at(pos));
+
+    return true;
+}
+
+/**
+ *  \brief Tidies every node on the way of \c path, from \c pos, below
+ *  \c node.
+ *
+ *  \arg \c node The node reached by the first \c pos characters of \c path.
+ *  \arg \c path The path.
+ *  \arg \c pos Number of characters of \c path already matched.
+ *
+ *  \see StoreFSPathTriePrivate#tidy
+ */
+void StoreFSPathTriePrivate::prune(Node *node, const QString &path, const int pos)
+{
+    if (pos == path.size()) {
+        return;
+    }
+
+    auto it = node->children.find(path.at(pos));
+
+    if ((it == node->children.end()) || (path.midRef(pos, it->second->label.size()) != it->second->label)) {
+        return;
+    }
+
+    prune(it->second.get(), path, pos + it->second->label.size());
+    tidy(node, path.at(pos));
+}
+
+/**
+ *  \brief Removes the child of \c node starting with \c first if it holds
+ *  no path, or merges it with its only child if no path ends at it.
+ *
+ *  \arg \c node The parent node.
+ *  \arg \c first The first character of the label of the child.
+ */
+void StoreFSPathTriePrivate::tidy(Node *node, const QChar first)
+{
+    auto it = node->children.find(first);
+
+    if (it == node->children.end()) {
+        return;
+    }
+
+    Node *child = it->second.get();
+
+    if (!child->terminal && child->children.empty()) {
+        node->children.erase(it);
+    } else if (!child->terminal && (child->children.size() == 1)) {
+        std::unique_ptr<Node> grandchild = std::move(child->children.begin()->second);
+
+        grandchild->label.prepend(child->label);
+        it->second = std::move(grandchild);
+    }
+}
+
+/**
+ *  \brief Appends the IDs of the paths ending at or below \c node, sorted by
+ *  path.
+ *
+ *  \arg \c node The node.
+ *  \arg \c ids Where to append the IDs.
+ */
+void StoreFSPathTriePrivate::collect(const Node *node, QList<quint64> &ids) const
+{
+    if (node->terminal) {
+        ids << node->id;
+    }
+
+    for (auto &child : node->children) {
+        collect(child.second.get(), ids);
+    }
+}
+
+/**
+ *  \brief Appends the paths ending at or below \c node, sorted.
+ *
+ *  \arg \c node The node.
+ *  \arg \c prefix The path that reaches \c node.
+ *  \arg \c paths Where to append the paths.
+ */
+void StoreFSPathTriePrivate::collect(const Node *node, const QString &prefix, QStringList &paths) const
+{
+    if (node->terminal) {
+        paths << prefix;
+    }
+
+    for (auto &child : node->children) {
+        collect(child.second.get(), prefix + child.second->label, paths);
+    }
+}
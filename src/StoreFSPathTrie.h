@@ -0,0 +1,55 @@
+/*
+ *  Copyright (c) 2015 Álan Crístoffer
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ *  sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ *  IN THE SOFTWARE.
+ */
+
+#ifndef STOREFSPATHTRIE_H
+#define STOREFSPATHTRIE_H
+
+#include <memory>
+
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+struct StoreFSPathTriePrivate;
+
+struct StoreFSPathTrie
+{
+    StoreFSPathTrie();
+    ~StoreFSPathTrie();
+
+    void insert(const QString &path, const quint64 id);
+    bool remove(const QString &path);
+    bool move(const QString &from, const QString &to);
+    void clear();
+
+    bool    contains(const QString &path) const;
+    quint64 value(const QString &path) const;
+    int     size() const;
+
+    QStringList    keys() const;
+    QList<quint64> withPrefix(const QString &prefix) const;
+
+private:
+    std::unique_ptr<StoreFSPathTriePrivate> _p;
+};
+
+#endif // STOREFSPATHTRIE_H
@@ -0,0 +1,289 @@
+/*
+ *  Copyright (c) 2015 Álan Crístoffer
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ *  sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ *  IN THE SOFTWARE.
+ */
+
+#include "StoreFSTrigramIndex.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+
+#include <QHash>
+#include <QVector>
+
+/*!
+ *  \class StoreFSTrigramIndex
+ *  \brief Inverted index of the trigrams of the paths of a StoreFS, for
+ *  substring and suffix searches.
+ *
+ *  Each path is case folded and cut in every run of three characters, and
+ *  the ID of the path is listed under each of them. The lists are kept
+ *  sorted by ID. A search takes the trigrams of the string it looks for,
+ *  intersects their lists, starting with the shortest, and only checks the
+ *  paths left, which are the ones that hold all of them. Since the index is
+ *  case folded, the same lists serve case sensitive and insensitive
+ *  searches. Strings shorter than a trigram are checked against every path.
+ *
+ *  Removing a path doesn't touch the lists, as it would take time
+ *  proportional to their length. Its IDs are left there and skipped by
+ *  searches, which check the current path, and the lists are rebuilt once
+ *  they hold more of those than valid ones.
+ */
+
+/**
+ *  \brief StoreFSTrigramIndex's private data structure
+ */
+struct StoreFSTrigramIndexPrivate
+{
+    QHash<quint64, QString>           paths;       /*!< Path of each ID. */
+    QHash<quint64, QVector<quint64> > postings;    /*!< Sorted IDs of the paths that hold each trigram. May list IDs that no longer do. */
+    qint64                            entries = 0; /*!< Number of IDs in StoreFSTrigramIndexPrivate#postings. */
+    qint64                            stale   = 0; /*!< How many of them are of paths that were removed or moved. */
+
+    static QVector<quint64> trigrams(const QString &s);
+
+    void           add(const QString &path, const quint64 id);
+    void           compact();
+    QList<quint64> search(const QString &s, const std::function<bool (const QString &)> &match) const;
+};
+
+/**
+ *  \brief Constructs an empty index.
+ */
+StoreFSTrigramIndex::StoreFSTrigramIndex()
+{
+    _p.reset(new StoreFSTrigramIndexPrivate);
+}
+
+/**
+ *  \brief Default destructor.
+ */
+StoreFSTrigramIndex::~StoreFSTrigramIndex() = default;
+
+/**
+ *  \brief Indexes \c path under \c id, replacing the path of \c id if it
+ *  was already indexed.
+ *
+ *  \arg \c path The path.
+ *  \arg \c id The ID.
+ */
+void StoreFSTrigramIndex::insert(const QString &path, const quint64 id)
+{
+    remove(id);
+    _p->add(path, id);
+}
+
+/**
+ *  \brief Removes the path of \c id from the index.
+ *
+ *  \arg \c id The ID.
+ */
+void StoreFSTrigramIndex::remove(const quint64 id)
+{
+    if (!_p->paths.contains(id)) {
+        return;
+    }
+
+    _p->stale += StoreFSTrigramIndexPrivate::trigrams(_p->paths.take(id)).size();
+
+    if (_p->stale * 2 > _p->entries) {
+        _p->compact();
+    }
+}
+
+/**
+ *  \brief Removes every path from the index.
+ */
+void StoreFSTrigramIndex::clear()
+{
+    _p->paths.clear();
+    _p->postings.clear();
+    _p->entries = 0;
+    _p->stale   = 0;
+}
+
+/**
+ *  \brief Returns the IDs of the paths that contain \c s.
+ *
+ *  \arg \c s The string to look for.
+ *  \arg \c cs Whether the case of \c s must match.
+ *
+ *  \return The IDs, sorted by path.
+ */
+QList<quint64> StoreFSTrigramIndex::contains(const QString &s, const Qt::CaseSensitivity cs) const
+{
+    return _p->search(s, [&s, cs](const QString &path) {
+        return path.contains(s, cs);
+    });
+}
+
+/**
+ *  \brief Returns the IDs of the paths that end with \c s.
+ *
+ *  \arg \c s The string to look for.
+ *  \arg \c cs Whether the case of \c s must match.
+ *
+ *  \return The IDs, sorted by path.
+ */
+QList<quint64> StoreFSTrigramIndex::endsWith(const QString &s, const Qt::CaseSensitivity cs) const
+{
+    return _p->search(s, [&s, cs](const QString &path) {
+        return path.endsWith(s, cs);
+    });
+}
+
+/**
+ *  \brief Returns the distinct trigrams of \c s, case folded.
+ *
+ *  \arg \c s The string.
+ *
+ *  \return The trigrams, each packed in the lower 48 bits of an integer.
+ */
+QVector<quint64> StoreFSTrigramIndexPrivate::trigrams(const QString &s)
+{
+    QString          folded = s.toCaseFolded();
+    QVector<quint64> grams;
+
+    for (int i = 0; i + 2 < folded.size(); i++) {
+        grams << ((static_cast<quint64>(folded.at(i).unicode()) << 32)
+                  | (static_cast<quint64>(folded.at(i + 1).unicode()) << 16)
+                  | static_cast<quint64>(folded.at(i + 2).unicode()));
+    }
+
+    std::sort(grams.begin(), grams.end());
+    grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+
+    return grams;
+}
+
+/**
+ *  \brief Lists \c id under the trigrams of \c path.
+ *
+ *  IDs are mostly new ones, which go at the end of the lists. A moved path
+ *  may still be listed under some of the trigrams, and isn't listed twice.
+ *
+ *  \arg \c path The path.
+ *  \arg \c id The ID.
+ */
+void StoreFSTrigramIndexPrivate::add(const QString &path, const quint64 id)
+{
+    paths[id] = path;
+
+    for (quint64 gram : trigrams(path)) {
+        QVector<quint64> &list = postings[gram];
+
+        if (list.isEmpty() || (list.last() < id)) {
+            list << id;
+        } else {
+            auto it = std::lower_bound(list.begin(), list.end(), id);
+
+            if (*it == id) {
+                continue;
+            }
+
+            list.insert(it, id);
+        }
+
+        entries++;
+    }
+}
+
+/**
+ *  \brief Rebuilds the lists without the IDs of removed paths.
+ */
+void StoreFSTrigramIndexPrivate::compact()
+{
+    QHash<quint64, QString> current = paths;
+    QList<quint64>          ids     = current.keys();
+
+    postings.clear();
+    entries = 0;
+    stale   = 0;
+
+    // By ascending ID, so each one goes at the end of its lists.
+    std::sort(ids.begin(), ids.end());
+
+    for (quint64 id : ids) {
+        add(current.value(id), id);
+    }
+}
+
+/**
+ *  \brief Returns the IDs of the paths \c match accepts, among the ones that
+ *  hold every trigram of \c s.
+ *
+ *  \arg \c s The string to look for.
+ *  \arg \c match Checks a path against \c s.
+ *
+ *  \return The IDs, sorted by path.
+ */
+QList<quint64> StoreFSTrigramIndexPrivate::search(const QString &s, const std::function<bool (const QString &)> &match) const
+{
+    QVector<quint64> grams = trigrams(s);
+    QList<quint64>   ids;
+
+    if (grams.isEmpty()) {
+        for (auto it = paths.constBegin(); it != paths.constEnd(); ++it) {
+            if (match(it.value())) {
+                ids << it.key();
+            }
+        }
+    } else {
+        QList<const QVector<quint64> *> lists;
+
+        for (quint64 gram : grams) {
+            auto it = postings.constFind(gram);
+
+            if (it == postings.constEnd()) {
+                return ids;
+            }
+
+            lists << &it.value();
+        }
+
+        std::sort(lists.begin(), lists.end(), [](const QVector<quint64> *a, const QVector<quint64> *b) {
+            return a->size() < b->size();
+        });
+
+        QVector<quint64> candidates = *lists.first();
+
+        for (int i = 1; (i < lists.size()) && !candidates.isEmpty(); i++) {
+            QVector<quint64> common;
+
+            std::set_intersection(candidates.constBegin(), candidates.constEnd(), lists[i]->constBegin(), lists[i]->constEnd(), std::back_inserter(common));
+            candidates.swap(common);
+        }
+
+        for (quint64 id : candidates) {
+            auto it = paths.constFind(id);
+
+            if ((it != paths.constEnd()) && match(it.value())) {
+                ids << id;
+            }
+        }
+    }
+
+    std::sort(ids.begin(), ids.end(), [this](const quint64 a, const quint64 b) {
+        return paths.value(a) < paths.value(b);
+    });
+
+    return ids;
+}
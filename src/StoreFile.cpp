@@ -26,6 +26,11 @@
 #include <QDataStream>
 #include <QFile>
 #include <QMap>
+#include <QSaveFile>
+
+#include <zstd.h>
+
+#define INDEX_ZSTD_LEVEL 1
 
 /*!
  *  \class StoreFile
@@ -50,7 +55,9 @@
  */
 struct StoreFilePrivate
 {
-    quint16                version = 1;  /*!< Version of the Store.void file format implemented. */
+    quint16                version = 4;  /*!< Version of the Store.void file format implemented. 2 may contain StoreFSPartFormat#FRAMED files, 3 records the IndexCodec, 4 lists the segments of the index instead of holding it, and the data is preceded by its own nonce instead of using the IV. */
+    quint16                fileVersion;  /*!< Version of the Store.void file loaded, or StoreFilePrivate#version for new files. */
+    IndexCodec             codec = ZSTD; /*!< Compression of StoreFilePrivate#data. */
     std::string            salt;         /*!< Salt used by the crypt operations */
     std::string            iv;           /*!< IV used by the crypt operations */
     QByteArray             data;         /*!< The serialized, compressed and encrypted data to be saved or that was loaded */
@@ -72,6 +79,7 @@ struct StoreFilePrivate
 StoreFile::StoreFile(QString path)
 {
     _p.reset(new StoreFilePrivate);
+    _p->fileVersion = _p->version;
     _p->storeFile.reset(new QFile(path) );
     if ( !_p->storeFile->open(QIODevice::ReadWrite) ) {
         error = CantOpenFile;
@@ -82,9 +90,25 @@ StoreFile::StoreFile(QString path)
         _p->load();
     }
 
+    // Saves replace the file instead of writing to this handle.
+    _p->storeFile->close();
+
     error = Success;
 }
 
+/**
+ *  \brief Sets the compression of the data.
+ *
+ *  Doesn't trigger a save, as it describes the data: call it before
+ *  StoreFile#setData with data compressed by \c codec.
+ *
+ *  \arg \c codec The IndexCodec of the next data.
+ */
+void StoreFile::setCodec(const IndexCodec codec)
+{
+    _p->codec = codec;
+}
+
 /**
  *  \brief Sets CryptoParams and triggers a save.
  *
@@ -136,6 +160,16 @@ void StoreFile::setSalt(const std::string salt)
     _p->save();
 }
 
+/**
+ *  \brief Returns the compression of the data in memory.
+ *
+ *  \return The IndexCodec of the data.
+ */
+IndexCodec StoreFile::codec() const
+{
+    return _p->codec;
+}
+
 /**
  *  \brief Returns the CryptoParams object in mememory.
  *
@@ -176,23 +210,108 @@ std::string StoreFile::salt() const
     return _p->salt;
 }
 
+/**
+ *  \brief Returns the version of the file format loaded.
+ *
+ *  Saving always writes the implemented version, so this is only lower
+ *  than it until the first save.
+ *
+ *  \return The version of the Store.void file.
+ */
+quint16 StoreFile::version() const
+{
+    return _p->fileVersion;
+}
+
 /**
  *  \brief Default destructor.
  */
 StoreFile::~StoreFile() = default;
 
+/**
+ *  \brief Compresses the serialized index with \c codec.
+ *
+ *  \arg \c data The index, as returned by StoreFS#serialize.
+ *  \arg \c codec The IndexCodec to use.
+ *
+ *  \return The compressed index.
+ */
+QByteArray StoreFile::compress(const QByteArray &data, const IndexCodec codec)
+{
+    if (codec == ZLIB) {
+        return qCompress(data, 9);
+    }
+
+    QByteArray compressed;
+
+    compressed.resize(static_cast<int>(ZSTD_compressBound(static_cast<size_t>(data.size()))));
+
+    size_t size = ZSTD_compress(compressed.data(), static_cast<size_t>(compressed.size()),
+                                data.constData(), static_cast<size_t>(data.size()), INDEX_ZSTD_LEVEL);
+
+    if (ZSTD_isError(size)) {
+        return QByteArray();
+    }
+
+    compressed.resize(static_cast<int>(size));
+
+    return compressed;
+}
+
+/**
+ *  \brief Uncompresses an index compressed with \c codec.
+ *
+ *  \arg \c data The compressed index.
+ *  \arg \c codec The IndexCodec it was compressed with.
+ *
+ *  \return The serialized index, or an empty QByteArray if \c data is
+ *  corrupted.
+ */
+QByteArray StoreFile::uncompress(const QByteArray &data, const IndexCodec codec)
+{
+    if (codec == ZLIB) {
+        return qUncompress(data);
+    }
+
+    unsigned long long size = ZSTD_getFrameContentSize(data.constData(), static_cast<size_t>(data.size()));
+    QByteArray         uncompressed;
+
+    if ((size == ZSTD_CONTENTSIZE_UNKNOWN) || (size == ZSTD_CONTENTSIZE_ERROR)) {
+        return uncompressed;
+    }
+
+    uncompressed.resize(static_cast<int>(size));
+
+    size_t written = ZSTD_decompress(uncompressed.data(), static_cast<size_t>(uncompressed.size()),
+                                     data.constData(), static_cast<size_t>(data.size()));
+
+    if (ZSTD_isError(written) || (written != size)) {
+        return QByteArray();
+    }
+
+    return uncompressed;
+}
+
 /**
  *  \brief Saves the information to the file.
  *
- *  Serializes \c version, \c salt, \c iv, \c data and
- *  \c cryptoParams saves it to \c storeFile.
+ *  Serializes \c version, \c salt, \c iv, \c data,
+ *  \c codec and \c cryptoParams saves it to \c storeFile.
+ *  The file is written through a QSaveFile, so a failed save leaves the
+ *  previous file intact.
  */
 void StoreFilePrivate::save()
 {
-    storeFile->seek(0);
+    fileVersion = version;
+
+    QSaveFile file(storeFile->fileName() );
+
+    if ( !file.open(QIODevice::WriteOnly) ) {
+        return;
+    }
 
     {
-        QDataStream stream(storeFile.get() );
+        QDataStream stream(&file);
         stream.setVersion(QDataStream::Qt_5_6);
 
         QByteArray qsalt = QByteArray::fromStdString(salt);
@@ -205,17 +324,19 @@ void StoreFilePrivate::save()
             << static_cast<quint8> (cryptoParams.keyDerivationFunction)
             << static_cast<quint8> (cryptoParams.keyDerivationHash)
             << cryptoParams.keyDerivationCost
+            << static_cast<quint8> (codec)
             << data;
     }
 
-    storeFile->flush();
+    file.commit();
 }
 
 /**
  *  \brief Loads information from file.
  *
- *  Loads \c version, \c salt, \c iv, \c data
- *  and \c cryptoParams from \c storeFile.
+ *  Loads \c version, \c salt, \c iv, \c data, \c codec
+ *  and \c cryptoParams from \c storeFile. Files older than version 3
+ *  are always compressed with IndexCodec#ZLIB.
  */
 void StoreFilePrivate::load()
 {
@@ -225,22 +346,30 @@ void StoreFilePrivate::load()
 
     QByteArray qsalt, qiv;
     quint8     digest, encryption, keyDerivationFunction, keyDerivationHash;
+    quint8     indexCodec = ZLIB;
 
-    stream >> version
+    // The file is rewritten in the implemented version on the next save.
+    stream >> fileVersion
         >> qsalt
         >> qiv
         >> digest
         >> encryption
         >> keyDerivationFunction
         >> keyDerivationHash
-        >> cryptoParams.keyDerivationCost
-        >> data;
+        >> cryptoParams.keyDerivationCost;
+
+    if (fileVersion >= 3) {
+        stream >> indexCodec;
+    }
+
+    stream >> data;
 
     cryptoParams.digest                = static_cast<DigestType> (digest);
     cryptoParams.encryption            = static_cast<EncType> (encryption);
     cryptoParams.keyDerivationFunction = static_cast<KeyDerivationFunction> (keyDerivationFunction);
     cryptoParams.keyDerivationHash     = static_cast<KeyDerivationHash> (keyDerivationHash);
 
-    salt = qsalt.toStdString();
-    iv   = qiv.toStdString();
+    codec = static_cast<IndexCodec> (indexCodec);
+    salt  = qsalt.toStdString();
+    iv    = qiv.toStdString();
 }
@@ -31,6 +31,15 @@
 
 struct StoreFilePrivate;
 
+/**
+ *  \brief Compression applied to the index before it's encrypted into
+ *  Store.void.
+ */
+enum IndexCodec : uint8_t {
+    ZLIB, /*!< zlib at level 9. The only codec of Store.void files older than version 3. */
+    ZSTD  /*!< Zstandard at a low level. Much faster to compress and decompress. */
+};
+
 struct StoreFile
 {
     /**
@@ -46,18 +55,24 @@ struct StoreFile
      */
     error;
 
+    static QByteArray compress(const QByteArray &data, const IndexCodec codec);
+    static QByteArray uncompress(const QByteArray &data, const IndexCodec codec);
+
     StoreFile(QString path);
     ~StoreFile();
 
+    void setCodec(const IndexCodec codec);
     void setCryptoParams(const CryptoParams params);
     void setData(const QByteArray data);
     void setIV(const std::string iv);
     void setSalt(const std::string salt);
 
+    IndexCodec   codec() const;
     CryptoParams cryptoParams() const;
     QByteArray   data() const;
     std::string  IV() const;
     std::string  salt() const;
+    quint16      version() const;
 
 private:
     std::unique_ptr<StoreFilePrivate> _p;
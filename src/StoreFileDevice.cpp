@@ -0,0 +1,442 @@
+/*
+ *  Copyright (c) 2015 Álan Crístoffer
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ *  sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ *  IN THE SOFTWARE.
+ */
+
+#include "StoreFileDevice.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <QFile>
+
+/*!
+ *  \class StoreFileDevice
+ *  \brief Reads or writes a file of the store as a QIODevice.
+ *
+ *  When reading, parts are decrypted lazily: only the part covering the
+ *  current position is read from disk, decrypted and verified, and it is
+ *  kept until a read crosses into another part. Seeking is free. Memory
+ *  usage is bounded by the size of one part, whatever the size of the file.
+ *
+ *  When writing, the device is sequential. Data is digested and encrypted
+ *  as it arrives, and a new part is cut every MAX_PART_SIZE bytes, so the
+ *  final size doesn't need to be known in advance. The file only enters the
+ *  index when the device is closed. If anything fails, the written parts are
+ *  removed and nothing is committed.
+ *
+ *  The device should not outlive the Store it came from.
+ *
+ *  \see Store#open
+ *  \see Store#create
+ */
+
+/**
+ *  \brief StoreFileDevice's private data structure
+ */
+struct StoreFileDevicePrivate
+{
+    StoreFSFilePtr file;             /*!< The file being read or written. */
+    QString        storePath;        /*!< Folder where the parts are. */
+    QByteArray     cache;            /*!< Clear text of the last chunk read. */
+    qint64         cacheOffset = -1; /*!< Offset of StoreFileDevicePrivate#cache in the clear text. */
+
+    StoreFileDevice::Commit            commit;           /*!< Adds the written file to the index. Empty for read devices. */
+    std::unique_ptr<StoreFSPartStream> stream;           /*!< Encrypts the part being written. */
+    std::unique_ptr<Digest>            digest;           /*!< Digests the part being written. */
+    std::vector<std::string>           partDigests;      /*!< Digests of the parts written so far. */
+    QFile                              partFile;         /*!< Temporary file of the part being written. */
+    qint64                             partSize = 0;     /*!< Clear text bytes in the part being written. */
+    QByteArray                         cipher;           /*!< Output buffer of StoreFileDevicePrivate#stream. */
+    bool                               failed   = false; /*!< Whether a write failed. Nothing is committed then. */
+
+    bool load(const qint64 position, QString &error);
+    bool startPart();
+    bool finishPart();
+    void discard();
+};
+
+/**
+ *  \brief Creates a device to read \c file.
+ *
+ *  \arg \c file The file to be read.
+ *  \arg \c storePath Folder of the store, where the parts are.
+ *  \arg \c parent Parent QObject.
+ */
+StoreFileDevice::StoreFileDevice(const StoreFSFilePtr file, const QString storePath, QObject *parent) : QIODevice(parent)
+{
+    _p.reset(new StoreFileDevicePrivate);
+
+    _p->file      = file;
+    _p->storePath = storePath;
+}
+
+/**
+ *  \brief Creates a device to write \c file.
+ *
+ *  \c file must already have its path, key, iv and salt set. Its size,
+ *  parts and digest are filled as data is written.
+ *
+ *  \arg \c file The file to be written.
+ *  \arg \c storePath Folder of the store, where the parts go.
+ *  \arg \c commit Called on close to add \c file to the index. Returns
+ *  whether it succeeded.
+ *  \arg \c parent Parent QObject.
+ */
+StoreFileDevice::StoreFileDevice(const StoreFSFilePtr file, const QString storePath, const Commit commit, QObject *parent) : StoreFileDevice(file, storePath, parent)
+{
+    _p->commit = commit;
+}
+
+/**
+ *  \brief Closes the device, committing the file if it was being written.
+ */
+StoreFileDevice::~StoreFileDevice()
+{
+    if (isOpen()) {
+        close();
+    }
+}
+
+/**
+ *  \brief Opens the device.
+ *
+ *  \arg \c mode QIODevice#ReadOnly for devices returned by Store#open,
+ *  QIODevice#WriteOnly for devices returned by Store#create. Write devices
+ *  can only be opened once.
+ *
+ *  \return Whether the device could be opened.
+ */
+bool StoreFileDevice::open(OpenMode mode)
+{
+    bool writing = _p->commit != nullptr;
+
+    if ((mode.testFlag(ReadOnly) && mode.testFlag(WriteOnly)) || (writing != mode.testFlag(WriteOnly))) {
+        setErrorString(writing ? QStringLiteral("StoreFileDevice is write only") : QStringLiteral("StoreFileDevice is read only"));
+        return false;
+    }
+
+    if (writing) {
+        if (_p->digest != nullptr) {
+            setErrorString(QStringLiteral("StoreFileDevice was already written"));
+            return false;
+        }
+
+        _p->digest.reset(new Digest);
+        _p->file->size = 0;
+
+        if (!_p->startPart()) {
+            setErrorString(QStringLiteral("Could not start the first part"));
+            _p->discard();
+            return false;
+        }
+    }
+
+    return QIODevice::open(mode | Unbuffered);
+}
+
+/**
+ *  \brief Closes the device.
+ *
+ *  For write devices, the last part is finished and the file is committed
+ *  to the index. If that fails, or a previous write failed, the parts are
+ *  removed instead.
+ */
+void StoreFileDevice::close()
+{
+    if (isOpen() && (_p->commit != nullptr)) {
+        if (_p->failed || !_p->finishPart()) {
+            _p->discard();
+        } else {
+            _p->file->digest = QByteArray::fromStdString(Crypto::fileDigest(_p->partDigests, _p->file->params));
+
+            if (!_p->commit(_p->file)) {
+                setErrorString(QStringLiteral("Could not add the file to the store"));
+                _p->discard();
+            }
+        }
+
+        _p->stream.reset();
+        _p->cipher.clear();
+    }
+
+    QIODevice::close();
+}
+
+/**
+ *  \brief Read devices are random access, write devices are sequential.
+ *
+ *  \return Whether the device is sequential.
+ */
+bool StoreFileDevice::isSequential() const
+{
+    return _p->commit != nullptr;
+}
+
+/**
+ *  \brief Returns the size of the unencrypted file.
+ *
+ *  For write devices, it's the number of bytes written so far.
+ *
+ *  \return Size in bytes.
+ */
+qint64 StoreFileDevice::size() const
+{
+    return static_cast<qint64>(_p->file->size);
+}
+
+/**
+ *  \brief Reads up to \c maxSize bytes from the current position.
+ *
+ *  Only the frames, or for older files the parts, covering the requested
+ *  range are decrypted.
+ *
+ *  \arg \c data Where to write the data.
+ *  \arg \c maxSize Maximum number of bytes to read.
+ *
+ *  \return Bytes read, or -1 if a part could not be read or is corrupted.
+ */
+qint64 StoreFileDevice::readData(char *data, qint64 maxSize)
+{
+    qint64 position = pos();
+    qint64 read     = 0;
+
+    while ((read < maxSize) && (position < size())) {
+        QString error;
+
+        if (!_p->load(position, error)) {
+            setErrorString(error);
+            return read > 0 ? read : -1;
+        }
+
+        qint64 offset = position - _p->cacheOffset;
+        qint64 count  = std::min(maxSize - read, static_cast<qint64>(_p->cache.size()) - offset);
+
+        if (count <= 0) {
+            break;
+        }
+
+        std::copy_n(_p->cache.constData() + offset, count, data + read);
+
+        read     += count;
+        position += count;
+    }
+
+    return read;
+}
+
+/**
+ *  \brief Digests and encrypts \c maxSize bytes from \c data.
+ *
+ *  A new part is started whenever the current one reaches MAX_PART_SIZE.
+ *
+ *  \arg \c data Data to be written.
+ *  \arg \c maxSize Number of bytes in \c data.
+ *
+ *  \return Bytes written, or -1 on failure, after which the device can only
+ *  be closed and nothing will be committed.
+ */
+qint64 StoreFileDevice::writeData(const char *data, qint64 maxSize)
+{
+    if ((_p->commit == nullptr) || _p->failed) {
+        return -1;
+    }
+
+    qint64 written = 0;
+
+    while (written < maxSize) {
+        if ((_p->partSize == MAX_PART_SIZE) && (!_p->finishPart() || !_p->startPart())) {
+            _p->failed = true;
+            setErrorString(QStringLiteral("Could not write part"));
+            return -1;
+        }
+
+        qint64 count   = std::min<qint64>({ maxSize - written, MAX_PART_SIZE - _p->partSize, MAX_SLICE_SIZE });
+        auto   data_c  = reinterpret_cast<const unsigned char*>(data + written);
+        auto   out_c   = reinterpret_cast<unsigned char*>(_p->cipher.data());
+        size_t cipherd = _p->stream->update(data_c, static_cast<size_t>(count), out_c, static_cast<size_t>(_p->cipher.size()));
+
+        _p->digest->update(data_c, static_cast<size_t>(count));
+
+        if ((_p->stream->error != Crypto::Success) || (_p->partFile.write(_p->cipher.constData(), static_cast<qint64>(cipherd)) == -1)) {
+            _p->failed = true;
+            setErrorString(QStringLiteral("Could not write part"));
+            return -1;
+        }
+
+        _p->partSize   += count;
+        _p->file->size += static_cast<quint64>(count);
+        written        += count;
+    }
+
+    return written;
+}
+
+/**
+ *  \brief Decrypts and verifies the chunk covering \c position into the
+ *  cache.
+ *
+ *  A chunk is a whole part for StoreFSPartFormat#SINGLE_MESSAGE files, which
+ *  can only be authenticated as a whole, and a single frame otherwise.
+ *
+ *  \arg \c position Offset in the clear text.
+ *  \arg \c error Set to a description of the error, if any.
+ *
+ *  \return Whether the chunk is in the cache.
+ */
+bool StoreFileDevicePrivate::load(const qint64 position, QString &error)
+{
+    bool   framed = file->format == FRAMED;
+    qint64 part   = position / MAX_PART_SIZE;
+    qint64 frame  = framed ? (position % MAX_PART_SIZE) / file->frameSize : 0;
+    qint64 start  = part * MAX_PART_SIZE + frame * file->frameSize;
+
+    if ((cache.size() > 0) && (start == cacheOffset)) {
+        return true;
+    }
+
+    cache.clear();
+
+    QString name = file->cryptoParts.name(static_cast<int>(part));
+    QFile   partFile(storePath + "/" + name);
+
+    if (name.isEmpty() || !partFile.open(QIODevice::ReadOnly)) {
+        error = QStringLiteral("Could not open part ") + name;
+        return false;
+    }
+
+    qint64 tagSize = static_cast<qint64>(Crypto::tagSize());
+    bool   ok;
+
+    if (framed) {
+        qint64 partSize  = std::min<qint64>(MAX_PART_SIZE, static_cast<qint64>(file->size) - part * MAX_PART_SIZE);
+        qint64 frameSize = std::min<qint64>(file->frameSize, partSize - frame * file->frameSize);
+
+        partFile.seek(frame * (file->frameSize + tagSize));
+
+        QByteArray cipher = partFile.read(frameSize + tagSize);
+        Crypto     c(file->key.toStdString(), StoreFSPartStream::frameIV(file, static_cast<quint32>(part), static_cast<quint32>(frame)));
+
+        cache.resize(static_cast<int>(frameSize));
+
+        auto   cipher_c = reinterpret_cast<const unsigned char*>(cipher.constData());
+        auto   clear_c  = reinterpret_cast<unsigned char*>(cache.data());
+        size_t size     = c.decrypt(cipher_c, static_cast<size_t>(cipher.size()), clear_c, static_cast<size_t>(cache.size()));
+
+        ok = (cipher.size() == frameSize + tagSize) && (c.error == Crypto::Success) && (size == static_cast<size_t>(frameSize));
+    } else {
+        QByteArray        cipher = partFile.readAll();
+        StoreFSPartStream stream(file, static_cast<quint32>(part), CryptoStream::Decrypt);
+
+        cache.resize(cipher.size());
+
+        auto   cipher_c = reinterpret_cast<const unsigned char*>(cipher.constData());
+        auto   clear_c  = reinterpret_cast<unsigned char*>(cache.data());
+        size_t size     = stream.update(cipher_c, static_cast<size_t>(cipher.size()), clear_c, static_cast<size_t>(cache.size()));
+
+        size += stream.final(clear_c + size, static_cast<size_t>(cache.size()) - size);
+        cache.resize(static_cast<int>(size));
+
+        Digest digest;
+
+        digest.update(clear_c, size);
+
+        ok = (stream.error == Crypto::Success) && StoreFSPartStream::checkName(file, static_cast<quint32>(part), digest.finalize());
+    }
+
+    if (!ok) {
+        cache.clear();
+        error = QStringLiteral("Part corrupted: ") + name;
+        return false;
+    }
+
+    cacheOffset = start;
+
+    return true;
+}
+
+/**
+ *  \brief Opens a temporary file for the next part and starts its stream.
+ *
+ *  \return Whether it succeeded.
+ */
+bool StoreFileDevicePrivate::startPart()
+{
+    partFile.setFileName(storePath + "/" + QString::fromStdString(Crypto::stringToHex(Crypto::generateRandom(16), "")) + ".part");
+
+    if (!partFile.open(QFile::WriteOnly)) {
+        return false;
+    }
+
+    stream.reset(new StoreFSPartStream(file, static_cast<quint32>(partDigests.size()), CryptoStream::Encrypt));
+    cipher.resize(static_cast<int>(stream->outputSize(MAX_SLICE_SIZE)));
+    partSize = 0;
+
+    return stream->error == Crypto::Success;
+}
+
+/**
+ *  \brief Writes the tag of the current part and renames it to its digest.
+ *
+ *  \return Whether it succeeded.
+ */
+bool StoreFileDevicePrivate::finishPart()
+{
+    size_t tagSize = stream->final(reinterpret_cast<unsigned char*>(cipher.data()), static_cast<size_t>(cipher.size()));
+    bool   ok      = (stream->error == Crypto::Success) && (partFile.write(cipher.constData(), static_cast<qint64>(tagSize)) != -1);
+
+    partFile.close();
+
+    if (!ok) {
+        partFile.remove();
+        return false;
+    }
+
+    std::string partDigest = digest->finalize();
+    std::string name       = StoreFSPartStream::partName(file, static_cast<quint32>(partDigests.size()), partDigest);
+    QString     partPath   = storePath + "/" + StoreFSPartList::fileName(name);
+
+    if (!StoreFS::placePart(partFile, partPath)) {
+        return false;
+    }
+
+    file->cryptoParts.appendDigest(QByteArray::fromStdString(name));
+    partDigests.push_back(partDigest);
+
+    return true;
+}
+
+/**
+ *  \brief Removes every part written so far.
+ */
+void StoreFileDevicePrivate::discard()
+{
+    if (partFile.isOpen()) {
+        partFile.close();
+        partFile.remove();
+    }
+
+    for (QString name : file->cryptoParts.names()) {
+        QFile::remove(storePath + "/" + name);
+    }
+
+    file->cryptoParts.clear();
+    partDigests.clear();
+}
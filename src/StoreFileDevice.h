@@ -0,0 +1,61 @@
+/*
+ *  Copyright (c) 2015 Álan Crístoffer
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ *  sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ *  IN THE SOFTWARE.
+ */
+
+#ifndef STOREFILEDEVICE_H
+#define STOREFILEDEVICE_H
+
+#include <functional>
+#include <memory>
+
+#include <QIODevice>
+
+#include "StoreFS.h"
+
+struct StoreFileDevicePrivate;
+
+class StoreFileDevice : public QIODevice
+{
+    Q_OBJECT
+public:
+    /**
+     *  \brief Adds a written file to the index. Returns whether it succeeded.
+     */
+    using Commit = std::function<bool (StoreFSFilePtr)>;
+
+    StoreFileDevice(const StoreFSFilePtr file, const QString storePath, QObject *parent = nullptr);
+    StoreFileDevice(const StoreFSFilePtr file, const QString storePath, const Commit commit, QObject *parent = nullptr);
+    ~StoreFileDevice();
+
+    bool   open(OpenMode mode) override;
+    void   close() override;
+    bool   isSequential() const override;
+    qint64 size() const override;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 maxSize) override;
+
+private:
+    std::unique_ptr<StoreFileDevicePrivate> _p;
+};
+
+#endif // STOREFILEDEVICE_H
@@ -42,6 +42,7 @@ StoreScreenBridge::StoreScreenBridge(const QString &path, const QString &passwor
 {
     _p.reset(new StoreScreenBridgePrivate);
     _p->store.reset(new Store(path, password, create) );
+    _p->store->setPersistDelay(PERSIST_DELAY);
 
     error      = _p->store->error;
     _p->parent = parent;
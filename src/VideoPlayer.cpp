@@ -42,6 +42,7 @@ namespace OpenSSL
 
 #include "Runner.h"
 #include "Store.h"
+#include "StoreFileDevice.h"
 #include "VideoPlayerWidget.h"
 
 #ifdef Q_OS_MAC
@@ -60,11 +61,11 @@ enum CertType {
 
 struct VideoPlayerPrivate
 {
-    std::shared_ptr<Store> store;
-    QSslConfiguration      serverSslConfig;
-    QByteArray             data;
-    QString                mimetype;
-    QString                hash;
+    std::shared_ptr<Store>           store;
+    QSslConfiguration                serverSslConfig;
+    std::unique_ptr<StoreFileDevice> device;
+    QString                          mimetype;
+    QString                          hash;
 
     QSslKey         generateRSAKey() const;
     QSslCertificate generateCertificate(const QSslKey &key, const QSslCertificate &signer, const QSslKey &signerKey, CertType type) const;
@@ -129,9 +130,14 @@ VideoPlayer::~VideoPlayer()
 
 void VideoPlayer::play(const QString path)
 {
-    _p->data     = _p->store->decryptFile(path);
+    _p->device.reset( _p->store->open(path) );
     _p->mimetype = _p->store->fileMetadata(path, "mimetype");
 
+    if ( (_p->device == nullptr) || !_p->device->open(QIODevice::ReadOnly) ) {
+        _p->device.reset();
+        return;
+    }
+
     if ( !isListening() ) {
         listen(QHostAddress::LocalHost);
     }
@@ -150,7 +156,7 @@ void VideoPlayer::play(const QString path)
     connect(video, &VideoPlayerWidget::closing, [this, player, video]() {
         player->setMedia( QMediaContent() );
 
-        _p->data.clear();
+        _p->device.reset();
         _p->mimetype.clear();
         _p->hash.clear();
 
@@ -319,14 +325,34 @@ QSslCertificate VideoPlayerPrivate::generateCertificate(const QSslKey &key, cons
 void VideoPlayer::incomingConnection(qintptr handle)
 {
     QSslSocket *socket = new QSslSocket(this);
+    auto       range   = std::make_shared<QPair<qint64, qint64> >(0, -1);
+
+    // Sends the body one slice at a time as the socket drains, so the
+    // requested range is never held in memory as a whole.
+    auto pump = [this, socket, range]() {
+        while ( _p->device && (range->first <= range->second) && (socket->encryptedBytesToWrite() + socket->bytesToWrite() < MAX_SLICE_SIZE) ) {
+            _p->device->seek(range->first);
+            QByteArray slice = _p->device->read( std::min<qint64>(MAX_SLICE_SIZE, range->second - range->first + 1) );
+
+            if ( slice.isEmpty() ) {
+                socket->close();
+                return;
+            }
 
-    connect(socket, &QAbstractSocket::disconnected, socket, &QObject::deleteLater);
-    connect(socket, &QIODevice::readyRead,          [this, socket]() {
+            range->first += slice.size();
+            socket->write(slice);
+        }
+    };
+
+    connect(socket, &QAbstractSocket::disconnected,     socket, &QObject::deleteLater);
+    connect(socket, &QSslSocket::encryptedBytesWritten, socket, pump);
+    connect(socket, &QIODevice::readyRead,              [this, socket, range, pump]() {
         QString request = socket->readAll();
 
-        bool partial = false;
-        int min = 0;
-        int max = _p->data.size() - 1;
+        bool   partial = false;
+        qint64 size    = _p->device ? _p->device->size() : 0;
+        qint64 min     = 0;
+        qint64 max     = size - 1;
 
         if ( socket->peerAddress() != QHostAddress(QHostAddress::LocalHost) ) {
             socket->write("HTTP/1.1 403 Forbidden\r\n\r\n");
@@ -335,7 +361,7 @@ void VideoPlayer::incomingConnection(qintptr handle)
             return;
         }
 
-        if ( !request.split("\r\n").first().contains(_p->hash) ) {
+        if ( !_p->device || !request.split("\r\n").first().contains(_p->hash) ) {
             socket->write("HTTP/1.1 404 Not Found\r\n\r\n");
             socket->flush();
             socket->close();
@@ -347,14 +373,14 @@ void VideoPlayer::incomingConnection(qintptr handle)
             QString rangeValue = request.split("\r\n").filter( QRegularExpression("Range:.*") ).first().split(":").last().trimmed();
             if ( !rangeValue.isEmpty() ) {
                 QStringList minMax = rangeValue.split("=").last().split("-");
-                min = minMax.first().toInt();
-                max = minMax.last().isEmpty() ? max : minMax.last().toInt();
+                min = minMax.first().toLongLong();
+                max = minMax.last().isEmpty() ? max : minMax.last().toLongLong();
             }
         }
 
-        if ( (max < min) || (max > _p->data.size() - 1) ) {
+        if ( (max < min) || (max > size - 1) ) {
             min = 0;
-            max = _p->data.size() - 1;
+            max = size - 1;
             partial = false;
         }
 
@@ -362,7 +388,7 @@ void VideoPlayer::incomingConnection(qintptr handle)
 
         if ( partial ) {
             socket->write( "HTTP/1.1 206 Partial Content\r\n");
-            socket->write( ("Content-Range: bytes " + QString::number(min) + "-" + QString::number(max) + "/" + QString::number( _p->data.size() ) + "\r\n").toLocal8Bit() );
+            socket->write( ("Content-Range: bytes " + QString::number(min) + "-" + QString::number(max) + "/" + QString::number(size) + "\r\n").toLocal8Bit() );
         } else {
             socket->write("HTTP/1.1 200 OK\r\n");
         }
@@ -376,7 +402,11 @@ void VideoPlayer::incomingConnection(qintptr handle)
         socket->write( "X-Frame-Options: DENY\r\n");
         socket->write( ("Content-Length: " + QString::number(max - min + 1) + "\r\n").toLocal8Bit() );
         socket->write( "X-Content-Type-Options: nosniff\r\n\r\n");
-        socket->write( _p->data.mid(min, max - min + 1) );
+
+        range->first  = min;
+        range->second = max;
+
+        pump();
         socket->flush();
     });
 
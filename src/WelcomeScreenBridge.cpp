@@ -129,6 +129,9 @@ QString WelcomeScreenBridge::StoreError2QString(Store::StoreError error)
 
         case Store::FileAlreadyExists:
             return QStringLiteral("FileAlreadyExists");
+
+        case Store::IndexCorrupted:
+            return QStringLiteral("IndexCorrupted");
         default:
             return "ShutUpCompiler";
     }
@@ -27,7 +27,7 @@ mac {
 }
 
 CONFIG += link_pkgconfig
-PKGCONFIG += nss openssl
+PKGCONFIG += nss openssl libzstd
 
 DEFINES += NSS_PKCS11_2_0_COMPAT
 
@@ -36,6 +36,12 @@ HEADERS += \
     Store.h \
     StoreFile.h \
     StoreFS.h \
+    StoreFSIndex.h \
+    StoreFSNodeTable.h \
+    StoreFSPartList.h \
+    StoreFSPathTrie.h \
+    StoreFSTrigramIndex.h \
+    StoreFileDevice.h \
     WelcomeScreen.h \
     WelcomeScreenBridge.h \
     StoreScreen.h \
@@ -51,6 +57,11 @@ SOURCES += \
     Store.cpp \
     StoreFile.cpp \
     StoreFS.cpp \
+    StoreFSIndex.cpp \
+    StoreFSPartList.cpp \
+    StoreFSPathTrie.cpp \
+    StoreFSTrigramIndex.cpp \
+    StoreFileDevice.cpp \
     WelcomeScreen.cpp \
     WelcomeScreenBridge.cpp \
     StoreScreen.cpp \
@@ -22,10 +22,17 @@
 
 #include "VoidTest.h"
 
+#include <QElapsedTimer>
+
 #include "Crypto.h"
 #include "Store.h"
 #include "StoreFile.h"
 #include "StoreFS.h"
+#include "StoreFSNodeTable.h"
+#include "StoreFSPartList.h"
+#include "StoreFSPathTrie.h"
+#include "StoreFSTrigramIndex.h"
+#include "StoreFileDevice.h"
 
 /*!
  *  \class VoidTest
@@ -133,6 +140,166 @@ void VoidTest::cryptoDecrypt()
     QCOMPARE( QString::fromStdString(message), QString("Hello World") );
 }
 
+/**
+ *  \brief Tests that CryptoStream produces the same output as Crypto#encrypt
+ *  when fed in slices.
+ */
+void VoidTest::cryptoEncryptStream()
+{
+    std::string key = "0123456789ABCDEF";
+    std::string iv  = "FEDCBA9876543210";
+    Crypto      c(key, iv);
+
+    std::string  message = "Hello World";
+    CryptoStream stream(c, CryptoStream::Encrypt);
+
+    std::string cipher = stream.update( message.substr(0, 3) );
+    cipher += stream.update( message.substr(3) );
+    cipher += stream.final();
+
+    QCOMPARE(stream.error, Crypto::Success);
+    QCOMPARE( QString::fromStdString( Crypto::stringToHex(cipher) ), QString("8C:A9:6D:CC:19:2A:01:08:02:73:04:A5:C5:B7:FE:B0:09:2F:CC:3C:E3:3C:D3:11:C9:69:8C") );
+}
+
+/**
+ *  \brief Tests that CryptoStream decrypts slices and detects tampered data.
+ */
+void VoidTest::cryptoDecryptStream()
+{
+    const unsigned char data[] = {
+        0x8C, 0xA9, 0x6D, 0xCC, 0x19, 0x2A, 0x01, 0x08,
+        0x02, 0x73, 0x04, 0xA5, 0xC5, 0xB7, 0xFE, 0xB0,
+        0x09, 0x2F, 0xCC, 0x3C, 0xE3, 0x3C, 0xD3, 0x11,
+        0xC9, 0x69, 0x8C
+    };
+
+    std::string cipher( reinterpret_cast<const char *> (data), sizeof(data) );
+
+    std::string key = "0123456789ABCDEF";
+    std::string iv  = "FEDCBA9876543210";
+    Crypto      c(key, iv);
+
+    CryptoStream stream(c, CryptoStream::Decrypt);
+    std::string  message;
+
+    for ( size_t i = 0; i < cipher.size(); i += 5 ) {
+        message += stream.update( cipher.substr(i, 5) );
+    }
+
+    stream.final();
+
+    QCOMPARE( stream.error,                    Crypto::Success);
+    QCOMPARE( QString::fromStdString(message), QString("Hello World") );
+
+    cipher[0] = static_cast<char> (cipher[0] ^ 1);
+
+    CryptoStream tampered(c, CryptoStream::Decrypt);
+    tampered.update(cipher);
+    tampered.final();
+
+    QCOMPARE(tampered.error, Crypto::CantDecrypt);
+}
+
+/**
+ *  \brief Tests the overloads of Crypto#encrypt, Crypto#decrypt and
+ *  Crypto#digest that write into caller owned memory.
+ */
+void VoidTest::cryptoCallerBuffers()
+{
+    std::string key = "0123456789ABCDEF";
+    std::string iv  = "FEDCBA9876543210";
+    Crypto      c(key, iv);
+
+    std::string   message = "Hello World";
+    unsigned char cipher[64];
+    unsigned char clear[64];
+    unsigned char digest[64];
+
+    auto   message_c = reinterpret_cast<const unsigned char *> ( message.data() );
+    size_t size      = c.encrypt( message_c, message.size(), cipher, sizeof(cipher) );
+
+    QCOMPARE(c.error,                                       Crypto::Success);
+    QCOMPARE(size,                                          message.size() + Crypto::tagSize() );
+    QCOMPARE(std::string(reinterpret_cast<char *> (cipher), size), c.encrypt(message) );
+
+    size = c.decrypt( cipher, size, clear, message.size() );
+
+    QCOMPARE(c.error,                                       Crypto::Success);
+    QCOMPARE(std::string(reinterpret_cast<char *> (clear), size), message);
+
+    size = Crypto::digest( message_c, message.size(), digest, sizeof(digest) );
+
+    QCOMPARE(size,                                          Crypto::digestSize() );
+    QCOMPARE(std::string(reinterpret_cast<char *> (digest), size), Crypto::digest(message) );
+
+    QCOMPARE(c.encrypt( message_c, message.size(), cipher, message.size() ), static_cast<size_t> (0) );
+    QCOMPARE(c.error,                                       Crypto::CantEncrypt);
+}
+
+/**
+ *  \brief Tests that Digest matches Crypto#digest when fed in slices and can
+ *  be reused.
+ */
+void VoidTest::cryptoDigest()
+{
+    std::string message = "Hello World";
+    std::string digest  = Crypto::digest(message);
+    Digest      d;
+
+    d.update( message.substr(0, 5) );
+    d.update( message.substr(5) );
+
+    QCOMPARE(d.finalize(), digest);
+    QCOMPARE(d.error,      Crypto::Success);
+
+    d.update("garbage");
+    d.reset();
+    d.update(message);
+
+    QCOMPARE(d.finalize(), digest);
+
+    CryptoParams params;
+    params.digest = SHA256;
+
+    Digest d256(params);
+    d256.update(message);
+
+    QCOMPARE(d256.finalize(), Crypto::digest(message, params) );
+}
+
+/**
+ *  \brief Tests both schemes of Crypto#fileDigest.
+ */
+void VoidTest::cryptoFileDigest()
+{
+    std::vector<std::string> parts = {
+        Crypto::digest("a"), Crypto::digest("b"), Crypto::digest("c")
+    };
+
+    CryptoParams chained;
+    chained.fileDigest = CHAINED;
+
+    std::string expected;
+    for ( const std::string &part : parts ) {
+        expected = Crypto::digest(expected + part);
+    }
+
+    QCOMPARE(Crypto::fileDigest(parts, chained), expected);
+
+    std::string              leaf(1, '\0');
+    std::string              node = "\x01";
+    std::vector<std::string> leaves;
+
+    for ( const std::string &part : parts ) {
+        leaves.push_back( Crypto::digest(leaf + part) );
+    }
+
+    std::string ab = Crypto::digest(node + leaves[0] + leaves[1]);
+
+    QCOMPARE(Crypto::fileDigest(parts),                               Crypto::digest(node + ab + leaves[2]) );
+    QCOMPARE(Crypto::fileDigest(std::vector<std::string> { parts[0] }), leaves[0]);
+}
+
 /**
  *  \brief Tests that StoreFile can create and load the Store.void file.
  */
@@ -159,6 +326,106 @@ void VoidTest::storeFileCreateAndLoadStore()
     QDir::current().rmdir("void_store");
 }
 
+/**
+ *  \brief Tests StoreFile#compress, StoreFile#uncompress and the IndexCodec
+ *  recorded in Store.void, including files older than version 3.
+ */
+void VoidTest::storeFileCodecs()
+{
+    QByteArray data = QByteArray("Hello World").repeated(1000);
+
+    QCOMPARE(StoreFile::uncompress(StoreFile::compress(data, ZLIB), ZLIB), data);
+    QCOMPARE(StoreFile::uncompress(StoreFile::compress(data, ZSTD), ZSTD), data);
+    QCOMPARE(StoreFile::uncompress("garbage", ZSTD),                       QByteArray() );
+
+    QDir::current().mkdir("void_store");
+
+    {
+        StoreFile sf("void_store/Store.void");
+
+        QCOMPARE(sf.codec(), ZSTD);
+
+        sf.setCodec(ZLIB);
+        sf.setData("data");
+    }
+
+    {
+        StoreFile sf("void_store/Store.void");
+
+        QCOMPARE(sf.codec(),   ZLIB);
+        QCOMPARE(sf.version(), static_cast<quint16>(4) );
+        QCOMPARE(sf.data(),    QByteArray("data") );
+    }
+
+    QFile::remove("void_store/Store.void");
+
+    {
+        // A version 2 file, which has no codec field.
+        QFile       file("void_store/Store.void");
+        QDataStream stream(&file);
+
+        file.open(QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_5_6);
+        stream << static_cast<quint16>(2)
+               << QByteArray("salt")
+               << QByteArray("iv")
+               << static_cast<quint8>(SHA512)
+               << static_cast<quint8>(AES_GCM_256)
+               << static_cast<quint8>(PKCS5_PBKDF2)
+               << static_cast<quint8>(HMAC_SHA512)
+               << static_cast<uint32_t>(250000)
+               << QByteArray("data");
+    }
+
+    StoreFile sf("void_store/Store.void");
+
+    QCOMPARE(sf.codec(),   ZLIB);
+    QCOMPARE(sf.version(), static_cast<quint16>(2) );
+    QCOMPARE(sf.salt(),    std::string("salt") );
+    QCOMPARE(sf.data(),    QByteArray("data") );
+
+    QFile::remove("void_store/Store.void");
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Compares how long each IndexCodec takes to compress the index of
+ *  a large store, which is done on every save, and to uncompress it, which
+ *  is done on every open.
+ */
+void VoidTest::storeFileCodecsBenchmark()
+{
+    QDir::current().mkdir("void_store");
+    StoreFS sfs("void_store");
+
+    for (int i = 0; i < 10000; i++) {
+        sfs.addFile(QString("/dir%1/file%2.txt").arg(i % 100).arg(i), QByteArray::number(i) );
+    }
+
+    QByteArray index = sfs.serialize();
+
+    for (IndexCodec codec : { ZLIB, ZSTD }) {
+        QElapsedTimer timer;
+
+        timer.start();
+        QByteArray compressed = StoreFile::compress(index, codec);
+        qint64     save       = timer.nsecsElapsed();
+
+        timer.restart();
+        QByteArray uncompressed = StoreFile::uncompress(compressed, codec);
+        qint64     open         = timer.nsecsElapsed();
+
+        QCOMPARE(uncompressed, index);
+
+        qInfo("%s: %d bytes into %d, save %.2fms, open %.2fms", codec == ZLIB ? "zlib" : "zstd",
+              index.size(), compressed.size(), save / 1e6, open / 1e6);
+    }
+
+    sfs.removeDir("/");
+
+    QDir::current().rmdir("void_store");
+}
+
 /**
  *  \brief Tests that StoreFS#makePath does what is should.
  *
@@ -175,9 +442,9 @@ void VoidTest::storeFSMakePath()
     sfs.makePath("/Users/Alan");
     sfs.makePath("/Users/Alan/Documents");
 
-    QCOMPARE( sfs.dir("/Users")->path,                QString("/Users") );
-    QCOMPARE( sfs.dir("/Users/Alan")->path,           QString("/Users/Alan") );
-    QCOMPARE( sfs.dir("/Users/Alan/Documents")->path, QString("/Users/Alan/Documents") );
+    QCOMPARE( sfs.dir("/Users")->path(),                QString("/Users") );
+    QCOMPARE( sfs.dir("/Users/Alan")->path(),           QString("/Users/Alan") );
+    QCOMPARE( sfs.dir("/Users/Alan/Documents")->path(), QString("/Users/Alan/Documents") );
 
     QByteArray ba = "Hello World!";
     sfs.addFile("/file", ba);
@@ -203,7 +470,7 @@ void VoidTest::storeFSAddFile()
 
     sfs.addFile("/hello.txt", data);
     StoreFSFilePtr file          = sfs.file("/hello.txt");
-    QString        expected_name = "void_store/" + file->cryptoParts.first();
+    QString        expected_name = "void_store/" + file->cryptoParts.name(0);
 
     QCOMPARE(sfs.error,                    StoreFS::Success);
     QCOMPARE(QFile::exists(expected_name), true);
@@ -233,7 +500,7 @@ void VoidTest::storeFSAddFileFromDisk()
     sfs.addFile( "void_store/hello.txt", QString("/hello.txt") );
 
     StoreFSFilePtr file          = sfs.file("/hello.txt");
-    QString        expected_name = "void_store/" + file->cryptoParts.first();
+    QString        expected_name = "void_store/" + file->cryptoParts.name(0);
 
     QCOMPARE(sfs.error,                    StoreFS::Success);
     QCOMPARE(QFile::exists(expected_name), true);
@@ -255,290 +522,1691 @@ void VoidTest::storeFSAddFileFromDisk()
 }
 
 /**
- *  \brief Tests StoreFS#removeFile
+ *  \brief Tests StoreFS#addFile(const QString, const QString) with a file
+ *  spanning several parts, processed in parallel.
  */
-void VoidTest::storeFSRemoveFile()
+void VoidTest::storeFSAddMultiPartFile()
 {
     QDir::current().mkdir("void_store");
     StoreFS sfs("void_store");
 
-    QByteArray data = "Hello World";
+    sfs.setMaxPartsInFlight(2);
+    QCOMPARE(sfs.maxPartsInFlight(), 2);
 
-    sfs.addFile("/hello.txt", data);
-    QCOMPARE(sfs.error,                    StoreFS::Success);
+    QByteArray data = QByteArray::fromStdString( Crypto::generateRandom(1048576) );
 
-    StoreFSFilePtr file = sfs.file("/hello.txt");
-    QCOMPARE(file != nullptr,              true);
+    data = data.repeated(110);
 
-    QString expected_name = "void_store/" + file->cryptoParts.first();
-    QCOMPARE(QFile::exists(expected_name), true);
+    QFile f("void_store/big.bin");
+    f.open(QIODevice::WriteOnly);
+    f.write(data);
+    f.close();
 
-    sfs.removeFile(file->path);
+    sfs.addFile( "void_store/big.bin", QString("/big.bin") );
 
-    file = sfs.file("/hello.txt");
-    QCOMPARE(file == nullptr,              true);
-    QCOMPARE(QFile::exists(expected_name), false);
+    StoreFSFilePtr file = sfs.file("/big.bin");
+
+    QCOMPARE(sfs.error,                  StoreFS::Success);
+    QCOMPARE(file->cryptoParts.size(),   3);
+    QCOMPARE(file->size,                 static_cast<quint64>( data.size() ) );
+    QVERIFY(sfs.throughput() > 0);
+
+    for (QString part : file->cryptoParts.names()) {
+        QCOMPARE(QFile::exists("void_store/" + part), true);
+    }
+
+    QCOMPARE(QDir("void_store").entryList(QStringList() << "*.part").size(), 0);
+
+    // The first two parts hold the same clear text.
+    QVERIFY(file->cryptoParts.name(0) != file->cryptoParts.name(1));
+
+    // Progress is reported from the pool, so it's checked afterwards.
+    QList<quint64> done;
+    quint64        total = 0;
+    QMutex         mutex;
+
+    sfs.decryptFile("/big.bin", "void_store/big2.bin", [&](quint64 d, quint64 t) {
+        QMutexLocker locker(&mutex);
+        done << d;
+        total = t;
+    });
+
+    QFile f2("void_store/big2.bin");
+    f2.open(QIODevice::ReadOnly);
+    QByteArray data2 = f2.readAll();
+    f2.close();
+
+    QVERIFY(!done.isEmpty());
+
+    for (int i = 1; i < done.size(); i++) {
+        QVERIFY(done.at(i) > done.at(i - 1));
+    }
+
+    QCOMPARE(sfs.error,   StoreFS::Success);
+    QCOMPARE(done.last(), file->size);
+    QCOMPARE(total,       file->size);
+    QVERIFY(data == data2);
+
+    StoreFileDevice *device = sfs.open("/big.bin");
+
+    QVERIFY(device->open(QIODevice::ReadOnly));
+    QCOMPARE(device->size(), static_cast<qint64>( data.size() ) );
+    QVERIFY(device->seek(MAX_PART_SIZE - 10));
+    QVERIFY(device->read(20) == data.mid(MAX_PART_SIZE - 10, 20));
+    delete device;
+
+    sfs.removeFile("/big.bin");
 
     QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/big.bin");
+    QFile::remove("void_store/big2.bin");
     QDir::current().rmdir("void_store");
 }
 
 /**
- *  \brief Tests StoreFS#removeDir
+ *  \brief Tests that identical parts of a file get their own part files.
  */
-void VoidTest::storeFSRemoveDir()
+void VoidTest::storeFSIdenticalParts()
 {
     QDir::current().mkdir("void_store");
     StoreFS sfs("void_store");
 
-    QByteArray data = "Hello World";
+    QByteArray data = QByteArray(MAX_PART_SIZE, 'a').repeated(2) + "tail";
 
-    sfs.addFile("/dir/hello.txt", data);
-    QCOMPARE(sfs.error, StoreFS::Success);
-    sfs.addFile("/dir/subdir/hello.txt", data);
+    sfs.addFile("/memory.bin", data);
+
+    StoreFSFilePtr file = sfs.file("/memory.bin");
+
+    QCOMPARE(sfs.error,                StoreFS::Success);
+    QCOMPARE(file->cryptoParts.size(), 3);
+    QVERIFY(file->cryptoParts.name(0) != file->cryptoParts.name(1));
+    QVERIFY(sfs.decryptFile("/memory.bin") == data);
     QCOMPARE(sfs.error, StoreFS::Success);
-    sfs.addFile("/dir/hello2.txt", data);
+
+    StoreFileDevice *device = sfs.create("/device.bin");
+
+    QVERIFY(device->open(QIODevice::WriteOnly));
+    QCOMPARE(device->write(data), static_cast<qint64>( data.size() ) );
+    device->close();
+    delete device;
+
+    StoreFSFilePtr written = sfs.file("/device.bin");
+
+    QCOMPARE(written->cryptoParts.size(), 3);
+    QVERIFY(written->cryptoParts.name(0) != written->cryptoParts.name(1));
+
+    for (StoreFSFilePtr f : { file, written }) {
+        for (QString part : f->cryptoParts.names()) {
+            QCOMPARE(QFile::exists("void_store/" + part), true);
+        }
+    }
+
+    sfs.decryptFile("/device.bin", "void_store/device.bin");
     QCOMPARE(sfs.error, StoreFS::Success);
 
-    QString name1 = sfs.file("/dir/hello.txt")->cryptoParts.first();
-    QString name2 = sfs.file("/dir/subdir/hello.txt")->cryptoParts.first();
-    QString name3 = sfs.file("/dir/hello2.txt")->cryptoParts.first();
+    QFile f("void_store/device.bin");
+    f.open(QIODevice::ReadOnly);
+    QVERIFY(f.readAll() == data);
+    f.close();
 
-    QCOMPARE(QFile::exists("void_store/" + name1), true);
-    QCOMPARE(QFile::exists("void_store/" + name2), true);
-    QCOMPARE(QFile::exists("void_store/" + name3), true);
+    device = sfs.open("/device.bin");
 
-    sfs.removeDir("/dir");
+    QVERIFY(device->open(QIODevice::ReadOnly));
+    QVERIFY(device->read(10) == data.left(10));
+    QVERIFY(device->seek(MAX_PART_SIZE + 10));
+    QVERIFY(device->read(10) == data.mid(MAX_PART_SIZE + 10, 10));
+    delete device;
 
-    QCOMPARE(sfs.dir("/dir") == nullptr,                   true);
-    QCOMPARE(sfs.dir("/dir/subdir") == nullptr,            true);
-    QCOMPARE(sfs.file("/dir/hello.txt") == nullptr,        true);
-    QCOMPARE(sfs.file("/dir/subdir/hello.txt") == nullptr, true);
-    QCOMPARE(sfs.file("/dir/hello2.txt") == nullptr,       true);
-    QCOMPARE(QFile::exists("void_store/" + name1),         false);
-    QCOMPARE(QFile::exists("void_store/" + name2),         false);
-    QCOMPARE(QFile::exists("void_store/" + name3),         false);
+    sfs.removeFile("/memory.bin");
+    sfs.removeFile("/device.bin");
 
     QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/device.bin");
     QDir::current().rmdir("void_store");
 }
 
 /**
- *  \brief Tests StoreFS#moveFile
+ *  \brief Tests that StoreFS#decryptFile(const QString, const QString)
+ *  leaves no output behind when a part is corrupted or the file digest
+ *  doesn't match.
  */
-void VoidTest::storeFSRenameFile()
+void VoidTest::storeFSDecryptCorruptedPart()
 {
     QDir::current().mkdir("void_store");
     StoreFS sfs("void_store");
 
-    QByteArray data = "Hello World";
+    sfs.addFile( "/hello.txt", QByteArray("Hello World").repeated(1000) );
 
-    sfs.addFile("/hello.txt", data);
-    QCOMPARE(sfs.error,                    StoreFS::Success);
+    StoreFSFilePtr file      = sfs.file("/hello.txt");
+    QString        part_name = "void_store/" + file->cryptoParts.name(0);
 
-    StoreFSFilePtr file = sfs.file("/hello.txt");
-    QCOMPARE(file != nullptr,              true);
+    QFile part(part_name);
+    part.open(QIODevice::ReadWrite);
+    QByteArray cipher = part.readAll();
+    cipher[10] = static_cast<char>(cipher[10] ^ 0x01);
+    part.seek(0);
+    part.write(cipher);
+    part.close();
 
-    QString expected_name = "void_store/" + file->cryptoParts.first();
-    QCOMPARE(QFile::exists(expected_name), true);
+    sfs.decryptFile("/hello.txt", "void_store/hello2.txt");
 
-    sfs.moveFile(file->path, "/Users/Alan/hello.txt");
+    QCOMPARE(sfs.error,                            StoreFS::PartCorrupted);
+    QCOMPARE(QFile::exists("void_store/hello2.txt"), false);
 
-    file = sfs.file("/Users/Alan/hello.txt");
-    QCOMPARE(file != nullptr, true);
+    sfs.addFile( "/bye.txt", QByteArray("Bye World").repeated(1000) );
 
-    file = sfs.file("/hello.txt");
-    QCOMPARE(file == nullptr, true);
+    StoreFSFilePtr bye = sfs.file("/bye.txt");
+    bye->digest[0] = static_cast<char>(bye->digest[0] ^ 0x01);
+
+    sfs.decryptFile("/bye.txt", "void_store/bye.txt");
+
+    QCOMPARE(sfs.error,                            StoreFS::WrongCheckSum);
+    QCOMPARE(QFile::exists("void_store/bye.txt"),  false);
+
+    sfs.removeFile("/bye.txt");
 
     QFile::remove("void_store/Store.void");
-    QFile::remove(expected_name);
+    QFile::remove(part_name);
     QDir::current().rmdir("void_store");
 }
 
 /**
- *  \brief Tests StoreFS#moveDir
+ *  \brief Tests StoreFS#open
  */
-void VoidTest::storeFSRenameDir()
+void VoidTest::storeFSOpen()
 {
     QDir::current().mkdir("void_store");
     StoreFS sfs("void_store");
 
-    QByteArray data = "Hello World";
+    QByteArray data = QByteArray("Hello World").repeated(1000);
 
-    sfs.addFile("/dir/hello.txt", data);
-    QCOMPARE(sfs.error, StoreFS::Success);
-    sfs.addFile("/dir/subdir/hello.txt", data);
-    QCOMPARE(sfs.error, StoreFS::Success);
-    sfs.addFile("/dir/hello2.txt", data);
-    QCOMPARE(sfs.error, StoreFS::Success);
+    sfs.addFile("/hello.txt", data);
 
-    sfs.moveDir("/dir", "/folder");
+    QCOMPARE(sfs.open("/nothing.txt"), static_cast<StoreFileDevice*>(nullptr) );
+    QCOMPARE(sfs.error,                StoreFS::NoSuchFile);
 
-    QCOMPARE(sfs.file("/folder/hello.txt") != nullptr,        true);
-    QCOMPARE(sfs.file("/folder/subdir/hello.txt") != nullptr, true);
-    QCOMPARE(sfs.file("/folder/hello2.txt") != nullptr,       true);
-    QCOMPARE(sfs.file("/dir/hello.txt") == nullptr,           true);
-    QCOMPARE(sfs.file("/dir/subdir/hello.txt") == nullptr,    true);
-    QCOMPARE(sfs.file("/dir/hello2.txt") == nullptr,          true);
+    StoreFileDevice *device = sfs.open("/hello.txt");
 
-    sfs.removeDir("/");
+    QCOMPARE(sfs.error,                          StoreFS::Success);
+    QCOMPARE(device->open(QIODevice::WriteOnly), false);
+    QCOMPARE(device->open(QIODevice::ReadOnly),  true);
+    QCOMPARE(device->size(),                     static_cast<qint64>( data.size() ) );
+    QCOMPARE(device->isSequential(),             false);
+    QVERIFY(device->seek(5000));
+    QVERIFY(device->read(100) == data.mid(5000, 100));
+    QVERIFY(device->seek(0));
+    QVERIFY(device->readAll() == data);
+    QCOMPARE(device->atEnd(),                    true);
+
+    delete device;
+
+    sfs.removeFile("/hello.txt");
 
     QFile::remove("void_store/Store.void");
     QDir::current().rmdir("void_store");
 }
 
 /**
- *  \brief Tests StoreFS#entryBeginsWith, StoreFS#entryEndsWith, StoreFS#entryContains and StoreFS#entryMatchRegExp.
+ *  \brief Tests StoreFS#create
  */
-void VoidTest::storeFSFilters()
+void VoidTest::storeFSCreate()
 {
     QDir::current().mkdir("void_store");
     StoreFS sfs("void_store");
 
-    QByteArray data = "Hello World";
-
-    sfs.addFile("/dir/hello", data);
-    QCOMPARE(sfs.error, StoreFS::Success);
-    sfs.addFile("/dir/subdir/hello.txt", data);
-    QCOMPARE(sfs.error, StoreFS::Success);
-    sfs.addFile("/folder/subdir/hello2.txt", data);
-    QCOMPARE(sfs.error,  StoreFS::Success);
+    QByteArray data      = QByteArray("Hello World").repeated(100000);
+    bool       committed = false;
 
-    QList<quint64> ids = sfs.entryBeginsWith("/dir");
-    QCOMPARE(ids.size(), 4);
-    for ( quint64 id : ids ) {
-        QStringList dpaths = {
-            "/dir", "/dir/subdir"
-        };
+    StoreFileDevice *device = sfs.create("/dir/hello.txt", [&committed]() {
+        committed = true;
+    });
 
-        QStringList fpaths = {
-            "/dir/hello", "/dir/subdir/hello.txt"
-        };
+    QCOMPARE(sfs.error,                          StoreFS::Success);
+    QCOMPARE(device->open(QIODevice::ReadOnly),  false);
+    QCOMPARE(device->open(QIODevice::WriteOnly), true);
+    QCOMPARE(device->isSequential(),             true);
 
-        if ( id > ( ( static_cast<quint64> (1) ) << 63 ) ) {
-            QCOMPARE(dpaths.contains(sfs.dir(id)->path), true);
-        } else {
-            QCOMPARE(fpaths.contains(sfs.file(id)->path), true);
-        }
+    for (int i = 0; i < data.size(); i += 333333) {
+        QVERIFY(device->write(data.mid(i, 333333)) > 0);
     }
 
-    ids = sfs.entryEndsWith("txt");
-    QCOMPARE(ids.size(), 2);
-    for ( quint64 id : ids ) {
-        QStringList fpaths = {
-            "/folder/subdir/hello2.txt", "/dir/subdir/hello.txt"
-        };
+    QCOMPARE(sfs.file("/dir/hello.txt"), StoreFSFilePtr());
 
-        if ( id > ( ( static_cast<quint64> (1) ) << 63 ) ) {
-            QCOMPARE(false, true);
-        } else {
-            QCOMPARE(fpaths.contains(sfs.file(id)->path), true);
-        }
+    device->close();
+    delete device;
+
+    StoreFSFilePtr file = sfs.file("/dir/hello.txt");
+
+    QCOMPARE(committed,  true);
+    QVERIFY(file != nullptr);
+    QCOMPARE(file->size, static_cast<quint64>( data.size() ) );
+    QVERIFY(sfs.decryptFile("/dir/hello.txt") == data);
+    QCOMPARE(sfs.error,  StoreFS::Success);
+
+    QCOMPARE(sfs.create("/dir/hello.txt"), static_cast<StoreFileDevice*>(nullptr) );
+    QCOMPARE(sfs.error,                    StoreFS::FileAlreadyExists);
+
+    sfs.removeFile("/dir/hello.txt");
+
+    QFile::remove("void_store/Store.void");
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests that StoreFileDevice reads and writes both StoreFSPartFormat
+ *  layouts, and that framed parts are authenticated frame by frame.
+ */
+void VoidTest::storeFSPartFormats()
+{
+    QDir::current().mkdir("void_store");
+
+    QByteArray data = QByteArray::fromStdString( Crypto::generateRandom(1000000) );
+
+    for (StoreFSPartFormat format : { SINGLE_MESSAGE, FRAMED }) {
+        StoreFSFilePtr file(new StoreFSFile);
+
+        file->format    = format;
+        file->frameSize = 65536;
+        file->key       = QByteArray::fromStdString( Crypto::generateRandom(32) );
+        file->iv        = QByteArray::fromStdString( Crypto::generateRandom(16) );
+        file->salt      = QByteArray::fromStdString( Crypto::generateRandom(16) );
+
+        StoreFileDevice writer(file, "void_store", [](StoreFSFilePtr) {
+            return true;
+        });
+
+        QVERIFY(writer.open(QIODevice::WriteOnly));
+        QCOMPARE(writer.write(data), static_cast<qint64>( data.size() ) );
+        writer.close();
+
+        QString partPath = "void_store/" + file->cryptoParts.name(0);
+        qint64  frames   = format == FRAMED ? data.size() / 65536 + 1 : 1;
+
+        QCOMPARE(QFileInfo(partPath).size(), data.size() + frames * static_cast<qint64>( Crypto::tagSize() ) );
+
+        StoreFileDevice reader(file, "void_store");
+
+        QVERIFY(reader.open(QIODevice::ReadOnly));
+        QVERIFY(reader.seek(500000));
+        QVERIFY(reader.read(1000) == data.mid(500000, 1000));
+        QVERIFY(reader.seek(0));
+        QVERIFY(reader.readAll() == data);
+
+        // Corrupts the last frame only. Framed files still serve the rest.
+        QFile part(partPath);
+        part.open(QIODevice::ReadWrite);
+        part.seek(part.size() - 1);
+        char last = part.read(1).at(0);
+        part.seek(part.size() - 1);
+        part.write(QByteArray(1, static_cast<char>(last ^ 0x01)));
+        part.close();
+
+        StoreFileDevice corrupted(file, "void_store");
+
+        QVERIFY(corrupted.open(QIODevice::ReadOnly));
+        QCOMPARE(corrupted.read(10) == data.left(10), format == FRAMED);
+        QVERIFY(corrupted.seek(data.size() - 10));
+        QCOMPARE(corrupted.read(10).isEmpty(),       true);
+
+        QFile::remove(partPath);
+    }
+
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests StoreFS#removeFile
+ */
+void VoidTest::storeFSRemoveFile()
+{
+    QDir::current().mkdir("void_store");
+    StoreFS sfs("void_store");
+
+    QByteArray data = "Hello World";
+
+    sfs.addFile("/hello.txt", data);
+    QCOMPARE(sfs.error,                    StoreFS::Success);
+
+    StoreFSFilePtr file = sfs.file("/hello.txt");
+    QCOMPARE(file != nullptr,              true);
+
+    QString expected_name = "void_store/" + file->cryptoParts.name(0);
+    QCOMPARE(QFile::exists(expected_name), true);
+
+    sfs.removeFile(file->path());
+
+    file = sfs.file("/hello.txt");
+    QCOMPARE(file == nullptr,              true);
+    QCOMPARE(QFile::exists(expected_name), false);
+
+    QFile::remove("void_store/Store.void");
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests StoreFS#removeDir
+ */
+void VoidTest::storeFSRemoveDir()
+{
+    QDir::current().mkdir("void_store");
+    StoreFS sfs("void_store");
+
+    QByteArray data = "Hello World";
+
+    sfs.addFile("/dir/hello.txt", data);
+    QCOMPARE(sfs.error, StoreFS::Success);
+    sfs.addFile("/dir/subdir/hello.txt", data);
+    QCOMPARE(sfs.error, StoreFS::Success);
+    sfs.addFile("/dir/hello2.txt", data);
+    QCOMPARE(sfs.error, StoreFS::Success);
+
+    QString name1 = sfs.file("/dir/hello.txt")->cryptoParts.name(0);
+    QString name2 = sfs.file("/dir/subdir/hello.txt")->cryptoParts.name(0);
+    QString name3 = sfs.file("/dir/hello2.txt")->cryptoParts.name(0);
+
+    QCOMPARE(QFile::exists("void_store/" + name1), true);
+    QCOMPARE(QFile::exists("void_store/" + name2), true);
+    QCOMPARE(QFile::exists("void_store/" + name3), true);
+
+    sfs.removeDir("/dir");
+
+    QCOMPARE(sfs.dir("/dir") == nullptr,                   true);
+    QCOMPARE(sfs.dir("/dir/subdir") == nullptr,            true);
+    QCOMPARE(sfs.file("/dir/hello.txt") == nullptr,        true);
+    QCOMPARE(sfs.file("/dir/subdir/hello.txt") == nullptr, true);
+    QCOMPARE(sfs.file("/dir/hello2.txt") == nullptr,       true);
+    QCOMPARE(QFile::exists("void_store/" + name1),         false);
+    QCOMPARE(QFile::exists("void_store/" + name2),         false);
+    QCOMPARE(QFile::exists("void_store/" + name3),         false);
+
+    QFile::remove("void_store/Store.void");
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests StoreFS#moveFile
+ */
+void VoidTest::storeFSRenameFile()
+{
+    QDir::current().mkdir("void_store");
+    StoreFS sfs("void_store");
+
+    QByteArray data = "Hello World";
+
+    sfs.addFile("/hello.txt", data);
+    QCOMPARE(sfs.error,                    StoreFS::Success);
+
+    StoreFSFilePtr file = sfs.file("/hello.txt");
+    QCOMPARE(file != nullptr,              true);
+
+    QString expected_name = "void_store/" + file->cryptoParts.name(0);
+    QCOMPARE(QFile::exists(expected_name), true);
+
+    sfs.moveFile(file->path(), "/Users/Alan/hello.txt");
+
+    file = sfs.file("/Users/Alan/hello.txt");
+    QCOMPARE(file != nullptr, true);
+
+    file = sfs.file("/hello.txt");
+    QCOMPARE(file == nullptr, true);
+
+    QFile::remove("void_store/Store.void");
+    QFile::remove(expected_name);
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests StoreFS#moveDir
+ */
+void VoidTest::storeFSRenameDir()
+{
+    QDir::current().mkdir("void_store");
+    StoreFS sfs("void_store");
+
+    QByteArray data = "Hello World";
+
+    sfs.addFile("/dir/hello.txt", data);
+    QCOMPARE(sfs.error, StoreFS::Success);
+    sfs.addFile("/dir/subdir/hello.txt", data);
+    QCOMPARE(sfs.error, StoreFS::Success);
+    sfs.addFile("/dir/hello2.txt", data);
+    QCOMPARE(sfs.error, StoreFS::Success);
+
+    sfs.moveDir("/dir", "/folder");
+
+    QCOMPARE(sfs.file("/folder/hello.txt") != nullptr,        true);
+    QCOMPARE(sfs.file("/folder/subdir/hello.txt") != nullptr, true);
+    QCOMPARE(sfs.file("/folder/hello2.txt") != nullptr,       true);
+    QCOMPARE(sfs.file("/dir/hello.txt") == nullptr,           true);
+    QCOMPARE(sfs.file("/dir/subdir/hello.txt") == nullptr,    true);
+    QCOMPARE(sfs.file("/dir/hello2.txt") == nullptr,          true);
+
+    sfs.removeDir("/");
+
+    QFile::remove("void_store/Store.void");
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests that StoreFS#moveDir relinks the directory, so its files,
+ *  subdirectories and IDs follow it, and that searches see the new paths.
+ */
+void VoidTest::storeFSMoveDir()
+{
+    QDir::current().mkdir("void_store");
+    StoreFS sfs("void_store");
+
+    QByteArray data = "Hello World";
+
+    sfs.addFile("/dir/a/hello.txt", data);
+    QCOMPARE(sfs.error, StoreFS::Success);
+    sfs.addFile("/dir/a/b/world.txt", data);
+    QCOMPARE(sfs.error, StoreFS::Success);
+    sfs.makePath("/dir/a/empty");
+    sfs.addFile("/other/readme.txt", data);
+    QCOMPARE(sfs.error, StoreFS::Success);
+
+    quint64 id = sfs.file("/dir/a/b/world.txt")->id;
+
+    // Builds the search index, so the move has to update it.
+    QCOMPARE(sfs.entryContains("/dir/a/").size(), 4);
+
+    sfs.moveDir("/dir/a", "/new/place");
+    QCOMPARE(sfs.error, StoreFS::Success);
+
+    QCOMPARE(sfs.dir("/dir/a") == nullptr,                   true);
+    QCOMPARE(sfs.file("/dir/a/hello.txt") == nullptr,        true);
+    QCOMPARE(sfs.dir("/new/place/empty") != nullptr,         true);
+    QCOMPARE(sfs.file("/new/place/b/world.txt")->id,         id);
+    QCOMPARE(sfs.path(id),                                   QString("/new/place/b/world.txt") );
+    QCOMPARE(sfs.dir("/new/place")->path(),                  QString("/new/place") );
+    QCOMPARE(sfs.entryBeginsWith("/dir/a").size(),           0);
+    QCOMPARE(sfs.entryBeginsWith("/new/place/").size(),      4);
+    QCOMPARE(sfs.entryEndsWith("b/world.txt"),               QList<quint64>() << id);
+    QCOMPARE(sfs.entryContains("/dir/a/").size(),            0);
+    QCOMPARE(sfs.entryMatchRegExp("^/new/.*\\.txt$").size(), 2);
+    QCOMPARE(sfs.decryptFile("/new/place/hello.txt"),        data);
+
+    // A directory can't be moved inside itself.
+    sfs.moveDir("/new", "/new/place/new");
+    QCOMPARE(sfs.dir("/new/place/new") == nullptr, true);
+
+    // Moving onto an existing directory merges them.
+    sfs.moveDir("/new/place", "/other");
+    QCOMPARE(sfs.file("/other/b/world.txt")->id,       id);
+    QCOMPARE(sfs.file("/other/hello.txt") != nullptr,  true);
+    QCOMPARE(sfs.file("/other/readme.txt") != nullptr, true);
+    QCOMPARE(sfs.dir("/new/place") == nullptr,         true);
+
+    sfs.removeDir("/");
+
+    QFile::remove("void_store/Store.void");
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests that StoreFS#makePath finds subdirectories by name in a wide
+ *  directory, and follows renamed and removed ones.
+ */
+void VoidTest::storeFSWideDir()
+{
+    QDir::current().mkdir("void_store");
+    StoreFS sfs("void_store");
+
+    QElapsedTimer timer;
+
+    timer.start();
+
+    for (int i = 0; i < 50000; i++) {
+        sfs.makePath(QString("/wide/dir%1").arg(i) );
+    }
+
+    qint64 make = timer.nsecsElapsed();
+
+    timer.restart();
+
+    for (int i = 0; i < 50000; i++) {
+        sfs.makePath(QString("/wide/dir%1/sub").arg(i) );
+    }
+
+    qint64 deeper = timer.nsecsElapsed();
+
+    QCOMPARE(sfs.dir("/wide")->subdirs.size(), 50000);
+
+    StoreFSDirPtr d = sfs.dir("/wide/dir123");
+
+    sfs.moveDir("/wide/dir123", "/wide/renamed");
+
+    QCOMPARE(sfs.makePath("/wide/renamed"),     d);
+    QCOMPARE(sfs.makePath("/wide/dir123") != d, true);
+    QCOMPARE(sfs.dir("/wide")->subdirs.size(),  50001);
+
+    sfs.removeDir("/wide/renamed");
+
+    QCOMPARE(sfs.dir("/wide/renamed/sub") == nullptr, true);
+    QCOMPARE(sfs.makePath("/wide/renamed") != d,      true);
+
+    qInfo("50000 subdirectories: make %.2fms, one level deeper %.2fms", make / 1e6, deeper / 1e6);
+
+    sfs.removeDir("/");
+
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests that entries with the same name share it, that removed
+ *  entries and the whole tree are released, and that entries held after
+ *  the tree is dropped don't point to it.
+ */
+void VoidTest::storeFSRelease()
+{
+    QDir::current().mkdir("void_store");
+
+    std::weak_ptr<StoreFSDir>  dir;
+    std::weak_ptr<StoreFSDir>  removedDir;
+    std::weak_ptr<StoreFSFile> removedFile;
+    StoreFSFilePtr             kept;
+
+    {
+        StoreFS sfs("void_store");
+
+        sfs.addFile("/a/b/c/hello.txt", "Hello");
+        sfs.addFile("/d/e/hello.txt",   "Hello");
+        sfs.addFile("/d/e/world.txt",   "World");
+
+        // Entries held across StoreFS#load are left without a parent.
+        kept = sfs.file("/a/b/c/hello.txt");
+        sfs.load(sfs.serialize() );
+
+        QCOMPARE(kept->parent == nullptr,               true);
+        QCOMPARE(sfs.file("/a/b/c/hello.txt")->path(), QString("/a/b/c/hello.txt") );
+
+        QCOMPARE(sfs.file("/a/b/c/hello.txt")->name.constData(), sfs.file("/d/e/hello.txt")->name.constData() );
+
+        dir         = sfs.dir("/a/b/c");
+        removedDir  = sfs.dir("/d/e");
+        removedFile = sfs.file("/d/e/world.txt");
+
+        sfs.removeDir("/d");
+
+        QCOMPARE(removedDir.expired(),  true);
+        QCOMPARE(removedFile.expired(), true);
+        QCOMPARE(dir.expired(),         false);
+
+        kept = sfs.file("/a/b/c/hello.txt");
+    }
+
+    QCOMPARE(dir.expired(),           true);
+    QCOMPARE(kept->parent == nullptr, true);
+
+    for (QString partName : kept->cryptoParts.names()) {
+        QFile::remove("void_store/" + partName);
+    }
+
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests StoreFS#entryBeginsWith, StoreFS#entryEndsWith, StoreFS#entryContains and StoreFS#entryMatchRegExp.
+ */
+void VoidTest::storeFSFilters()
+{
+    QDir::current().mkdir("void_store");
+    StoreFS sfs("void_store");
+
+    QByteArray data = "Hello World";
+
+    sfs.addFile("/dir/hello", data);
+    QCOMPARE(sfs.error, StoreFS::Success);
+    sfs.addFile("/dir/subdir/hello.txt", data);
+    QCOMPARE(sfs.error, StoreFS::Success);
+    sfs.addFile("/folder/subdir/hello2.txt", data);
+    QCOMPARE(sfs.error,  StoreFS::Success);
+
+    QList<quint64> ids = sfs.entryBeginsWith("/dir");
+    QCOMPARE(ids.size(), 4);
+    for ( quint64 id : ids ) {
+        QStringList dpaths = {
+            "/dir", "/dir/subdir"
+        };
+
+        QStringList fpaths = {
+            "/dir/hello", "/dir/subdir/hello.txt"
+        };
+
+        if ( id > ( ( static_cast<quint64> (1) ) << 63 ) ) {
+            QCOMPARE(dpaths.contains(sfs.dir(id)->path()), true);
+        } else {
+            QCOMPARE(fpaths.contains(sfs.file(id)->path()), true);
+        }
+    }
+
+    ids = sfs.entryEndsWith("txt");
+    QCOMPARE(ids.size(), 2);
+    for ( quint64 id : ids ) {
+        QStringList fpaths = {
+            "/folder/subdir/hello2.txt", "/dir/subdir/hello.txt"
+        };
+
+        if ( id > ( ( static_cast<quint64> (1) ) << 63 ) ) {
+            QCOMPARE(false, true);
+        } else {
+            QCOMPARE(fpaths.contains(sfs.file(id)->path()), true);
+        }
+    }
+
+    ids = sfs.entryContains("subdir");
+    QCOMPARE(ids.size(), 4);
+    for ( quint64 id : ids ) {
+        QStringList dpaths = {
+            "/dir/subdir", "/folder/subdir"
+        };
+
+        QStringList fpaths = {
+            "/folder/subdir/hello2.txt", "/dir/subdir/hello.txt"
+        };
+
+        if ( id > ( ( static_cast<quint64> (1) ) << 63 ) ) {
+            QCOMPARE(dpaths.contains(sfs.dir(id)->path()), true);
+        } else {
+            QCOMPARE(fpaths.contains(sfs.file(id)->path()), true);
+        }
+    }
+
+    ids = sfs.entryMatchRegExp(".*hello[0-9]?.txt");
+    QCOMPARE(ids.size(), 2);
+    for ( quint64 id : ids ) {
+        QStringList fpaths = {
+            "/folder/subdir/hello2.txt", "/dir/subdir/hello.txt"
+        };
+
+        if ( id > ( ( static_cast<quint64> (1) ) << 63 ) ) {
+            QCOMPARE(false, true);
+        } else {
+            QCOMPARE(fpaths.contains(sfs.file(id)->path()), true);
+        }
+    }
+
+    sfs.removeDir("/");
+
+    QFile::remove("void_store/Store.void");
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests StoreFS#allFiles, StoreFS#allDirs and StoreFS#allEntries
+ */
+void VoidTest::storeFSFetchAll()
+{
+    QDir::current().mkdir("void_store");
+    StoreFS sfs("void_store");
+
+    QByteArray data = "Hello World";
+
+    sfs.addFile("/dir/hello", data);
+    QCOMPARE(sfs.error, StoreFS::Success);
+    sfs.addFile("/dir/subdir/hello.txt", data);
+    QCOMPARE(sfs.error, StoreFS::Success);
+    sfs.addFile("/folder/subdir/hello2.txt", data);
+    QCOMPARE(sfs.error,                                   StoreFS::Success);
+
+    QStringList paths = sfs.allDirs();
+    QCOMPARE(paths.size(),                                5);
+    QCOMPARE(paths.contains("/"),                         true);
+    QCOMPARE(paths.contains("/dir"),                      true);
+    QCOMPARE(paths.contains("/dir/subdir"),               true);
+    QCOMPARE(paths.contains("/folder"),                   true);
+    QCOMPARE(paths.contains("/folder/subdir"),            true);
+
+    paths = sfs.allFiles();
+    QCOMPARE(paths.size(),                                3);
+    QCOMPARE(paths.contains("/dir/hello"),                true);
+    QCOMPARE(paths.contains("/dir/subdir/hello.txt"),     true);
+    QCOMPARE(paths.contains("/folder/subdir/hello2.txt"), true);
+
+    paths = sfs.allEntries();
+    QCOMPARE(paths.size(),                                8);
+    QCOMPARE(paths.contains("/"),                         true);
+    QCOMPARE(paths.contains("/dir"),                      true);
+    QCOMPARE(paths.contains("/dir/subdir"),               true);
+    QCOMPARE(paths.contains("/folder"),                   true);
+    QCOMPARE(paths.contains("/folder/subdir"),            true);
+    QCOMPARE(paths.contains("/dir/hello"),                true);
+    QCOMPARE(paths.contains("/dir/subdir/hello.txt"),     true);
+    QCOMPARE(paths.contains("/folder/subdir/hello2.txt"), true);
+
+    sfs.removeDir("/");
+
+    QFile::remove("void_store/Store.void");
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests StoreFS#serialize and StoreFS#load, including records that use
+ *  the chained file digest of older stores.
+ */
+void VoidTest::storeFSSerialize()
+{
+    QDir::current().mkdir("void_store");
+    StoreFS sfs("void_store");
+
+    QByteArray data = "Hello World";
+
+    sfs.addFile("/tree.txt", data);
+    QCOMPARE(sfs.error, StoreFS::Success);
+    sfs.addFile("/chained.txt", data);
+    QCOMPARE(sfs.error, StoreFS::Success);
+
+    StoreFSFilePtr chained = sfs.file("/chained.txt");
+    chained->params.fileDigest = CHAINED;
+    chained->digest            = QByteArray::fromStdString( Crypto::fileDigest(std::vector<std::string> { Crypto::digest( data.toStdString() ) }, chained->params) );
+
+    StoreFS loaded("void_store");
+    loaded.load( sfs.serialize() );
+
+    QCOMPARE(loaded.file("/tree.txt")->params.fileDigest,    MERKLE_TREE);
+    QCOMPARE(loaded.file("/chained.txt")->params.fileDigest, CHAINED);
+    QCOMPARE(loaded.file("/tree.txt")->format,               FRAMED);
+    QCOMPARE(loaded.file("/tree.txt")->frameSize,            static_cast<quint32>(FRAME_SIZE) );
+    QCOMPARE(loaded.decryptFile("/tree.txt"),                data);
+    QCOMPARE(loaded.error,                                   StoreFS::Success);
+    QCOMPARE(loaded.decryptFile("/chained.txt"),             data);
+    QCOMPARE(loaded.error,                                   StoreFS::Success);
+
+    loaded.removeDir("/");
+
+    QFile::remove("void_store/Store.void");
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests that the compact index keeps every field, decodes files
+ *  only when they are accessed, reports records it can't read, and that
+ *  older indexes still load.
+ */
+void VoidTest::storeFSIndex()
+{
+    QDir::current().mkdir("void_store");
+    StoreFS sfs("void_store");
+
+    sfs.addFile("/a/hello.txt", "Hello World");
+    sfs.addFile("/a/bye.txt",   "Bye World");
+    sfs.addFile("/b/héllo.txt", "Hello Again");
+
+    StoreFSFilePtr hello = sfs.file("/a/hello.txt");
+    hello->metadata["type"]  = "text/plain";
+    hello->metadata["thumb"] = QByteArray(16, 'x');
+    sfs.file("/b/héllo.txt")->metadata["type"] = "text/plain";
+
+    StoreFS loaded("void_store");
+    loaded.load( sfs.serialize() );
+
+    QCOMPARE(loaded.allFiles().size(),             3);
+    QCOMPARE(loaded.dir("/a")->files.size(),       2);
+    QVERIFY(loaded.dir("/a")->files.first()->index != nullptr);
+
+    StoreFSFilePtr file = loaded.file("/a/hello.txt");
+
+    QVERIFY(file->index == nullptr);
+
+    QCOMPARE(file->size,                           hello->size);
+    QCOMPARE(file->metadata,                       hello->metadata);
+    QCOMPARE(file->key,                            hello->key);
+    QCOMPARE(file->iv,                             hello->iv);
+    QCOMPARE(file->salt,                           hello->salt);
+    QCOMPARE(file->digest,                         hello->digest);
+    QCOMPARE(file->cryptoParts,                    hello->cryptoParts);
+    QCOMPARE(file->params.keyDerivationCost,       hello->params.keyDerivationCost);
+    QCOMPARE(file->format,                         hello->format);
+    QCOMPARE(file->frameSize,                      hello->frameSize);
+    QCOMPARE(loaded.decryptFile("/a/hello.txt"),   QByteArray("Hello World") );
+    QCOMPARE(loaded.error,                         StoreFS::Success);
+
+    QCOMPARE(loaded.file("/b/héllo.txt")->metadata["type"], QByteArray("text/plain") );
+
+    // A record cut short is reported and left encoded, never half read.
+    QByteArray cut = sfs.serialize();
+    StoreFS    truncated("void_store");
+
+    cut.chop(10);
+    truncated.load(cut);
+
+    QCOMPARE(truncated.error,                                StoreFS::Success);
+    QVERIFY(truncated.file("/b/héllo.txt") == nullptr);
+    QCOMPARE(truncated.error,                                StoreFS::IndexCorrupted);
+    QVERIFY(truncated.dir("/b")->files.first()->index != nullptr);
+    QVERIFY(truncated.dir("/b")->files.first()->metadata.isEmpty() );
+    QCOMPARE(truncated.decryptFile("/b/héllo.txt"),          QByteArray() );
+    QCOMPARE(truncated.error,                                StoreFS::IndexCorrupted);
+    QCOMPARE(truncated.serializeSegment("b"),                QByteArray() );
+    QCOMPARE(truncated.error,                                StoreFS::IndexCorrupted);
+    QCOMPARE(truncated.serializeSegment("a").isEmpty(),      false);
+    QCOMPARE(truncated.error,                                StoreFS::Success);
+
+    // An index whose paths are cut short isn't loaded at all.
+    truncated.load(cut.left(8) );
+
+    QCOMPARE(truncated.error,                                StoreFS::IndexCorrupted);
+    QCOMPARE(truncated.allFiles().size(),                    0);
+
+    // A version 3 index is a plain sequence of records, which name their
+    // parts in hex.
+    QByteArray  legacy;
+    QDataStream stream(&legacy, QIODevice::WriteOnly);
+
+    auto writeLegacy = [&stream](const QString &path, const StoreFSFilePtr &file, const QStringList &partNames) {
+        QMap<quint32, QString> parts;
+
+        for (int i = 0; i < partNames.size(); i++) {
+            parts[static_cast<quint32>(i)] = partNames.at(i);
+        }
+
+        stream << path
+               << file->size
+               << file->metadata
+               << file->key
+               << file->iv
+               << file->salt
+               << file->digest
+               << parts
+               << static_cast<quint8>(file->params.digest)
+               << static_cast<quint8>(file->params.encryption)
+               << static_cast<quint8>(file->params.keyDerivationFunction)
+               << static_cast<quint8>(file->params.keyDerivationHash)
+               << file->params.keyDerivationCost
+               << static_cast<quint8>(file->params.fileDigest)
+               << static_cast<quint8>(file->format)
+               << file->frameSize;
+    };
+
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << static_cast<quint32>(3);
+
+    for (QString path : QStringList() << "/a/hello.txt" << "/b/héllo.txt") {
+        writeLegacy(path, sfs.file(path), sfs.file(path)->cryptoParts.names() );
+    }
+
+    StoreFS old("void_store");
+    old.load(legacy);
+
+    QCOMPARE(old.allFiles().size(),                       2);
+    QCOMPARE(old.file("/a/hello.txt")->metadata,          hello->metadata);
+    QCOMPARE(old.file("/a/hello.txt")->cryptoParts,       hello->cryptoParts);
+    QCOMPARE(old.decryptFile("/a/hello.txt"),             QByteArray("Hello World") );
+
+    // Parts must be named after their digest.
+    writeLegacy("/c/hello.txt", hello, QStringList() << "hand written");
+    old.load(legacy);
+
+    QCOMPARE(old.error,                                   StoreFS::IndexCorrupted);
+    QCOMPARE(old.allFiles().size(),                       0);
+
+    sfs.removeDir("/");
+
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests that StoreFSPartList keeps digests raw, names their files in
+ *  hex, and serializes the raw digests.
+ */
+void VoidTest::storeFSPartList()
+{
+    std::string     digest = Crypto::generateRandom(64);
+    QString         hex    = QString::fromStdString(Crypto::stringToHex(digest, "") );
+    StoreFSPartList parts;
+
+    parts.appendDigest(QByteArray::fromStdString(digest) );
+    parts.appendDigest(QByteArray::fromStdString(digest) );
+    parts.appendDigest(QByteArray::fromStdString(Crypto::generateRandom(32) ) );
+
+    QCOMPARE(parts.size(),                                  3);
+    QCOMPARE(parts.name(0),                                 hex);
+    QCOMPARE(parts.name(1),                                 hex);
+    QCOMPARE(parts.name(2).size(),                          64);
+    QCOMPARE(parts.name(3),                                 QString() );
+    QCOMPARE(parts.bytes(1),                                QByteArray::fromStdString(digest) );
+    QCOMPARE(StoreFSPartList::fileName(digest),             hex);
+    QCOMPARE(StoreFSPartList::isFileName(hex),              true);
+    QCOMPARE(StoreFSPartList::isFileName("hand written"),   false);
+    QCOMPARE(StoreFSPartList::isFileName(hex.toLower() ),   false);
+    QCOMPARE(parts.matches(0, digest),                      true);
+    QCOMPARE(parts.matches(0, Crypto::generateRandom(64) ), false);
+    QCOMPARE(parts.matches(3, digest),                      false);
+
+    QByteArray      data;
+    StoreFSPartList read;
+
+    {
+        QDataStream out(&data, QIODevice::WriteOnly);
+        out << parts;
+    }
+
+    QDataStream in(data);
+    in >> read;
+
+    QCOMPARE(read == parts, true);
+    QCOMPARE(data.size(),   4 + 3 * 4 + 64 + 64 + 32);
+
+    parts.removeLast();
+
+    QCOMPARE(parts.size(),  2);
+    QCOMPARE(parts.names(), QStringList() << hex << hex);
+    QCOMPARE(read != parts, true);
+}
+
+/**
+ *  \brief Tests that StoreFSNodeTable gives IDs from its base and reuses the
+ *  slots of removed nodes.
+ */
+void VoidTest::storeFSNodeTable()
+{
+    StoreFSNodeTable<StoreFSDir> table(DIR_ID_BASE);
+
+    StoreFSDirPtr a = std::make_shared<StoreFSDir>();
+    StoreFSDirPtr b = std::make_shared<StoreFSDir>();
+    StoreFSDirPtr c = std::make_shared<StoreFSDir>();
+
+    QCOMPARE(table.insert(a), DIR_ID_BASE);
+    QCOMPARE(table.insert(b), DIR_ID_BASE + 1);
+    QCOMPARE(b->id,           DIR_ID_BASE + 1);
+    QCOMPARE(table.size(),    2);
+
+    table.remove(a->id);
+    table.remove(a->id);
+
+    QCOMPARE(table.size(),                    1);
+    QCOMPARE(table.contains(DIR_ID_BASE),     false);
+    QCOMPARE(table.value(DIR_ID_BASE),        StoreFSDirPtr() );
+    QCOMPARE(table.value(DIR_ID_BASE + 1),    b);
+    QCOMPARE(table.contains(0),               false);
+    QCOMPARE(table.contains(DIR_ID_BASE + 2), false);
+
+    // The slot of a is reused before the table grows.
+    QCOMPARE(table.insert(c), DIR_ID_BASE);
+    QCOMPARE(table.ids(),     QList<quint64>() << DIR_ID_BASE << DIR_ID_BASE + 1);
+    QCOMPARE(table.values(),  QList<StoreFSDirPtr>() << c << b);
+
+    table.clear();
+
+    QCOMPARE(table.size(), 0);
+    QCOMPARE(table.ids(),  QList<quint64>() );
+}
+
+/**
+ *  \brief Tests that StoreFSPathTrie splits and merges its edges and lists
+ *  prefixes in order.
+ */
+void VoidTest::storeFSPathTrie()
+{
+    StoreFSPathTrie trie;
+
+    trie.insert("",           0);
+    trie.insert("/abc",       1);
+    trie.insert("/abd",       2);
+    trie.insert("/ab",        3);
+    trie.insert("/abc/x.txt", 4);
+    trie.insert("/b",         5);
+
+    QCOMPARE(trie.size(),                6);
+    QCOMPARE(trie.keys(),                QStringList() << "" << "/ab" << "/abc" << "/abc/x.txt" << "/abd" << "/b");
+    QCOMPARE(trie.value("/abd"),         static_cast<quint64>(2) );
+    QCOMPARE(trie.withPrefix("/a"),      QList<quint64>() << 3 << 1 << 4 << 2);
+    QCOMPARE(trie.withPrefix("/abc"),    QList<quint64>() << 1 << 4);
+    QCOMPARE(trie.withPrefix("/abc/x"),  QList<quint64>() << 4);
+    QCOMPARE(trie.withPrefix("/c"),      QList<quint64>() );
+    QCOMPARE(trie.withPrefix("").size(), 6);
+    QVERIFY(!trie.contains("/a") );
+    QVERIFY(!trie.contains("/abc/") );
+
+    trie.insert("/abd", 7);
+
+    QCOMPARE(trie.size(),        6);
+    QCOMPARE(trie.value("/abd"), static_cast<quint64>(7) );
+
+    QVERIFY(trie.remove("/ab") );
+    QVERIFY(!trie.remove("/ab") );
+    QVERIFY(trie.remove("/abc") );
+    QVERIFY(trie.remove("/abd") );
+
+    QCOMPARE(trie.size(),              3);
+    QCOMPARE(trie.keys(),              QStringList() << "" << "/abc/x.txt" << "/b");
+    QCOMPARE(trie.withPrefix("/abc/"), QList<quint64>() << 4);
+
+    trie.insert("/abc/y.txt", 8);
+
+    QVERIFY(trie.move("/abc/", "/b/c/") );
+    QVERIFY(!trie.move("/abc/", "/d/") );
+
+    QCOMPARE(trie.size(),              4);
+    QCOMPARE(trie.keys(),              QStringList() << "" << "/b" << "/b/c/x.txt" << "/b/c/y.txt");
+    QCOMPARE(trie.withPrefix("/b/"),   QList<quint64>() << 4 << 8);
+    QCOMPARE(trie.value("/b/c/y.txt"), static_cast<quint64>(8) );
+    QVERIFY(!trie.contains("/abc/x.txt") );
+
+    trie.clear();
+
+    QCOMPARE(trie.size(), 0);
+    QCOMPARE(trie.keys(), QStringList() );
+}
+
+/**
+ *  \brief Tests that StoreFSTrigramIndex finds substrings and suffixes, with
+ *  and without case, and follows moved and removed paths.
+ */
+void VoidTest::storeFSTrigramIndex()
+{
+    StoreFSTrigramIndex index;
+
+    index.insert("",                  0);
+    index.insert("/Photos",           1);
+    index.insert("/Photos/beach.JPG", 2);
+    index.insert("/Photos/city.jpg",  3);
+    index.insert("/notes.txt",        4);
+
+    QCOMPARE(index.contains("hoto"),                       QList<quint64>() << 1 << 2 << 3);
+    QCOMPARE(index.contains("PHOTO"),                      QList<quint64>() );
+    QCOMPARE(index.contains("PHOTO", Qt::CaseInsensitive), QList<quint64>() << 1 << 2 << 3);
+    QCOMPARE(index.endsWith(".jpg"),                       QList<quint64>() << 3);
+    QCOMPARE(index.endsWith(".jpg", Qt::CaseInsensitive),  QList<quint64>() << 2 << 3);
+    QCOMPARE(index.contains("t"),                          QList<quint64>() << 1 << 2 << 3 << 4);
+    QCOMPARE(index.contains("").size(),                    5);
+    QCOMPARE(index.contains("xyz"),                        QList<quint64>() );
+
+    index.insert("/Archive/city.jpg", 3);
+    index.remove(2);
+
+    QCOMPARE(index.contains("hoto"),         QList<quint64>() << 1);
+    QCOMPARE(index.contains("city"),         QList<quint64>() << 3);
+    QCOMPARE(index.endsWith("ive/city.jpg"), QList<quint64>() << 3);
+
+    // A lower ID coming back keeps the lists sorted for the intersection.
+    index.insert("/Archive/beach.jpg", 2);
+
+    QCOMPARE(index.contains("Archive/"),   QList<quint64>() << 2 << 3);
+    QCOMPARE(index.endsWith("/beach.jpg"), QList<quint64>() << 2);
+
+    index.clear();
+
+    QCOMPARE(index.contains(""), QList<quint64>() );
+}
+
+/**
+ *  \brief Measures how long StoreFSTrigramIndex takes to search the paths
+ *  of a store with 500000 entries.
+ */
+void VoidTest::storeFSTrigramIndexBenchmark()
+{
+    StoreFSTrigramIndex index;
+
+    for (quint64 i = 0; i < 500000; i++) {
+        index.insert(QString("/dir%1/sub%2/file%3.txt").arg(i % 100).arg(i % 1000).arg(i), i);
+    }
+
+    QElapsedTimer timer;
+
+    timer.start();
+    QList<quint64> contains = index.contains("file12345", Qt::CaseInsensitive);
+    qint64         search   = timer.nsecsElapsed();
+
+    timer.restart();
+    QList<quint64> endsWith = index.endsWith("99.txt");
+    qint64         suffix   = timer.nsecsElapsed();
+
+    QCOMPARE(contains.size(), 11);
+    QCOMPARE(endsWith.size(), 5000);
+
+    qInfo("500000 paths: contains %.2fms, ends with %.2fms", search / 1e6, suffix / 1e6);
+}
+
+/**
+ *  \brief Tests that StoreFS#entryMatchRegExp finds the same entries when
+ *  it can narrow them down by a literal of the pattern and when it can't,
+ *  sorted by path.
+ */
+void VoidTest::storeFSRegExp()
+{
+    QDir::current().mkdir("void_store");
+    StoreFS sfs("void_store");
+
+    sfs.addFile("/dir/hello",                "Hello");
+    sfs.addFile("/dir/subdir/hello.txt",     "Hello");
+    sfs.addFile("/folder/subdir/hello2.txt", "Hello");
+
+    auto paths = [&sfs](const QString pattern) {
+        QStringList list;
+
+        for (quint64 id : sfs.entryMatchRegExp(pattern)) {
+            list << sfs.path(id);
+        }
+
+        return list;
+    };
+
+    QCOMPARE(paths("hello2?\\.txt$"),    QStringList() << "/dir/subdir/hello.txt" << "/folder/subdir/hello2.txt");
+    QCOMPARE(paths("hel{1,2}o2"),        QStringList() << "/folder/subdir/hello2.txt");
+    QCOMPARE(paths("(?i)HELLO$"),        QStringList() << "/dir/hello");
+    QCOMPARE(paths("^/(dir|x)/hello$"),  QStringList() << "/dir/hello");
+    QCOMPARE(paths("dir|folder").size(), 7);
+    QCOMPARE(paths("("),                 QStringList() );
+
+    // The arguments of escapes aren't literal.
+    sfs.addFile( "/ABC", QByteArray("ABC") );
+
+    QCOMPARE(paths("\\x41BC"),                QStringList() << "/ABC");
+    QCOMPARE(paths("\\x{41}BC"),              QStringList() << "/ABC");
+    QCOMPARE(paths("\\101BC"),                QStringList() << "/ABC");
+    QCOMPARE(paths("(?<n>A)\\k<n>?BC"),       QStringList() << "/ABC");
+    QCOMPARE(paths("(?<name>A)\\g<name>?BC"), QStringList() << "/ABC");
+
+    sfs.removeDir("/");
+
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests that segments declared with StoreFS#setSegments are only
+ *  loaded when a path inside them is accessed.
+ */
+void VoidTest::storeFSSegments()
+{
+    QDir::current().mkdir("void_store");
+    StoreFS sfs("void_store");
+
+    sfs.addFile("/a/1.txt",   "One");
+    sfs.addFile("/a/x/2.txt", "Two");
+    sfs.addFile("/b/3.txt",   "Three");
+    sfs.addFile("/root.txt",  "Root");
+
+    QCOMPARE(StoreFS::segment("/a/x/2.txt"), QString("a") );
+    QCOMPARE(StoreFS::segment("/root.txt"),  QString() );
+    QCOMPARE(sfs.serializeSegment("c"),      QByteArray() );
+
+    QMap<QString, QByteArray> segments;
+    QStringList               loaded;
+    QMutex                    mutex;
+
+    for (QString name : QStringList() << "" << "a" << "b") {
+        segments[name] = sfs.serializeSegment(name);
+    }
+
+    StoreFS lazy("void_store");
+    lazy.setSegments(segments.keys(), [&segments, &loaded, &mutex](const QString name) {
+        QMutexLocker locker(&mutex);
+        loaded << name;
+        return segments[name];
+    });
+
+    QCOMPARE(lazy.subdirs("/").size(),           2);
+    QCOMPARE(loaded,                             QStringList() << "");
+    QCOMPARE(lazy.decryptFile("/a/x/2.txt"),     QByteArray("Two") );
+    QCOMPARE(loaded,                             QStringList() << "" << "a");
+    QCOMPARE(lazy.entryBeginsWith("/a/").size(), 3);
+    QCOMPARE(loaded.size(),                      2);
+    QCOMPARE(lazy.allFiles().size(),             4);
+    QCOMPARE(loaded.size(),                      3);
+    QCOMPARE(lazy.decryptFile("/b/3.txt"),       QByteArray("Three") );
+
+    sfs.removeDir("/");
+
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests Store#Store
+ */
+void VoidTest::storeCreate()
+{
+    QString path     = QDir::current().filePath("void_store");
+    QString password = "pswd";
+
+    Store store(path, password, false);
+
+    QCOMPARE(store.error,                            Store::DoesntExistAndCreationIsNotPermitted);
+
+    Store store2(path, password, true);
+    QCOMPARE(store2.error,                           Store::Success);
+    QCOMPARE(QFile::exists("void_store/Store.void"), true);
+
+    QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/Store.journal");
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests that changes are journaled instead of rewriting Store.void,
+ *  and replayed when the store is opened again.
+ */
+void VoidTest::storeJournal()
+{
+    QString path     = QDir::current().filePath("void_store");
+    QString password = "pswd";
+
+    {
+        Store store(path, password, true);
+
+        QCOMPARE(store.error, Store::Success);
+
+        qint64 size = QFileInfo("void_store/Store.void").size();
+
+        store.addFileFromData("/a/hello.txt", "Hello World");
+        store.addFileFromData("/a/bye.txt",   "Bye World");
+        store.addFileFromData("/gone.txt",    "Gone");
+        store.setFileMetadata( "/a/hello.txt", "important", QByteArray("k") );
+        store.move("/a", "/b");
+        store.remove("/gone.txt");
+
+        QCOMPARE(QFileInfo("void_store/Store.void").size(), size);
+        QVERIFY(QFileInfo("void_store/Store.journal").size() > 0);
     }
 
-    ids = sfs.entryContains("subdir");
-    QCOMPARE(ids.size(), 4);
-    for ( quint64 id : ids ) {
-        QStringList dpaths = {
-            "/dir/subdir", "/folder/subdir"
-        };
+    // Simulates a crash in the middle of an append.
+    QFile journal("void_store/Store.journal");
+    journal.open(QIODevice::Append);
+    journal.write("torn");
+    journal.close();
 
-        QStringList fpaths = {
-            "/folder/subdir/hello2.txt", "/dir/subdir/hello.txt"
-        };
+    Store store(path, password, false);
 
-        if ( id > ( ( static_cast<quint64> (1) ) << 63 ) ) {
-            QCOMPARE(dpaths.contains(sfs.dir(id)->path), true);
-        } else {
-            QCOMPARE(fpaths.contains(sfs.file(id)->path), true);
-        }
+    QCOMPARE(store.error,                                     Store::Success);
+    QCOMPARE(store.listAllFiles().size(),                     2);
+    QCOMPARE(store.decryptFile("/b/hello.txt"),               QByteArray("Hello World") );
+    QCOMPARE(store.decryptFile("/b/bye.txt"),                 QByteArray("Bye World") );
+    QCOMPARE(store.fileMetadata("/b/hello.txt", "important"), QByteArray("k") );
+    QCOMPARE(store.fileSize("/gone.txt"),                     static_cast<quint64>(0) );
+    QCOMPARE(store.error,                                     Store::NoSuchFile);
+
+    store.remove("/");
+    QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/Store.journal");
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests Store#beginBatch, Store#commitBatch and Store#rollbackBatch
+ */
+void VoidTest::storeBatch()
+{
+    QString path     = QDir::current().filePath("void_store");
+    QString password = "pswd";
+
+    {
+        Store store(path, password, true);
+
+        QCOMPARE(store.error, Store::Success);
+
+        store.beginBatch();
+        store.addFileFromData("/a/hello.txt", "Hello World");
+        store.addFileFromData("/a/bye.txt",   "Bye World");
+        store.beginBatch();
+        store.addFileFromData("/keep.txt", "Keep");
+        store.commitBatch();
+
+        QCOMPARE(QFileInfo("void_store/Store.journal").size(), static_cast<qint64>(0) );
+
+        store.commitBatch();
+
+        QVERIFY(QFileInfo("void_store/Store.journal").size() > 0);
+
+        qint64 size  = QFileInfo("void_store/Store.journal").size();
+        int    parts = QDir("void_store").entryList(QDir::Files).size();
+
+        store.beginBatch();
+        store.addFileFromData("/new.txt", "New");
+        store.setFileMetadata( "/a/hello.txt", "important", QByteArray("k") );
+        store.move("/a", "/b");
+        store.remove("/keep.txt");
+
+        QCOMPARE(store.listAllFiles().size(), 3);
+
+        store.rollbackBatch();
+
+        QCOMPARE(QFileInfo("void_store/Store.journal").size(),          size);
+        QCOMPARE(QDir("void_store").entryList(QDir::Files).size(),      parts);
+        QCOMPARE(store.listAllFiles().size(),                           3);
+        QCOMPARE(store.decryptFile("/a/hello.txt"),                     QByteArray("Hello World") );
+        QCOMPARE(store.decryptFile("/keep.txt"),                        QByteArray("Keep") );
+        QCOMPARE(store.fileMetadata("/a/hello.txt", "important").size(), 0);
+
+        store.beginBatch();
+        store.remove("/keep.txt");
+        store.commitBatch();
+
+        QCOMPARE(QDir("void_store").entryList(QDir::Files).size(), parts - 1);
     }
 
-    ids = sfs.entryMatchRegExp(".*hello[0-9]?.txt");
-    QCOMPARE(ids.size(), 2);
-    for ( quint64 id : ids ) {
-        QStringList fpaths = {
-            "/folder/subdir/hello2.txt", "/dir/subdir/hello.txt"
-        };
+    Store store(path, password, false);
 
-        if ( id > ( ( static_cast<quint64> (1) ) << 63 ) ) {
-            QCOMPARE(false, true);
-        } else {
-            QCOMPARE(fpaths.contains(sfs.file(id)->path), true);
+    QCOMPARE(store.error,                       Store::Success);
+    QCOMPARE(store.listAllFiles().size(),       2);
+    QCOMPARE(store.decryptFile("/a/hello.txt"), QByteArray("Hello World") );
+    QCOMPARE(store.decryptFile("/a/bye.txt"),   QByteArray("Bye World") );
+
+    store.remove("/");
+    QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/Store.journal");
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests Store#setPersistDelay and Store#flush
+ */
+void VoidTest::storePersistDelay()
+{
+    QString path     = QDir::current().filePath("void_store");
+    QString password = "pswd";
+
+    {
+        Store store(path, password, true);
+
+        QCOMPARE(store.error, Store::Success);
+
+        store.setPersistDelay(60000);
+        QCOMPARE(store.persistDelay(), 60000);
+
+        store.addFileFromData("/hello.txt", "Hello World");
+        store.setFileMetadata( "/hello.txt", "important", QByteArray("k") );
+
+        QCOMPARE(QFileInfo("void_store/Store.journal").size(), static_cast<qint64>(0) );
+
+        store.flush();
+
+        qint64 size = QFileInfo("void_store/Store.journal").size();
+
+        QVERIFY(size > 0);
+
+        store.setFileMetadata( "/hello.txt", "important", QByteArray("l") );
+        store.addFileFromData("/bye.txt", "Bye World");
+
+        QCOMPARE(QFileInfo("void_store/Store.journal").size(), size);
+    }
+
+    Store store(path, password, false);
+
+    QCOMPARE(store.error,                                   Store::Success);
+    QCOMPARE(store.listAllFiles().size(),                   2);
+    QCOMPARE(store.fileMetadata("/hello.txt", "important"), QByteArray("l") );
+    QCOMPARE(store.decryptFile("/bye.txt"),                 QByteArray("Bye World") );
+
+    store.remove("/");
+    QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/Store.journal");
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests Store#setIndexCodec
+ */
+void VoidTest::storeIndexCodec()
+{
+    QString path     = QDir::current().filePath("void_store");
+    QString password = "pswd";
+
+    {
+        Store store(path, password, true);
+
+        QCOMPARE(store.error,        Store::Success);
+        QCOMPARE(store.indexCodec(), ZSTD);
+
+        store.addFileFromData("/hello.txt", "Hello World");
+        store.setIndexCodec(ZLIB);
+
+        QCOMPARE(store.indexCodec(), ZLIB);
+    }
+
+    {
+        StoreFile sf("void_store/Store.void");
+
+        QCOMPARE(sf.codec(), ZLIB);
+    }
+
+    // The segment rewritten with the new codec replaced the old file.
+    QCOMPARE(QDir("void_store").entryList(QStringList() << "Store.*.index").size(), 1);
+
+    {
+        Store store(path, password, false);
+
+        QCOMPARE(store.error,                     Store::Success);
+        QCOMPARE(store.indexCodec(),              ZLIB);
+        QCOMPARE(store.decryptFile("/hello.txt"), QByteArray("Hello World") );
+
+        store.setIndexCodec(ZSTD);
+    }
+
+    Store store(path, password, false);
+
+    QCOMPARE(store.error,                     Store::Success);
+    QCOMPARE(store.indexCodec(),              ZSTD);
+    QCOMPARE(store.decryptFile("/hello.txt"), QByteArray("Hello World") );
+
+    store.remove("/");
+    QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/Store.journal");
+
+    for ( QString shard : QDir("void_store").entryList(QStringList() << "Store.*.index") ) {
+        QFile::remove("void_store/" + shard);
+    }
+
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests that the index is written in segments, and that a
+ *  compaction only rewrites the segments that changed, to new files.
+ */
+void VoidTest::storeSegments()
+{
+    QString     path     = QDir::current().filePath("void_store");
+    QString     password = "pswd";
+    QStringList filter   = QStringList() << "Store.*.index";
+
+    {
+        Store store(path, password, true);
+
+        QCOMPARE(store.error, Store::Success);
+
+        store.addFileFromData("/a/1.txt",  "One");
+        store.addFileFromData("/b/2.txt",  "Two");
+        store.addFileFromData("/root.txt", "Root");
+
+        // Rewrites every segment.
+        store.setIndexCodec(ZSTD);
+    }
+
+    QStringList               shards = QDir("void_store").entryList(filter);
+    QMap<QString, QByteArray> before;
+
+    QCOMPARE(shards.size(), 3);
+
+    for (QString shard : shards) {
+        QFile file("void_store/" + shard);
+        file.open(QIODevice::ReadOnly);
+        before[shard] = file.readAll();
+    }
+
+    {
+        Store store(path, password, false);
+
+        QCOMPARE(store.error, Store::Success);
+
+        // Grows the journal past the size that triggers a compaction.
+        store.setFileMetadata( "/a/1.txt", "big", QByteArray(2 * 1048576, 'x') );
+    }
+
+    QStringList after     = QDir("void_store").entryList(filter);
+    int         unchanged = 0;
+
+    for (QString shard : shards) {
+        QFile file("void_store/" + shard);
+
+        if (file.open(QIODevice::ReadOnly) && (file.readAll() == before[shard])) {
+            unchanged++;
         }
     }
 
-    sfs.removeDir("/");
+    QCOMPARE(unchanged,                                    2);
+    QCOMPARE(after.size(),                                 3);
+    QVERIFY(after != shards);
+    QCOMPARE(QFileInfo("void_store/Store.journal").size(), static_cast<qint64>(0) );
 
+    Store store(path, password, false);
+
+    QCOMPARE(store.error,                                  Store::Success);
+    QCOMPARE(store.listAllFiles().size(),                  3);
+    QCOMPARE(store.fileMetadata("/a/1.txt", "big").size(), 2 * 1048576);
+    QCOMPARE(store.decryptFile("/b/2.txt"),                QByteArray("Two") );
+    QCOMPARE(store.decryptFile("/root.txt"),               QByteArray("Root") );
+
+    store.remove("/");
     QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/Store.journal");
+
+    for ( QString shard : QDir("void_store").entryList(filter) ) {
+        QFile::remove("void_store/" + shard);
+    }
+
     QDir::current().rmdir("void_store");
 }
 
 /**
- *  \brief Tests StoreFS#allFiles, StoreFS#allDirs and StoreFS#allEntries
+ *  \brief Tests that a segment whose file can't be read is reported, can't
+ *  be changed, and is never rewritten, so it's back once the file is.
  */
-void VoidTest::storeFSFetchAll()
+void VoidTest::storeUnreadableSegment()
 {
-    QDir::current().mkdir("void_store");
-    StoreFS sfs("void_store");
+    QString     path     = QDir::current().filePath("void_store");
+    QString     password = "pswd";
+    QStringList filter   = QStringList() << "Store.*.index";
 
-    QByteArray data = "Hello World";
+    {
+        Store store(path, password, true);
 
-    sfs.addFile("/dir/hello", data);
-    QCOMPARE(sfs.error, StoreFS::Success);
-    sfs.addFile("/dir/subdir/hello.txt", data);
-    QCOMPARE(sfs.error, StoreFS::Success);
-    sfs.addFile("/folder/subdir/hello2.txt", data);
-    QCOMPARE(sfs.error,                                   StoreFS::Success);
+        store.addFileFromData("/a/x.txt", "One");
+        store.addFileFromData("/b/x.txt", "Two");
 
-    QStringList paths = sfs.allDirs();
-    QCOMPARE(paths.size(),                                5);
-    QCOMPARE(paths.contains("/"),                         true);
-    QCOMPARE(paths.contains("/dir"),                      true);
-    QCOMPARE(paths.contains("/dir/subdir"),               true);
-    QCOMPARE(paths.contains("/folder"),                   true);
-    QCOMPARE(paths.contains("/folder/subdir"),            true);
+        // Writes both segments.
+        store.setIndexCodec(ZSTD);
+    }
 
-    paths = sfs.allFiles();
-    QCOMPARE(paths.size(),                                3);
-    QCOMPARE(paths.contains("/dir/hello"),                true);
-    QCOMPARE(paths.contains("/dir/subdir/hello.txt"),     true);
-    QCOMPARE(paths.contains("/folder/subdir/hello2.txt"), true);
+    QStringList shards = QDir("void_store").entryList(filter);
+    QFile       segment("void_store/" + shards.first() );
 
-    paths = sfs.allEntries();
-    QCOMPARE(paths.size(),                                8);
-    QCOMPARE(paths.contains("/"),                         true);
-    QCOMPARE(paths.contains("/dir"),                      true);
-    QCOMPARE(paths.contains("/dir/subdir"),               true);
-    QCOMPARE(paths.contains("/folder"),                   true);
-    QCOMPARE(paths.contains("/folder/subdir"),            true);
-    QCOMPARE(paths.contains("/dir/hello"),                true);
-    QCOMPARE(paths.contains("/dir/subdir/hello.txt"),     true);
-    QCOMPARE(paths.contains("/folder/subdir/hello2.txt"), true);
+    QCOMPARE(shards.size(), 2);
 
-    sfs.removeDir("/");
+    segment.open(QIODevice::ReadWrite);
+
+    QByteArray original = segment.readAll();
+    QByteArray garbage(original.size(), 'x');
+
+    segment.seek(0);
+    segment.write(garbage);
+    segment.close();
+
+    {
+        Store store(path, password, false);
+
+        QCOMPARE(store.error, Store::Success);
+
+        QString broken = store.decryptFile("/a/x.txt").isEmpty() ? "/a" : "/b";
+
+        QCOMPARE(store.decryptFile(broken + "/x.txt"), QByteArray() );
+        QCOMPARE(store.error,                          Store::IndexCorrupted);
+        QCOMPARE(store.listAllFiles().size(),          1);
 
+        store.addFileFromData(broken + "/y.txt", "New");
+        QCOMPARE(store.error, Store::IndexCorrupted);
+        store.remove(broken);
+        QCOMPARE(store.error, Store::IndexCorrupted);
+        store.setIndexCodec(ZLIB);
+        QCOMPARE(store.error, Store::IndexCorrupted);
+        QCOMPARE(store.indexCodec(), ZSTD);
+
+        store.addFileFromData("/c/x.txt", "Three");
+        QCOMPARE(store.error, Store::Success);
+
+        // Grows the journal past the size that triggers a compaction, which
+        // also gets every segment, as setIndexCodec marked them all.
+        store.setFileMetadata( "/c/x.txt", "big", QByteArray(2 * 1048576, 'x') );
+    }
+
+    QVERIFY(QDir("void_store").entryList(filter).contains(shards.first() ) );
+
+    segment.open(QIODevice::ReadWrite);
+    QCOMPARE(segment.readAll(), garbage);
+
+    segment.seek(0);
+    segment.write(original);
+    segment.close();
+
+    Store store(path, password, false);
+
+    QCOMPARE(store.error,                                  Store::Success);
+    QCOMPARE(store.listAllFiles().size(),                  3);
+    QCOMPARE(store.decryptFile("/a/x.txt"),                QByteArray("One") );
+    QCOMPARE(store.decryptFile("/b/x.txt"),                QByteArray("Two") );
+    QCOMPARE(store.fileMetadata("/c/x.txt", "big").size(), 2 * 1048576);
+
+    store.remove("/");
     QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/Store.journal");
+    QFile::remove("void_store/Store.journal.old");
+
+    for ( QString shard : QDir("void_store").entryList(filter) ) {
+        QFile::remove("void_store/" + shard);
+    }
+
     QDir::current().rmdir("void_store");
 }
 
 /**
- *  \brief Tests Store#Store
+ *  \brief Measures how long opening a large store and listing all of its
+ *  files takes, which reads and parses every segment of the index.
  */
-void VoidTest::storeCreate()
+void VoidTest::storeOpenLatency()
 {
     QString path     = QDir::current().filePath("void_store");
     QString password = "pswd";
 
-    Store store(path, password, false);
+    {
+        Store store(path, password, true);
 
-    QCOMPARE(store.error,                            Store::DoesntExistAndCreationIsNotPermitted);
+        QCOMPARE(store.error, Store::Success);
 
-    Store store2(path, password, true);
-    QCOMPARE(store2.error,                           Store::Success);
-    QCOMPARE(QFile::exists("void_store/Store.void"), true);
+        store.beginBatch();
+
+        for (int i = 0; i < 5000; i++) {
+            store.addFileFromData(QString("/dir%1/file%2.txt").arg(i % 50).arg(i), QByteArray::number(i) );
+        }
+
+        store.commitBatch();
 
+        // Writes every segment, so the journal is empty on open.
+        store.setIndexCodec(ZSTD);
+    }
+
+    QElapsedTimer timer;
+
+    timer.start();
+    Store  store(path, password, false);
+    qint64 open = timer.nsecsElapsed();
+
+    timer.restart();
+    QStringList files = store.listAllFiles();
+    qint64      list  = timer.nsecsElapsed();
+
+    QCOMPARE(store.error,  Store::Success);
+    QCOMPARE(files.size(), 5000);
+
+    qInfo("%d files in 50 segments: open %.2fms, list %.2fms", files.size(), open / 1e6, list / 1e6);
+
+    store.remove("/");
     QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/Store.journal");
+
+    for ( QString shard : QDir("void_store").entryList(QStringList() << "Store.*.index") ) {
+        QFile::remove("void_store/" + shard);
+    }
+
     QDir::current().rmdir("void_store");
 }
 
@@ -563,6 +2231,7 @@ void VoidTest::storeAddFile()
     store.remove("/");
 
     QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/Store.journal");
     QDir::current().rmdir("void_store");
 }
 
@@ -600,6 +2269,7 @@ void VoidTest::storeAddFileFromDisk()
 
     store.remove("/");
     QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/Store.journal");
     QFile::remove("void_store/hello.txt");
     QFile::remove("void_store/hello2.txt");
     QDir::current().rmdir("void_store");
@@ -647,6 +2317,54 @@ void VoidTest::storeRenameFile()
 
     store.remove("/");
     QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/Store.journal");
+    QDir::current().rmdir("void_store");
+}
+
+/**
+ *  \brief Tests that Store#move journals a directory in a single record,
+ *  even one whose files repeat its name further down, and that the move
+ *  survives a reopen.
+ */
+void VoidTest::storeMoveDir()
+{
+    QString path     = QDir::current().filePath("void_store");
+    QString password = "pswd";
+
+    {
+        Store store(path, password, true);
+
+        store.addFileFromData("/a/x/a/y.txt", "Y");
+        store.addFileFromData("/a/a.txt",     "A");
+
+        qint64 journaled = QFileInfo("void_store/Store.journal").size();
+
+        store.move("/a", "/b/");
+
+        // Smaller than the record of a single file.
+        QVERIFY(QFileInfo("void_store/Store.journal").size() - journaled < 200);
+
+        QCOMPARE(store.error,                       Store::Success);
+        QCOMPARE(store.decryptFile("/b/x/a/y.txt"), QByteArray("Y") );
+    }
+
+    Store store(path, password, false);
+
+    QCOMPARE(store.error,                       Store::Success);
+    QCOMPARE(store.listAllFiles().size(),       2);
+    QCOMPARE(store.decryptFile("/b/x/a/y.txt"), QByteArray("Y") );
+    QCOMPARE(store.decryptFile("/b/a.txt"),     QByteArray("A") );
+    QCOMPARE(store.decryptFile("/a/x/a/y.txt"), QByteArray() );
+    QCOMPARE(store.error,                       Store::NoSuchFile);
+
+    store.remove("/");
+    QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/Store.journal");
+
+    for ( QString shard : QDir("void_store").entryList(QStringList() << "Store.*.index") ) {
+        QFile::remove("void_store/" + shard);
+    }
+
     QDir::current().rmdir("void_store");
 }
 
@@ -695,6 +2413,7 @@ void VoidTest::storeFetchAll()
 
     store.remove("/");
     QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/Store.journal");
     QDir::current().rmdir("void_store");
 }
 
@@ -727,8 +2446,19 @@ void VoidTest::storeCheckMetadata()
     store.fileMetadata("/hello2.rb", "important");
     QCOMPARE(store.error, Store::NoSuchFile);
 
+    StoreFileDevice *device = store.create("/created.rb");
+
+    QVERIFY(device->open(QIODevice::WriteOnly));
+    device->write(data);
+    device->close();
+    delete device;
+
+    mimetype = mimedb.mimeTypeForName( store.fileMetadata("/created.rb", "mimetype") );
+    QCOMPARE(mimetype.inherits("application/x-ruby"), true);
+
     store.remove("/");
     QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/Store.journal");
     QDir::current().rmdir("void_store");
 }
 
@@ -767,6 +2497,7 @@ void VoidTest::storeListEntries()
 
     store.remove("/");
     QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/Store.journal");
     QDir::current().rmdir("void_store");
 }
 
@@ -890,6 +2621,7 @@ void VoidTest::storeSearch()
 
     store.remove("/");
     QFile::remove("void_store/Store.void");
+    QFile::remove("void_store/Store.journal");
     QDir::current().rmdir("void_store");
 }
 
@@ -36,23 +36,56 @@ private slots:
     void cryptoFromB64();
     void cryptoEncrypt();
     void cryptoDecrypt();
+    void cryptoEncryptStream();
+    void cryptoDecryptStream();
+    void cryptoCallerBuffers();
+    void cryptoDigest();
+    void cryptoFileDigest();
 
     void storeFileCreateAndLoadStore();
+    void storeFileCodecs();
+    void storeFileCodecsBenchmark();
 
     void storeFSMakePath();
     void storeFSAddFile();
     void storeFSAddFileFromDisk();
+    void storeFSAddMultiPartFile();
+    void storeFSIdenticalParts();
+    void storeFSDecryptCorruptedPart();
+    void storeFSOpen();
+    void storeFSCreate();
+    void storeFSPartFormats();
     void storeFSRemoveFile();
     void storeFSRemoveDir();
     void storeFSRenameFile();
     void storeFSRenameDir();
+    void storeFSMoveDir();
+    void storeFSWideDir();
+    void storeFSRelease();
     void storeFSFilters();
     void storeFSFetchAll();
+    void storeFSSerialize();
+    void storeFSIndex();
+    void storeFSPartList();
+    void storeFSNodeTable();
+    void storeFSPathTrie();
+    void storeFSTrigramIndex();
+    void storeFSTrigramIndexBenchmark();
+    void storeFSRegExp();
+    void storeFSSegments();
 
     void storeCreate();
+    void storeJournal();
+    void storeBatch();
+    void storePersistDelay();
+    void storeIndexCodec();
+    void storeSegments();
+    void storeUnreadableSegment();
+    void storeOpenLatency();
     void storeAddFile();
     void storeAddFileFromDisk();
     void storeRenameFile();
+    void storeMoveDir();
     void storeFetchAll();
     void storeCheckMetadata();
     void storeListEntries();
@@ -20,22 +20,36 @@ MOC_DIR     = ../moc
 
 INCLUDEPATH += $$PWD/../src
 CONFIG += link_pkgconfig
-PKGCONFIG += nss openssl
+PKGCONFIG += nss openssl libzstd
 
 unix {
     LIBS += $$OBJECTS_DIR/Crypto.o \
             $$OBJECTS_DIR/StoreFS.o \
+            $$OBJECTS_DIR/StoreFSIndex.o \
+            $$OBJECTS_DIR/StoreFSPartList.o \
+            $$OBJECTS_DIR/StoreFSPathTrie.o \
+            $$OBJECTS_DIR/StoreFSTrigramIndex.o \
             $$OBJECTS_DIR/moc_Store.o \
             $$OBJECTS_DIR/Store.o \
-            $$OBJECTS_DIR/StoreFile.o
+            $$OBJECTS_DIR/StoreFile.o \
+            $$OBJECTS_DIR/Runner.o \
+            $$OBJECTS_DIR/StoreFileDevice.o \
+            $$OBJECTS_DIR/moc_StoreFileDevice.o
 }
 
 win32 {
     LIBS += $$OBJECTS_DIR/Crypto.obj \
             $$OBJECTS_DIR/StoreFS.obj \
+            $$OBJECTS_DIR/StoreFSIndex.obj \
+            $$OBJECTS_DIR/StoreFSPartList.obj \
+            $$OBJECTS_DIR/StoreFSPathTrie.obj \
+            $$OBJECTS_DIR/StoreFSTrigramIndex.obj \
             $$OBJECTS_DIR/moc_Store.obj \
             $$OBJECTS_DIR/Store.obj \
-            $$OBJECTS_DIR/StoreFile.obj
+            $$OBJECTS_DIR/StoreFile.obj \
+            $$OBJECTS_DIR/Runner.obj \
+            $$OBJECTS_DIR/StoreFileDevice.obj \
+            $$OBJECTS_DIR/moc_StoreFileDevice.obj
 }
 
 HEADERS = VoidTest.h